@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include "hotplug.h"
+#include "log.h"
+
+#define UEVENT_BUFSIZE 8192
+#define SYSFS_TTY "/sys/class/tty/"
+
+
+int hotplug_open(void) {
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		LOG(0,"hotplug: unable to create netlink socket (%s)\n",strerror(errno));
+		return HOTPLUG_ERR;
+	}
+	memset(&addr,0,sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;			// kernel events, udev rebroadcasts on group 2
+	if (bind(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0) {
+		LOG(0,"hotplug: unable to bind netlink socket (%s)\n",strerror(errno));
+		close(fd);
+		return HOTPLUG_ERR;
+	}
+	return fd;
+}
+
+
+void hotplug_close(int fd) {
+	if (fd >= 0) close(fd);
+}
+
+
+int hotplug_read(int fd, HOTPLUG_EventT *ev) {
+	char buf[UEVENT_BUFSIZE];
+	struct sockaddr_nl addr;
+	socklen_t addrLen = sizeof(addr);
+	const char *action = NULL;
+	const char *subsystem = NULL;
+	const char *devname = NULL;
+	char *p,*end;
+	ssize_t len;
+
+	len = recvfrom(fd,buf,sizeof(buf)-1,0,(struct sockaddr *)&addr,&addrLen);
+	if (len <= 0) return HOTPLUG_ERR;
+	if (addr.nl_pid != 0) return 0;			// not sent by the kernel
+	buf[len] = 0;
+
+	// "action@devpath" followed by KEY=value strings, each terminated by \0
+	end = buf + len;
+	for (p = buf + strlen(buf) + 1; p < end; p += strlen(p) + 1) {
+		if (strncmp(p,"ACTION=",7) == 0) action = p+7;
+		else if (strncmp(p,"SUBSYSTEM=",10) == 0) subsystem = p+10;
+		else if (strncmp(p,"DEVNAME=",8) == 0) devname = p+8;
+	}
+	if (!action || !subsystem || !devname) return 0;
+	if (strcmp(subsystem,"tty") != 0) return 0;
+
+	if (strcmp(action,"add") == 0) ev->action = HOTPLUG_ADD;
+	else if (strcmp(action,"remove") == 0) ev->action = HOTPLUG_REMOVE;
+	else return 0;
+
+	p = strrchr(devname,'/');				// DEVNAME may be relative to /dev
+	if (p) devname = p+1;
+	strncpy(ev->devname,devname,sizeof(ev->devname)-1);
+	ev->devname[sizeof(ev->devname)-1] = 0;
+	VPRINTF(2,"hotplug: %s %s\n",action,ev->devname);
+	return 1;
+}
+
+
+int hotplug_getDevname(const char *portname, char *devname, int devnameLen) {
+	char real[PATH_MAX];
+	const char *p;
+
+	if (realpath(portname,real)) portname = real;
+	p = strrchr(portname,'/');
+	if (p) p++; else p = portname;
+	if ((int)strlen(p) >= devnameLen) return HOTPLUG_ERR;
+	strcpy(devname,p);
+	return HOTPLUG_OK;
+}
+
+
+// read a single line sysfs attribute, returns HOTPLUG_ERR if it does not exist
+static int readAttr(const char *dir, const char *name, char *buf, int len) {
+	char path[PATH_MAX+32];
+	FILE *f;
+
+	snprintf(path,sizeof(path),"%s/%s",dir,name);
+	f = fopen(path,"r");
+	if (!f) return HOTPLUG_ERR;
+	if (!fgets(buf,len,f)) buf[0] = 0;
+	fclose(f);
+	buf[strcspn(buf,"\r\n")] = 0;
+	return HOTPLUG_OK;
+}
+
+
+int hotplug_getAdapterId(const char *portname, char *id, int idLen) {
+	char devname[HOTPLUG_DEVNAMELEN];
+	char path[PATH_MAX];
+	char dir[PATH_MAX];
+	char vendor[16],product[16],serial[64];
+	char *p;
+
+	if (hotplug_getDevname(portname,devname,sizeof(devname)) != HOTPLUG_OK) return HOTPLUG_ERR;
+	snprintf(path,sizeof(path),SYSFS_TTY "%s/device",devname);
+	if (!realpath(path,dir)) return HOTPLUG_ERR;
+
+	// walk up from the usb interface to the usb device
+	while (readAttr(dir,"idVendor",vendor,sizeof(vendor)) != HOTPLUG_OK) {
+		p = strrchr(dir,'/');
+		if (!p || p == dir) return HOTPLUG_ERR;
+		*p = 0;
+	}
+	if (readAttr(dir,"idProduct",product,sizeof(product)) != HOTPLUG_OK) return HOTPLUG_ERR;
+
+	if (readAttr(dir,"serial",serial,sizeof(serial)) == HOTPLUG_OK && serial[0])
+		snprintf(id,idLen,"%s:%s:%s",vendor,product,serial);
+	else
+		snprintf(id,idLen,"%s:%s@%s",vendor,product,strrchr(dir,'/')+1);
+	return HOTPLUG_OK;
+}
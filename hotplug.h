@@ -0,0 +1,42 @@
+#ifndef HOTPLUG_H_INCLUDED
+#define HOTPLUG_H_INCLUDED
+
+/*
+ * kernel uevent listener for usb serial adapters
+ *
+ * the id of an adapter is built from the usb descriptors found in sysfs,
+ * vendor:product:serial or, if the adapter has no serial number,
+ * vendor:product@usb-port. It does not change when the adapter is
+ * plugged in again, even if the tty name changes (ttyUSB0 -> ttyUSB1)
+ */
+
+#define HOTPLUG_OK 0
+#define HOTPLUG_ERR -1
+
+#define HOTPLUG_ADD 1
+#define HOTPLUG_REMOVE 2
+
+#define HOTPLUG_IDLEN 128
+#define HOTPLUG_DEVNAMELEN 32
+
+typedef struct {
+	int action;								// HOTPLUG_ADD or HOTPLUG_REMOVE
+	char devname[HOTPLUG_DEVNAMELEN];		// kernel name of the tty, e.g. ttyUSB0
+} HOTPLUG_EventT;
+
+// open a non-blocking netlink socket receiving kernel uevents, returns the fd or HOTPLUG_ERR
+int hotplug_open(void);
+
+void hotplug_close(int fd);
+
+// read one uevent without blocking, returns 1 for tty add/remove events (stored in ev),
+// 0 for other events and HOTPLUG_ERR if no event was available
+int hotplug_read(int fd, HOTPLUG_EventT *ev);
+
+// kernel name of the tty portname points to (symlinks are resolved), e.g. ttyUSB0
+int hotplug_getDevname(const char *portname, char *devname, int devnameLen);
+
+// get the id of the usb adapter portname belongs to, HOTPLUG_ERR if it is not an usb device
+int hotplug_getAdapterId(const char *portname, char *id, int idLen);
+
+#endif // HOTPLUG_H_INCLUDED
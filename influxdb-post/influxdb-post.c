@@ -25,8 +25,15 @@
 #include "../log.h"
 #include <inttypes.h>
 #include <assert.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
 #include <time.h>
 #include<signal.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include <pthread.h>
 
 #define INFLUX_TIMEOUT_SECONDS 5
 #define INFLUX_DEQUEUE_AT_ONCE 50
@@ -56,7 +63,11 @@
 int _format_line(influx_client_t* c, va_list ap);
 int send_udp_line(influx_client_t* c, char *line, int len);
 int _format_line2(influx_client_t* c, va_list ap);
-int _escaped_append(influx_client_t* c, const char* src, const char* escape_seq);
+int _escaped_append(influx_client_t* c, const char* src, int escape);
+#ifdef INFLUXDB_POST_LIBCURL
+static void curlShareAttach(CURL *ch);
+static void curlCleanup(CURL *ch);
+#endif
 
 influx_client_t* influxdb_post_init (char* host, int port, char* db, char* user, char* pwd, char * org, char *bucket, char *token, int numQueueEntries, char *api
 #ifdef INFLUXDB_POST_LIBCURL
@@ -79,10 +90,20 @@ influx_client_t* influxdb_post_init (char* host, int port, char* db, char* user,
     if (token) i->token=strdup(token);
     if (api) i->apiStr=strdup(api);
     i->maxNumEntriesToQueue=numQueueEntries;
+    i->maxQueueBytes = INFLUX_QUEUE_MAX_BYTES;
+    i->maxPostBytes = INFLUX_POST_MAX_BYTES;
     i->lastNeededBufferSize = INFLUX_INITIAL_BUF_SIZE;
     i->firstConnectionAttempt = 1;
 #ifdef INFLUXDB_POST_LIBCURL
 	i->ssl_verifypeer = SSL_VerifyPeer;
+	if (getTransportProto(i->host) == proto_tcp) {
+		if (port == 0) i->port = INFLUX_TCP_PORT;
+		i->tcp = influxdb_tcp_init(strstr(i->host,"://") + 3, i->port, 1, 0);
+		if (!i->tcp) {
+			influxdb_post_free(i);
+			return NULL;
+		}
+	}
 #endif
     return i;
 }
@@ -112,6 +133,7 @@ void influxdb_post_freeBuffer(influx_client_t *c) {
 }
 
 void influxdb_post_deInit(influx_client_t *c) {
+     if (c->wal) influxdb_post_closeDiskQueue(c);   // kept for the next start
      while (influxdb_deQueue(c) > 0) {};
 #ifndef INFLUXDB_POST_LIBCURL
      if(c->ainfo) {
@@ -127,6 +149,12 @@ void influxdb_post_free(influx_client_t *c) {
 	if (c) {
 		influxdb_post_deInit(c);
 		influxdb_post_freeBuffer(c);
+		while (c->numEntriesQueued) {
+			free(c->queue[c->queueFirst]);
+			c->queueFirst = (c->queueFirst + 1) % c->queueSize;
+			c->numEntriesQueued--;
+		}
+		free(c->queue);
 		free(c->host);
 		free(c->db);
 		free(c->usr);
@@ -138,7 +166,15 @@ void influxdb_post_free(influx_client_t *c) {
 #ifdef INFLUXDB_POST_LIBCURL
 		free(c->url);
 		if (c->ch_headers) curl_slist_free_all(c->ch_headers);
-		if (c->ch) curl_easy_cleanup(c->ch);
+		if (c->ch_headers_gzip) curl_slist_free_all(c->ch_headers_gzip);
+#ifdef HAVE_ZLIB
+		if (c->zstream) deflateEnd((z_stream *)c->zstream);
+		free(c->zstream);
+#endif
+		free(c->gzBuf);
+		if (c->ch) curlCleanup(c->ch);
+		if (c->chProbe) curlCleanup(c->chProbe);
+		influxdb_tcp_free(c->tcp);
 #endif
 		free(c);
 	}
@@ -198,65 +234,110 @@ int _format_line(influx_client_t* c, va_list ap) {
 }
 
 
-int appendToBuf2 (char **buf, size_t *used, size_t *bufLen, char *src) {
-    int srcLen = strlen(src);
-    if (*used+srcLen+1 > *bufLen) {
-        *bufLen = (*bufLen * 2) + srcLen;
-        *buf = (char*)realloc(*buf, *bufLen);
-        if (*buf == NULL) {
-            LOGN(0,"failed to expand buffer to %zu (used: %zu, slen: %d)\n",*bufLen,*used,srcLen);
-            return -1;
-        }
-        //printf("appendToBuf, after realloc\n>'%s'<\n",*buf);
+// grow the buffer for n more chars plus the terminating 0
+static inline int ensureSpace(influx_client_t* c, size_t n) {
+    size_t len = c->influxBufLen;
+    char *buf;
+
+    if (!c->influxBuf) return -1;
+    if (c->influxBufUsed + n + 1 <= len) return 0;
+    while (c->influxBufUsed + n + 1 > len) len *= 2;
+    buf = (char*)realloc(c->influxBuf, len);
+    if (!buf) {
+        LOGN(0,"failed to expand buffer to %zu (used: %zu, needed: %zu)\n",len,c->influxBufUsed,n);
+        return -1;
     }
+    c->influxBuf = buf;
+    c->influxBufLen = len;
+    return 0;
+}
 
-    strcpy(*buf + *used,src);
-    //printf("buf: %s\n", *buf);
-    *used+=srcLen;
-    return srcLen;
+static inline int appendStr(influx_client_t* c, const char *src, size_t len) {
+    if (ensureSpace(c, len) < 0) return -1;
+    memcpy(c->influxBuf + c->influxBufUsed, src, len);
+    c->influxBufUsed += len;
+    c->influxBuf[c->influxBufUsed] = 0;
+    return 0;
+}
+
+static inline int appendChar(influx_client_t* c, char ch) {
+    return appendStr(c, &ch, 1);
 }
 
-int appendToBuf (influx_client_t* c, char * src) {
-	return appendToBuf2 (&c->influxBuf, &c->influxBufUsed, &c->influxBufLen, src);
+// %lld with an optional suffix, e.g. 'i' for integer fields
+static int appendInt(influx_client_t* c, int64_t v, char suffix) {
+    char tmp[24], *t = tmp + sizeof(tmp);
+    uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+
+    if (suffix) *--t = suffix;
+    do { *--t = '0' + u % 10; u /= 10; } while (u);
+    if (v < 0) *--t = '-';
+    return appendStr(c, t, tmp + sizeof(tmp) - t);
 }
 
 #define MAX_FIELD_LENGTH 255
+#define FMT_MAX_PREC 9
+#define FMT_MAX_EXACT 9007199254740992.0        // 2^53, larger values are formatted by snprintf
+
+static const double pow10tab[FMT_MAX_PREC+1] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+
+// same result as %.*lf, scaled to an integer and written without snprintf. Values close to
+// half a digit, huge values, nan and inf are left to snprintf, it rounds the exact binary value
+static int appendDouble(influx_client_t* c, double d, int prec) {
+    char tmp[48], *t = tmp + sizeof(tmp);
+    double x, f;
+    uint64_t r;
+    int k, n;
+
+    if ((prec >= 0) && (prec <= FMT_MAX_PREC)) {
+        x = (d < 0 ? -d : d) * pow10tab[prec];
+        if (x < FMT_MAX_EXACT) {
+            r = (uint64_t)x;
+            f = x - r;
+            if ((f - 0.5 > x * DBL_EPSILON) || (0.5 - f > x * DBL_EPSILON)) {
+                if (f > 0.5) r++;
+                for (k=0;k<prec;k++) { *--t = '0' + r % 10; r /= 10; }
+                if (prec) *--t = '.';
+                do { *--t = '0' + r % 10; r /= 10; } while (r);
+                if (signbit(d)) *--t = '-';
+                return appendStr(c, t, tmp + sizeof(tmp) - t);
+            }
+        }
+    }
+    if (ensureSpace(c, MAX_FIELD_LENGTH) < 0) return -1;
+    n = snprintf(c->influxBuf + c->influxBufUsed, MAX_FIELD_LENGTH, "%.*lf", prec, d);
+    if ((n < 0) || (n >= MAX_FIELD_LENGTH)) {
+        c->influxBuf[c->influxBufUsed] = 0;
+        return -1;
+    }
+    c->influxBufUsed += n;
+    return 0;
+}
 
 
+// chars escaped with a backslash, _escaped_append escapes the ones with one of the bits given
+#define ESC_MEAS 1        // measurement: comma and space
+#define ESC_KEY  2        // tag keys, tag values and field keys: comma, equals sign and space
+#define ESC_STR  4        // string field values: double quote
+
+static const uint8_t escapeTable[256] = {
+    [','] = ESC_MEAS | ESC_KEY,
+    [' '] = ESC_MEAS | ESC_KEY,
+    ['='] = ESC_KEY,
+    ['"'] = ESC_STR };
+
 
 int _format_line2(influx_client_t* c, va_list ap)
 {
-#if 0
-#define _APPEND(fmter...) \
-    for(;;) {\
-        if((written = snprintf(*buf + used, len - used, ##fmter)) < 0)\
-            goto FAIL;\
-        if(used + written > len && !(*buf = (char*)realloc(*buf, len *= 2)))\
-            return -1;\
-        else {\
-            used += written;\
-            break;\
-        }\
-    }
-#endif // 0
-
-#define _APPEND(fmter...) {\
-        if (snprintf(&tempStr[0],MAX_FIELD_LENGTH, ##fmter) >= MAX_FIELD_LENGTH) goto FAIL; \
-        if (appendToBuf (c, &tempStr[0]) < 0) goto FAIL; \
-		}
+#define _APPEND(s) { if (appendStr(c, s, sizeof(s)-1) < 0) goto FAIL; }
 
-//    size_t len = *_len;
     int type = 0;
-    uint64_t i = 0;
+    int64_t i = 0;
     double d = 0.0;
-    char tempStr[MAX_FIELD_LENGTH+1];
 
     if (c->influxBuf == NULL) {
-	    _begin_line(c);
-	    //used = 0;
+	    if (_begin_line(c) < 0) return -1;
 	    c->last_type = 0;
-//	} else {
-//		last_type = IF_TYPE_FIELD_BOOLEAN; // ad 2.12.2021
 	}
 
     type = va_arg(ap, int);
@@ -264,8 +345,8 @@ int _format_line2(influx_client_t* c, va_list ap)
         if(type >= IF_TYPE_TAG && type <= IF_TYPE_FIELD_BOOLEAN) {
             if(c->last_type < IF_TYPE_MEAS || c->last_type > (type == IF_TYPE_TAG ? IF_TYPE_TAG : IF_TYPE_FIELD_BOOLEAN))
                 goto FAIL;
-            _APPEND("%c", (c->last_type <= IF_TYPE_TAG && type > IF_TYPE_TAG) ? ' ' : ',');
-            if(_escaped_append(c, va_arg(ap, char*), ",= ")) return -2;
+            if (appendChar(c, (c->last_type <= IF_TYPE_TAG && type > IF_TYPE_TAG) ? ' ' : ',') < 0) goto FAIL;
+            if(_escaped_append(c, va_arg(ap, char*), ESC_KEY)) return -2;
             _APPEND("=");
         }
         switch(type) {
@@ -273,43 +354,45 @@ int _format_line2(influx_client_t* c, va_list ap)
                 if(c->last_type) _APPEND("\n");
                 if(c->last_type && c->last_type <= IF_TYPE_TAG)
                     goto FAIL;
-                if(_escaped_append(c, va_arg(ap, char*), ", "))
+                if(_escaped_append(c, va_arg(ap, char*), ESC_MEAS))
                     return -3;
                 break;
             case IF_TYPE_TAG:
-                if(_escaped_append(c, va_arg(ap, char*), ",= "))
+                if(_escaped_append(c, va_arg(ap, char*), ESC_KEY))
                     return -4;
                 break;
             case IF_TYPE_FIELD_STRING:
                 _APPEND("\"");
-                if(_escaped_append(c, va_arg(ap, char*), "\""))
+                if(_escaped_append(c, va_arg(ap, char*), ESC_STR))
                     return -5;
                 _APPEND("\"");
                 break;
             case IF_TYPE_FIELD_FLOAT:
                 d = va_arg(ap, double);
                 i = va_arg(ap, int);
-                _APPEND("%.*lf", (int)i, d);
+                if (appendDouble(c, d, (int)i) < 0) goto FAIL;
                 break;
             case IF_TYPE_FIELD_INTEGER:
                 i = va_arg(ap, long long);
-                _APPEND("%" PRId64 "i", i);    //"%lldi", i);
+                if (appendInt(c, i, 'i') < 0) goto FAIL;
                 break;
             case IF_TYPE_FIELD_BOOLEAN:
                 i = va_arg(ap, int);
-                _APPEND("%c", i ? 't' : 'f');
+                if (appendChar(c, i ? 't' : 'f') < 0) goto FAIL;
                 break;
             case IF_TYPE_TIMESTAMP:
                 if(c->last_type < IF_TYPE_FIELD_STRING || c->last_type > IF_TYPE_FIELD_BOOLEAN)
                     goto FAIL;
                 i = va_arg(ap, long long);
-                _APPEND(" %" PRId64, i);
+                _APPEND(" ");
+                if (appendInt(c, i, 0) < 0) goto FAIL;
                 break;
             case IF_TYPE_TIMESTAMP_NOW:
                 if(c->last_type < IF_TYPE_FIELD_STRING || c->last_type > IF_TYPE_FIELD_BOOLEAN)
                     goto FAIL;
                 i = influxdb_getTimestamp();
-                _APPEND(" %" PRId64, i);
+                _APPEND(" ");
+                if (appendInt(c, i, 0) < 0) goto FAIL;
                 break;
             default:
                 goto FAIL;
@@ -322,7 +405,6 @@ int _format_line2(influx_client_t* c, va_list ap)
     if(c->last_type <= IF_TYPE_TAG)
         goto FAIL;
 #endif
-    //*_len = len;
     return 0;
 FAIL:
 	influxdb_post_freeBuffer(c);
@@ -330,30 +412,202 @@ FAIL:
 }
 #undef _APPEND
 
-int _escaped_append(influx_client_t * c, const char* src, const char* escape_seq)
+// escape is one or more of ESC_x, the worst case (all chars escaped) is reserved at once
+int _escaped_append(influx_client_t * c, const char* src, int escape)
 {
-    size_t i = 0;
-
-    for(;;) {
-        if((i = strcspn(src, escape_seq)) > 0) {
-            if(c->influxBufUsed + i > c->influxBufLen && !(c->influxBuf = (char*)realloc(c->influxBuf, (c->influxBufLen) *= 2)))
-                return -1;
-            strncpy(c->influxBuf + c->influxBufUsed, src, i);
-            c->influxBufUsed += i;
-            src += i;
-        }
-        if(*src) {
-            if(c->influxBufUsed + 2 > c->influxBufLen && !(c->influxBuf = (char*)realloc(c->influxBuf, (c->influxBufLen) *= 2)))
-                return -2;
-            (c->influxBuf)[(c->influxBufUsed)++] = '\\';
-            (c->influxBuf)[(c->influxBufUsed)++] = *src++;
+    char *p;
+
+    if (ensureSpace(c, strlen(src) * 2) < 0) return -1;
+    p = c->influxBuf + c->influxBufUsed;
+    for (; *src; src++) {
+        if (escapeTable[(uint8_t)*src] & escape) *p++ = '\\';
+        *p++ = *src;
+    }
+    *p = 0;
+    c->influxBufUsed = p - c->influxBuf;
+    return 0;
+}
+
+
+typedef struct {
+    char *key;              // escaped, with the separator before and the equals sign
+    size_t len;
+    char *name;             // as given, for sorting
+    int type;
+    int precision;
+    int index;              // in the values array
+} influx_tfield_t;
+
+typedef struct {
+    char *key;
+    char *value;
+} influx_ttag_t;
+
+struct influx_template_s {
+    char *measurement;
+    int numTags;
+    influx_ttag_t *tags;
+    int numFields;
+    influx_tfield_t *fields;
+    char *prefix;           // escaped measurement and sorted tags, NULL until compiled
+    size_t prefixLen;
+};
+
+influx_template_t * influxdb_template_new(const char *measurement) {
+    influx_template_t *t = calloc(1, sizeof(*t));
+
+    if (!t) return NULL;
+    t->measurement = strdup(measurement);
+    if (!t->measurement) { free(t); return NULL; }
+    return t;
+}
+
+void influxdb_template_free(influx_template_t *t) {
+    int i;
+
+    if (!t) return;
+    for (i=0;i<t->numTags;i++) { free(t->tags[i].key); free(t->tags[i].value); }
+    for (i=0;i<t->numFields;i++) { free(t->fields[i].key); free(t->fields[i].name); }
+    free(t->tags);
+    free(t->fields);
+    free(t->measurement);
+    free(t->prefix);
+    free(t);
+}
+
+int influxdb_template_tag(influx_template_t *t, const char *key, const char *value) {
+    influx_ttag_t *tags = realloc(t->tags, sizeof(*tags) * (t->numTags+1));
+
+    if (!tags) return -1;
+    t->tags = tags;
+    tags[t->numTags].key = strdup(key);
+    tags[t->numTags].value = strdup(value);
+    if (!tags[t->numTags].key || !tags[t->numTags].value) {
+        free(tags[t->numTags].key);
+        free(tags[t->numTags].value);
+        return -1;
+    }
+    t->numTags++;
+    free(t->prefix);
+    t->prefix = NULL;
+    return 0;
+}
+
+int influxdb_template_field(influx_template_t *t, const char *key, int type, int precision) {
+    influx_tfield_t *fields, *f;
+
+    if (type != IF_TYPE_FIELD_FLOAT && type != IF_TYPE_FIELD_INTEGER && type != IF_TYPE_FIELD_BOOLEAN) return -1;
+    fields = realloc(t->fields, sizeof(*fields) * (t->numFields+1));
+    if (!fields) return -1;
+    t->fields = fields;
+    f = &fields[t->numFields];
+    memset(f, 0, sizeof(*f));
+    f->name = strdup(key);
+    if (!f->name) return -1;
+    f->type = type;
+    f->precision = precision;
+    f->index = t->numFields;
+    free(t->prefix);
+    t->prefix = NULL;
+    return t->numFields++;
+}
+
+int influxdb_template_numFields(influx_template_t *t) {
+    return t->numFields;
+}
+
+// escape src to dst (at least 2*strlen(src)+1), returns the length
+static size_t escapeTo(char *dst, const char *src, int escape) {
+    char *p = dst;
+
+    for (; *src; src++) {
+        if (escapeTable[(uint8_t)*src] & escape) *p++ = '\\';
+        *p++ = *src;
+    }
+    *p = 0;
+    return p - dst;
+}
+
+static int cmpTag(const void *a, const void *b) {
+    return strcmp(((const influx_ttag_t *)a)->key, ((const influx_ttag_t *)b)->key);
+}
+
+static int cmpField(const void *a, const void *b) {
+    return strcmp(((const influx_tfield_t *)a)->name, ((const influx_tfield_t *)b)->name);
+}
+
+// sort tags and fields by key (strcmp compares as bytes.Compare does) and build the escaped strings
+static int compileTemplate(influx_template_t *t) {
+    size_t len = strlen(t->measurement) * 2 + 1;
+    influx_tfield_t *f;
+    char *p;
+    int i;
+
+    if (t->numFields == 0) return -1;
+    for (i=0;i<t->numTags;i++) len += (strlen(t->tags[i].key) + strlen(t->tags[i].value)) * 2 + 2;
+    t->prefix = malloc(len);
+    if (!t->prefix) return -1;
+    qsort(t->tags, t->numTags, sizeof(*t->tags), cmpTag);
+    p = t->prefix;
+    p += escapeTo(p, t->measurement, ESC_MEAS);
+    for (i=0;i<t->numTags;i++) {
+        *p++ = ',';
+        p += escapeTo(p, t->tags[i].key, ESC_KEY);
+        *p++ = '=';
+        p += escapeTo(p, t->tags[i].value, ESC_KEY);
+    }
+    t->prefixLen = p - t->prefix;
+
+    qsort(t->fields, t->numFields, sizeof(*t->fields), cmpField);
+    for (i=0;i<t->numFields;i++) {
+        f = &t->fields[i];
+        free(f->key);
+        f->key = malloc(strlen(f->name) * 2 + 3);
+        if (!f->key) { free(t->prefix); t->prefix = NULL; return -1; }
+        f->key[0] = i ? ',' : ' ';
+        f->len = escapeTo(f->key + 1, f->name, ESC_KEY) + 1;
+        f->key[f->len++] = '=';
+        f->key[f->len] = 0;
+    }
+    return 0;
+}
+
+int influxdb_template_line(influx_client_t* c, influx_template_t *t, const influx_value_t *values, long long timestamp) {
+    const influx_value_t *v;
+    influx_tfield_t *f;
+    int rc;
+
+    if (!t->prefix && compileTemplate(t) < 0) return -1;
+    if (c->influxBuf == NULL) {
+        if (_begin_line(c) < 0) return -1;
+        c->last_type = 0;
+    } else if (c->last_type && c->last_type <= IF_TYPE_TAG)
+        goto FAIL;              // an unfinished line of influxdb_format_line
+
+    if (c->last_type && appendChar(c, '\n') < 0) goto FAIL;
+    if (appendStr(c, t->prefix, t->prefixLen) < 0) goto FAIL;
+    for (f = t->fields; f < t->fields + t->numFields; f++) {
+        if (appendStr(c, f->key, f->len) < 0) goto FAIL;
+        v = &values[f->index];
+        switch (f->type) {
+            case IF_TYPE_FIELD_FLOAT: rc = appendDouble(c, v->f, f->precision); break;
+            case IF_TYPE_FIELD_INTEGER: rc = appendInt(c, v->i, 'i'); break;
+            default: rc = appendChar(c, v->i ? 't' : 'f');
         }
-        else
-            return 0;
+        if (rc < 0) goto FAIL;
+    }
+    c->last_type = IF_TYPE_FIELD_BOOLEAN;
+    if (timestamp) {
+        if (appendChar(c, ' ') < 0 || appendInt(c, timestamp, 0) < 0) goto FAIL;
+        c->last_type = IF_TYPE_TIMESTAMP;
     }
     return 0;
+FAIL:
+    influxdb_post_freeBuffer(c);
+    return -1;
 }
 
+
 #ifndef INFLUXDB_POST_LIBCURL
 int resolvHostname (influx_client_t *c) {
     int res;
@@ -505,7 +759,7 @@ int post_http_send_line(influx_client_t *c, char *buf, int len)
         LOGN(0, "influxdb-c::post_http: iv[0] = '%s'\n", (char *)iv[0].iov_base);
         LOGN(0, "influxdb-c::post_http: iv[1] = '%s'\n", (char *)iv[1].iov_base);
     } else
-    if (log_verbosity>1) {
+    if (log_getVerboseLevel()>1) {
         LOGN(1,"post_http_send_line: statusCode: %d, line: %s\n",ret_code,buf);
     } else
 		if (ret_code != 204) LOGN(0,"post_http_send_line: statusCode: %d\n",ret_code);
@@ -524,8 +778,8 @@ END:
 
 
 
-int protoPrefixLen[] = {4,5,2,3,0,0};
-const char * protocolsStr[] = {"http","https","ws","wss",NULL,NULL};
+int protoPrefixLen[] = {4,5,2,3,3,0,0};
+const char * protocolsStr[] = {"http","https","ws","wss","tcp",NULL,NULL};
 
 const char *getTransportProtoStr(transport_proto_t t) {
 	if (t < 0 || t > proto_unknown) return NULL;
@@ -583,7 +837,7 @@ static int curlDebugCallback(CURL *handle, curl_infotype type, char *data, size_
   (void)handle; /* prevent compiler warning */
   (void)clientp;
 
-  if (verbose <3) return 0;
+  if (log_getVerboseLevel() <3) return 0;
   switch(type) {
 	case CURLINFO_TEXT:
 		//fputs("== Info: ", stderr);	fwrite(data, size, 1, stderr);
@@ -594,12 +848,100 @@ static int curlDebugCallback(CURL *handle, curl_infotype type, char *data, size_
 }
 
 
+// DNS cache and TLS sessions are shared by all clients and survive a new curl handle
+// connections are not shared, curl does not support that between threads, each handle keeps its own
+// the share is created with the first curl handle and freed with the last one
+static CURLSH *curlShare;
+static pthread_mutex_t curlShareLock[CURL_LOCK_DATA_LAST];
+static pthread_mutex_t curlShareMutex = PTHREAD_MUTEX_INITIALIZER;
+static int curlShareUsers;				// curl handles of all clients
+
+static void curlShareLockFn(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+	pthread_mutex_lock(&curlShareLock[data]);
+}
+
+static void curlShareUnlockFn(CURL *handle, curl_lock_data data, void *userptr) {
+	pthread_mutex_unlock(&curlShareLock[data]);
+}
+
+static void curlShareAttach(CURL *ch) {
+	int i;
+
+	pthread_mutex_lock(&curlShareMutex);
+	if (curlShareUsers++ == 0) {
+		for (i=0;i<CURL_LOCK_DATA_LAST;i++) pthread_mutex_init(&curlShareLock[i],NULL);
+		curlShare = curl_share_init();
+		if (curlShare) {
+			curl_share_setopt(curlShare, CURLSHOPT_LOCKFUNC, curlShareLockFn);
+			curl_share_setopt(curlShare, CURLSHOPT_UNLOCKFUNC, curlShareUnlockFn);
+			curl_share_setopt(curlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+			curl_share_setopt(curlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+		}
+	}
+	if (curlShare) curl_easy_setopt(ch, CURLOPT_SHARE, curlShare);
+	pthread_mutex_unlock(&curlShareMutex);
+}
+
+// curl_easy_cleanup of a handle passed to curlShareAttach
+static void curlCleanup(CURL *ch) {
+	int i;
+
+	curl_easy_cleanup(ch);
+	pthread_mutex_lock(&curlShareMutex);
+	if (--curlShareUsers == 0) {
+		if (curlShare) curl_share_cleanup(curlShare);
+		curlShare = NULL;
+		for (i=0;i<CURL_LOCK_DATA_LAST;i++) pthread_mutex_destroy(&curlShareLock[i]);
+	}
+	pthread_mutex_unlock(&curlShareMutex);
+}
+
+
+#ifdef HAVE_ZLIB
+// compress buf into c->gzBuf, the stream is kept and reset for each post
+// returns the compressed length or 0 if not compressed
+static int gzipBody(influx_client_t *c, const char *buf, int len) {
+	z_stream *z = (z_stream *)c->zstream;
+	size_t size;
+	char *p;
+
+	if (!z) {
+		z = calloc(1,sizeof(*z));
+		if (!z) return 0;
+		// 15+16: gzip header instead of zlib
+		if (deflateInit2(z, INFLUX_GZIP_LEVEL, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			LOGN(0,"deflateInit2 failed, posting uncompressed");
+			free(z);
+			c->gzipMinBytes = 0;
+			return 0;
+		}
+		c->zstream = z;
+	} else deflateReset(z);
+	size = deflateBound(z, len);
+	if (size > c->gzBufLen) {
+		p = realloc(c->gzBuf, size);
+		if (!p) return 0;
+		c->gzBuf = p;
+		c->gzBufLen = size;
+	}
+	z->next_in = (Bytef *)buf;
+	z->avail_in = len;
+	z->next_out = (Bytef *)c->gzBuf;
+	z->avail_out = c->gzBufLen;
+	if (deflate(z, Z_FINISH) != Z_STREAM_END) return 0;
+	return z->total_out < (uLong)len ? (int)z->total_out : 0;
+}
+#endif
+
+
 int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr) {
 	int res;
 	long response_code;
 
 	assert(c != NULL);
 
+	if (c->tcp) return influxdb_tcp_send(c->tcp, buf, len);
+
 	if (!c->ch) {
 		char * strbuf;
 		c->ch = curl_easy_init();
@@ -613,11 +955,19 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 		//printf("CURLOPT_SSL_VERIFYPEER, %d, rc: %d\n",c->ssl_verifypeer,res);
 
 		curl_easy_setopt(c->ch, CURLOPT_DEBUGFUNCTION, curlDebugCallback);
+		// a server that does not answer would otherwise block the sender forever
+		curl_easy_setopt(c->ch, CURLOPT_TIMEOUT, (long)INFLUX_TIMEOUT_SECONDS);
+		curlShareAttach(c->ch);
+		curl_easy_setopt(c->ch, CURLOPT_DNS_CACHE_TIMEOUT, (long)INFLUX_DNS_CACHE_SECONDS);
+		curl_easy_setopt(c->ch, CURLOPT_TCP_KEEPALIVE, 1L);
+#if LIBCURL_VERSION_NUM >= 0x072f00
+		curl_easy_setopt(c->ch, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);	// http/2 if the server offers it via TLS
+#endif
 		// add http:// if needed
 		if (getTransportProto (c->host) == proto_none) changeTransportProto (&c->host, proto_http);
 
 		if (!c->url) {
-			if (verbose > 3) curl_easy_setopt(c->ch, CURLOPT_VERBOSE, 1L);
+			if (log_getVerboseLevel() > 3) curl_easy_setopt(c->ch, CURLOPT_VERBOSE, 1L);
 
 			if (c->isGrafana) {
 				// v2 api
@@ -645,14 +995,14 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 					if (res) {
 						EPRINTFN("curl_easy_setopt(CURLOPT_URL,\"%s\") failed with %d (%s)",c->url,res,curl_easy_strerror(res));
 						curl_slist_free_all(c->ch);
-						curl_easy_cleanup(c->ch); c->ch = NULL;
+						curlCleanup(c->ch); c->ch = NULL;
 						return res;
 					};
 					res = curl_easy_setopt(c->ch, CURLOPT_CONNECT_ONLY, 2);
 					if (res) {
 						EPRINTFN("curl_easy_setopt(CURLOPT_CONNECT_ONLY) for '%s' failed with %d (%s)",c->url,res,curl_easy_strerror(res));
 						curl_slist_free_all(c->ch);
-						curl_easy_cleanup(c->ch); c->ch = NULL;
+						curlCleanup(c->ch); c->ch = NULL;
 						return res;
 					}
 
@@ -670,7 +1020,7 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 						else changeTransportProto (&c->host, proto_http);
 						free(c->url); c->url = NULL;
 						//curl_slist_free_all(c->ch);
-						curl_easy_cleanup(c->ch); c->ch = NULL;
+						curlCleanup(c->ch); c->ch = NULL;
 						return post_http_send_line(c,buf,len,showSendErr);
 					} else {
 						c->isWebsocket = 1;
@@ -742,6 +1092,15 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 		}
 		curl_easy_setopt(c->ch, CURLOPT_URL, c->url);
 		curl_easy_setopt(c->ch, CURLOPT_PORT, c->port);
+#ifdef HAVE_ZLIB
+		if (c->gzipMinBytes) {
+			struct curl_slist *l;
+			curl_slist_free_all(c->ch_headers_gzip);
+			c->ch_headers_gzip = NULL;
+			for (l = c->ch_headers; l; l = l->next) c->ch_headers_gzip = curl_slist_append(c->ch_headers_gzip, l->data);
+			c->ch_headers_gzip = curl_slist_append(c->ch_headers_gzip, "Content-Encoding: gzip");
+		}
+#endif
 	}
 
 	if (c->isWebsocket) {
@@ -761,7 +1120,7 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 			curl_easy_setopt(c->ch,CURLOPT_VERBOSE, 0);
 			if (res) {
 				if (showSendErr) EPRINTFN("curl_ws_send to \"%s\" failed with %d (%s), closing connection",c->url,res,curl_easy_strerror(res));
-				curl_easy_cleanup(c->ch);
+				curlCleanup(c->ch);
 				c->ch = NULL;	// reconnect next time
 				free(c->url); c->url = NULL;
 				return -1;
@@ -772,6 +1131,17 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 		return 0;
 	} else {
 		if (len <= 0) return 0;
+#ifdef HAVE_ZLIB
+		if (c->gzipMinBytes && !c->isGrafana) {
+			int zlen = len >= c->gzipMinBytes ? gzipBody(c, buf, len) : 0;
+			curl_easy_setopt(c->ch, CURLOPT_HTTPHEADER, zlen > 0 ? c->ch_headers_gzip : c->ch_headers);
+			if (zlen > 0) {
+				LOGN(4,"Post to influxdb, %d bytes compressed to %d",len,zlen);
+				buf = c->gzBuf;
+				len = zlen;
+			}
+		}
+#endif
 		/* Set size of the POST data */
 		curl_easy_setopt(c->ch, CURLOPT_POSTFIELDSIZE, len);
 
@@ -782,12 +1152,10 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 		/* Perform the request, res will get the return code */
 		res = curl_easy_perform(c->ch);
 		/* Check for errors */
+		// the handle is kept on errors, curl closes a broken connection itself and
+		// reconnects with the next post using the cached DNS entry and TLS session
 		if(res != CURLE_OK && res != CURLE_HTTP_RETURNED_ERROR) {
 			if (showSendErr) EPRINTFN("Posting %s data returned %d (%s)",c->isGrafana?"grafana":"influx",res,curl_easy_strerror(res));
-			//curl_slist_free_all(c->ch);	// this will result in a segfault
-			curl_easy_cleanup(c->ch);
-			c->ch = NULL;	// reconnect next time
-			free(c->url); c->url = NULL;
 			return res;
 		}
 
@@ -795,10 +1163,6 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 		res = curl_easy_getinfo(c->ch, CURLINFO_RESPONSE_CODE, &response_code);
 		if(res != CURLE_OK) {
 			EPRINTFN("curl_easy_getinfo returned %d (%s)",res,curl_easy_strerror(res));
-			//curl_slist_free_all(c->ch);
-			curl_easy_cleanup(c->ch);
-			c->ch = NULL;	// reconnect next time
-			free(c->url); c->url = NULL;
 			return res;
 		}
 		LOGN(4,"Post to influxdb, status: %d",response_code);
@@ -806,69 +1170,283 @@ int post_http_send_line(influx_client_t *c, char *buf, int len, int showSendErr)
 	}
 }
 
+
+static uint64_t nowMs(void) {
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+// HEAD /ping (grafana: /api/health) with its own handle and a short timeout, the server is up if it
+// answers at all, even if the endpoint does not exist (apiStr), except for 502..504 from a proxy
+static int probeServer(influx_client_t *c) {
+	long response_code = 0;
+	char *url;
+	int res;
+
+	if (c->tcp) return influxdb_tcp_connect(c->tcp);		// a connect is the probe
+	if (!c->chProbe) {
+		c->chProbe = curl_easy_init();
+		if (!c->chProbe) return -1;
+		if (! c->ssl_verifypeer) {
+			curl_easy_setopt(c->chProbe, CURLOPT_SSL_VERIFYPEER, 0);
+			curl_easy_setopt(c->chProbe, CURLOPT_SSL_VERIFYHOST, 0);
+		}
+		curl_easy_setopt(c->chProbe, CURLOPT_TIMEOUT, (long)INFLUX_PROBE_TIMEOUT_SECONDS);
+		curlShareAttach(c->chProbe);
+		curl_easy_setopt(c->chProbe, CURLOPT_DNS_CACHE_TIMEOUT, (long)INFLUX_DNS_CACHE_SECONDS);
+		curl_easy_setopt(c->chProbe, CURLOPT_NOBODY, 1L);
+		if (getTransportProto (c->host) == proto_none) changeTransportProto (&c->host, proto_http);
+		url = malloc(strlen(c->host) + 16);
+		if (!url) return -2;
+		sprintf(url, "%s%s", c->host, c->isGrafana ? "/api/health" : "/ping");
+		curl_easy_setopt(c->chProbe, CURLOPT_URL, url);		// curl copies the string
+		free(url);
+		curl_easy_setopt(c->chProbe, CURLOPT_PORT, (long)(c->isGrafana && !c->port ? 3000 : c->port));
+	}
+	res = curl_easy_perform(c->chProbe);
+	if (res == CURLE_OK) res = curl_easy_getinfo(c->chProbe, CURLINFO_RESPONSE_CODE, &response_code);
+	LOGN(3,"Probing influxdb at %s: %d, status: %ld",c->host,res,response_code);
+	if (res != CURLE_OK) return res;
+	return response_code >= 502 && response_code <= 504 ? response_code : 0;
+}
+
+// circuit breaker: after INFLUX_BREAKER_FAILURES failed posts the server is considered down and
+// posts are queued without trying to send them, only a probe is sent with increasing delay
+// returns 1 if the post has to be queued
+static int serverDown(influx_client_t *c) {
+	uint64_t now;
+
+	if (c->sendFailures < INFLUX_BREAKER_FAILURES || c->isWebsocket) return 0;
+	now = nowMs();
+	if (now < c->nextProbeMs) return 1;
+	if (probeServer(c) != 0) {
+		c->probeDelayMs = c->probeDelayMs ? c->probeDelayMs * 2 : INFLUX_PROBE_MIN_SECONDS * 1000;
+		if (c->probeDelayMs > INFLUX_PROBE_MAX_SECONDS * 1000) c->probeDelayMs = INFLUX_PROBE_MAX_SECONDS * 1000;
+		c->nextProbeMs = now + c->probeDelayMs;
+		return 1;
+	}
+	LOGN(0,"influxdb at %s is reachable again",c->host);
+	c->sendFailures = 0;
+	c->probeDelayMs = 0;
+	return 0;
+}
+
+// count consecutive failures of post_http_send_line
+static void sendResult(influx_client_t *c, int failed) {
+	if (!failed) {
+		c->sendFailures = 0;
+		return;
+	}
+	if (++c->sendFailures == INFLUX_BREAKER_FAILURES) {
+		LOGN(0,"influxdb at %s not reachable, queuing posts and probing the server",c->host);
+		c->probeDelayMs = INFLUX_PROBE_MIN_SECONDS * 1000;
+		c->nextProbeMs = nowMs() + c->probeDelayMs;
+	}
+}
+
 #endif // INFLUXDB_POST_LIBCURL
 
 
+int influxdb_post_openDiskQueue(influx_client_t *c, const char *dir, size_t maxBytes) {
+    uint64_t records,bytes,dropped;
+
+    influxdb_post_closeDiskQueue(c);
+    c->wal = influxdb_wal_open(dir, maxBytes);
+    if (!c->wal) return -1;
+    influxdb_wal_stats(c->wal, &records, &bytes, &dropped);
+    c->numEntriesQueued = records;      // posted after the next successful post
+    return 0;
+}
+
+
+void influxdb_post_closeDiskQueue(influx_client_t *c) {
+    if (!c->wal) return;
+    influxdb_wal_close(c->wal);
+    c->wal = NULL;
+    c->numEntriesQueued = 0;
+}
+
+
+int influxdb_post_setGzip(influx_client_t *c, int minBytes) {
+#if defined(HAVE_ZLIB) && defined(INFLUXDB_POST_LIBCURL)
+    c->gzipMinBytes = minBytes;
+    if (c->ch) {                        // header lists are built with the next connection
+        curlCleanup(c->ch);
+        c->ch = NULL;
+        free(c->url); c->url = NULL;
+    }
+    return 0;
+#else
+    if (minBytes) LOGN(0,"gzip not available, built without zlib");
+    return minBytes ? -1 : 0;
+#endif
+}
+
+
+#ifdef INFLUXDB_POST_LIBCURL
+void influxdb_post_setTcpNoDelay(influx_client_t *c, int noDelay) {
+	if (c->tcp) influxdb_tcp_setNoDelay(c->tcp, noDelay);
+}
+#endif
+
+void influxdb_post_setQueueLimits(influx_client_t *c, size_t maxQueueBytes, size_t maxPostBytes) {
+    c->maxQueueBytes = maxQueueBytes;
+    c->maxPostBytes = maxPostBytes ? maxPostBytes : INFLUX_POST_MAX_BYTES;
+}
+
+
 int addToQueue (influx_client_t* c) {
-    struct influx_dataRow_t *t;
-    struct influx_dataRow_t *t2;
-
-    if (c->numEntriesQueued < c->maxNumEntriesToQueue) {
-        t = malloc(sizeof(*t));
-        if (! t) return -1;
-        t->next=NULL;
-        t->postData=c->influxBuf;
+    uint64_t records,bytes,dropped;
+    size_t len = strlen(c->influxBuf);
+    char **q;
+    int i,size;
+
+    if (c->wal) {
+        if (influxdb_wal_append(c->wal, c->influxBuf, len) != 0) return -2;
+        free(c->influxBuf);
         c->influxBuf=NULL;
         c->influxBufLen=0;
         c->influxBufUsed=0;
-        if (! c->firstEntry) {
-            c->firstEntry=t;
-        } else {
-            t2=c->firstEntry;
-            while (t2->next) t2=t2->next;
-            t2->next=t;
-        }
-        if (c->numEntriesQueued==0) {
-            LOGN(0,"Beginning queueing of records due to failures posting to influxdb (max: %d)",c->maxNumEntriesToQueue);
-        } else
-            LOGN(1,"Due to failure sending data, record has been queued as #%d",c->numEntriesQueued);
-        c->numEntriesQueued++;
+        if (c->numEntriesQueued==0)
+            LOGN(0,"Beginning queueing of records on disk due to failures posting to influxdb");
+        influxdb_wal_stats(c->wal, &records, &bytes, &dropped);
+        LOGN(1,"Due to failure sending data, record has been queued on disk, %llu records, %llu kB",(unsigned long long)records,(unsigned long long)bytes/1024);
+        c->numEntriesQueued = records;
         return 0;
-    } else {
+    }
+    if ((c->numEntriesQueued >= c->maxNumEntriesToQueue) || (c->queueBytes + len > c->maxQueueBytes)) {
         //LOGN((c->maxNumEntriesToQueue>0),"Failed sending data and will not queue (numEntriesQueued(%d) < maxNumEntriesToQueue(%d), record lost", c->numEntriesQueued, c->maxNumEntriesToQueue);
         return -2;
     }
+    if (c->numEntriesQueued == c->queueSize) {
+        // ring is full, double it and move the entries to the start
+        size = c->queueSize ? c->queueSize * 2 : 16;
+        if (size > c->maxNumEntriesToQueue) size = c->maxNumEntriesToQueue;
+        q = malloc(sizeof(*q) * size);
+        if (! q) return -1;
+        for (i=0;i<c->numEntriesQueued;i++) q[i] = c->queue[(c->queueFirst + i) % c->queueSize];
+        free(c->queue);
+        c->queue = q;
+        c->queueSize = size;
+        c->queueFirst = 0;
+    }
+    c->queue[(c->queueFirst + c->numEntriesQueued) % c->queueSize] = c->influxBuf;
+    c->queueBytes += len;
+    c->influxBuf=NULL;
+    c->influxBufLen=0;
+    c->influxBufUsed=0;
+    if (c->numEntriesQueued==0) {
+        LOGN(0,"Beginning queueing of records due to failures posting to influxdb (max: %zu kB)",c->maxQueueBytes/1024);
+    } else
+        LOGN(1,"Due to failure sending data, record has been queued as #%d (%zu kB)",c->numEntriesQueued,c->queueBytes/1024);
+    c->numEntriesQueued++;
+    return 0;
+}
+
+
+// queued entry *pos (0 = oldest), advances pos, returns 0 if there are no more
+typedef int (*queueNextFn)(influx_client_t *c, uint32_t *pos, const char **data, size_t *len);
+// remove the n oldest entries
+typedef void (*queueAckFn)(influx_client_t *c, int n);
+
+static int memoryNext(influx_client_t *c, uint32_t *pos, const char **data, size_t *len) {
+    if (*pos >= c->numEntriesQueued) return 0;
+    *data = c->queue[(c->queueFirst + *pos) % c->queueSize];
+    *len = strlen(*data);
+    (*pos)++;
+    return 1;
+}
+
+static void memoryAck(influx_client_t *c, int n) {
+    char *p;
+
+    while ((n-- > 0) && c->numEntriesQueued) {
+        p = c->queue[c->queueFirst];
+        c->queueBytes -= strlen(p);
+        free(p);
+        c->queueFirst = (c->queueFirst + 1) % c->queueSize;
+        c->numEntriesQueued--;
+    }
+}
+
+static int diskNext(influx_client_t *c, uint32_t *pos, const char **data, size_t *len) {
+    return influxdb_wal_peek(c->wal, pos, data, len);
+}
+
+static void diskAck(influx_client_t *c, int n) {
+    uint64_t records,bytes,dropped;
+
+    influxdb_wal_ack(c->wal, n);
+    influxdb_wal_stats(c->wal, &records, &bytes, &dropped);
+    c->numEntriesQueued = records;
 }
 
 
+// no response, 5xx, 408 (request timeout) and 429 (too many requests) may succeed later
+static int retryable(int code) {
+    return (code != 0) && ((code < 200) || (code >= 500) || (code == 408) || (code == 429));
+}
+
+
+// adjacent entries are joined into one request of up to maxPostBytes, at most INFLUX_DEQUEUE_AT_ONCE requests
+// if the server rejects a request with several entries (4xx, e.g. 413 or a bad line), the number of entries
+// per request is halved until the rejected entry is sent alone and dropped, it would block the queue forever
 int influxdb_deQueue(influx_client_t *c) {
-    int numDequeued=0;
-    int res;
-    struct influx_dataRow_t *t;
+    queueNextFn next = c->wal ? diskNext : memoryNext;
+    queueAckFn ack = c->wal ? diskAck : memoryAck;
+    int numDequeued=0, numPosts=0, maxEntries=INT_MAX, n, res=0;
+    const char *data, *post;
+    char *body = NULL;
+    size_t len, used;
+    uint32_t pos;
 
     if (c->numEntriesQueued) {
-        LOGN(0,"beginning dequeing to %s, %d remaining",c->url,c->numEntriesQueued);
-        do {
-            //if (c->firstEntry) {}
-            res = post_http_send_line(c, c->firstEntry->postData, strlen(c->firstEntry->postData),1);
-            if (res == 0) {
-                t = c->firstEntry;
-                c->firstEntry = t->next;
-                free(t->postData);
-                free(t);
-                numDequeued++; c->numEntriesQueued--;
-                //LOGN(0,"dequeue first: success, remaining: %d",c->numEntriesQueued);
-            } else {
-                LOGN(0,"dequeue: post_http_send_line to %s failed with %d",c->url,res);
-                return -1;
+        LOGN(0,"beginning dequeing to %s, %d remaining",c->url ? c->url : c->host,c->numEntriesQueued);
+        while ((numPosts < INFLUX_DEQUEUE_AT_ONCE) && (res == 0)) {
+            pos = 0;
+            if (! next(c, &pos, &post, &used)) break;
+            n = 1;
+            while ((n < maxEntries) && next(c, &pos, &data, &len) && (used + 1 + len <= c->maxPostBytes)) {
+                if (! body) body = malloc(c->maxPostBytes);
+                if (! body) break;
+                if (post != body) { memcpy(body, post, used); post = body; }
+                body[used++] = '\n';
+                memcpy(body + used, data, len);
+                used += len;
+                n++;
             }
-        } while((numDequeued < INFLUX_DEQUEUE_AT_ONCE) && (res == 0) && (c->numEntriesQueued));
+            res = post_http_send_line(c, (char *)post, used, 1);
+            numPosts++;
+#ifdef INFLUXDB_POST_LIBCURL
+            sendResult(c, res != 0 && (res < 200 || res >= 500));
+#endif
+            if (retryable(res)) {
+                LOGN(0,"dequeue: post_http_send_line to %s failed with %d",c->url ? c->url : c->host,res);
+                break;
+            }
+            if (res != 0) {
+                if (n > 1) {
+                    maxEntries = n / 2;
+                    LOGN(1,"dequeue: %s rejected %d queued entries with %d, retrying with %d",c->url ? c->url : c->host, n, res, maxEntries);
+                    res = 0;
+                    continue;
+                }
+                LOGN(0,"dequeue: %s rejected a queued entry with %d, dropped",c->url ? c->url : c->host, res);
+                maxEntries = INT_MAX;
+                res = 0;
+            } else numDequeued += n;
+            ack(c, n);
+        }
+        free(body);
         if (numDequeued>0) {
             char s[20];
             if (c->numEntriesQueued) sprintf(s,"%d left",c->numEntriesQueued);
             else strcpy(s,"=all");
-            LOGN(0,"%d entr%s (%s) dequeued and successfully posted to %s",numDequeued, numDequeued > 1 ? "ies" : "y", s, c->url);
+            LOGN(0,"%d entr%s (%s) dequeued and successfully posted to %s in %d request%s",numDequeued, numDequeued > 1 ? "ies" : "y", s, c->url ? c->url : c->host, numPosts, numPosts > 1 ? "s" : "");
         }
+        if (res != 0) return -1;
     }
     return numDequeued;
 }
@@ -907,13 +1485,23 @@ int influxdb_post_http_line(influx_client_t* c)
 {
     int ret_code = 0, len = strlen(c->influxBuf);
 
+#ifdef INFLUXDB_POST_LIBCURL
+    if (serverDown(c)) {
+        ret_code = INFLUX_ERR_SERVER_DOWN;
+        goto QUEUE;
+    }
+#endif
     //ret_code = post_http_send_line(c, c->influxBuf, len, 0);	// dont show send errors
     //if (ret_code != 0 && (ret_code < 200 || ret_code >= 500))
 	//	ret_code = post_http_send_line(c, c->influxBuf, len, 1);	// retry and show send errors
 	ret_code = post_http_send_line(c, c->influxBuf, len, 1);
 	if (ret_code == -1) ret_code = post_http_send_line(c, c->influxBuf, len, 1);
     //printf("rc from post_http_send_line: %d\n",ret_code);
-    if (ret_code != 0 && (ret_code < 200 || ret_code >= 500)) {
+#ifdef INFLUXDB_POST_LIBCURL
+    sendResult(c, ret_code != 0 && (ret_code < 200 || ret_code >= 500));
+#endif
+    if (retryable(ret_code)) {
+QUEUE:
         if (addToQueue(c)<0) {
             influxdb_post_freeBuffer(c);     // queue full, must ignore this one
         } else {
@@ -927,6 +1515,24 @@ int influxdb_post_http_line(influx_client_t* c)
     return ret_code;
 }
 
+char * influxdb_post_takeBuffer(influx_client_t *c) {
+    char *buf = c->influxBuf;
+
+    if (!buf || !c->influxBufUsed) return NULL;
+    c->influxBuf = NULL;            // the size is kept for the next buffer
+    influxdb_post_freeBuffer(c);
+    return buf;
+}
+
+int influxdb_post_http_buffer(influx_client_t *c, char *buf)
+{
+    influxdb_post_freeBuffer(c);
+    c->influxBuf = buf;
+    c->influxBufUsed = strlen(buf);
+    c->influxBufLen = c->influxBufUsed + 1;
+    return influxdb_post_http_line(c);
+}
+
 #if 0
 int send_udp_line(influx_client_t* c, char *line, int len)
 {
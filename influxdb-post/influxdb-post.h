@@ -17,6 +17,8 @@ extern "C" {
 //#include <stdio.h>
 #include <unistd.h>
 #include <netdb.h>
+#include "influxdb-wal.h"
+#include "influxdb-tcp.h"
 
 #ifndef ESP32
 #define INFLUXDB_POST_LIBCURL
@@ -28,6 +30,12 @@ extern "C" {
 #endif
 
 #define INFLUX_TIMEOUT_SECONDS 5
+#define INFLUX_DNS_CACHE_SECONDS 300
+#define INFLUX_BREAKER_FAILURES 2			// consecutive failed posts until the server is considered down
+#define INFLUX_PROBE_MIN_SECONDS 5			// delay until the first probe of a server that is down,
+#define INFLUX_PROBE_MAX_SECONDS 120		// doubled after each failed probe up to this
+#define INFLUX_PROBE_TIMEOUT_SECONDS 2
+#define INFLUX_ERR_SERVER_DOWN -10			// influxdb_post_http_line: not sent but queued because the server is down
 
 /*
   Usage:
@@ -58,11 +66,10 @@ extern "C" {
 
 #define INFLUX_INITIAL_BUF_SIZE 0x100
 
-struct influx_dataRow_t
-{
-    char* postData;
-    struct influx_dataRow_t* next;
-};
+#define INFLUX_QUEUE_MAX_BYTES (8*1024*1024)
+#define INFLUX_POST_MAX_BYTES (256*1024)
+#define INFLUX_GZIP_MIN_BYTES 1024
+#define INFLUX_GZIP_LEVEL 6
 
 
 typedef struct _influx_client_t
@@ -78,7 +85,17 @@ typedef struct _influx_client_t
     char *apiStr; // if set,db..token will be ignored and only this string is send in the http header, e.g. /write?username=Admin?password=questdb
     int maxNumEntriesToQueue;  // for buffer in case of send failures
     int numEntriesQueued;
-    struct influx_dataRow_t* firstEntry;
+    char **queue;              // ring of failed posts, oldest at queueFirst
+    int queueSize;
+    int queueFirst;
+    size_t queueBytes;
+    size_t maxQueueBytes;      // limit of queueBytes
+    size_t maxPostBytes;       // queued posts are joined into requests up to this size
+    influx_wal_t *wal;         // if set, failed posts are queued on disk instead of queue
+    int gzipMinBytes;          // posts of at least this size are compressed, 0 = off
+    void *zstream;             // z_stream, kept for all posts
+    char *gzBuf;
+    size_t gzBufLen;
 
     int lastNeededBufferSize;
     size_t influxBufUsed;
@@ -92,10 +109,16 @@ typedef struct _influx_client_t
 	char *grafanaPushID;
 	CURL *ch;
 	struct curl_slist *ch_headers;
+	struct curl_slist *ch_headers_gzip;	// ch_headers plus Content-Encoding
 	char *url;
 	int isWebsocket;
 	int ssl_verifypeer;
 	int firstConnectionAttempt;
+	CURL *chProbe;				// probes the server while it is down
+	int sendFailures;			// consecutive
+	int probeDelayMs;
+	uint64_t nextProbeMs;
+	influx_tcp_t *tcp;			// host tcp://..., line protocol over a tcp connection instead of http
 #else
 	int hostResolved;
     struct addrinfo *ainfo;
@@ -113,6 +136,17 @@ influx_client_t* influxdb_post_init_grafana (char* host, int port, char * grafan
 
 void influxdb_post_freeBuffer(influx_client_t *c);
 int influxdb_deQueue(influx_client_t *c);
+// queue failed posts in segment files in dir (at most maxBytes) instead of memory, they survive a restart
+int influxdb_post_openDiskQueue(influx_client_t *c, const char *dir, size_t maxBytes);
+void influxdb_post_closeDiskQueue(influx_client_t *c);
+// compress posts of at least minBytes (INFLUX_GZIP_MIN_BYTES) with gzip, 0 = off, -1 if built without zlib
+int influxdb_post_setGzip(influx_client_t *c, int minBytes);
+// limit the memory used by queued posts, maxPostBytes is the size of the requests when sending them (0 = default)
+void influxdb_post_setQueueLimits(influx_client_t *c, size_t maxQueueBytes, size_t maxPostBytes);
+#ifdef INFLUXDB_POST_LIBCURL
+// TCP_NODELAY for tcp://, on by default as each post is written with one send
+void influxdb_post_setTcpNoDelay(influx_client_t *c, int noDelay);
+#endif
 void influxdb_post_deInit(influx_client_t *c);
 void influxdb_post_free(influx_client_t *c);
 
@@ -142,8 +176,36 @@ int influxdb_send_udp(influx_client_t* c, ...);
 
 int influxdb_format_line(influx_client_t* c, ...); //char **buf, int *len , size_t used, ...);
 
+/*
+  Templates: measurement, tags and field keys are escaped and sorted once, a line then
+  only needs the values. The values are passed in the order the fields were added.
+
+    influx_template_t *t = influxdb_template_new("Battery");
+    influxdb_template_tag(t, "Module", "1");
+    int u = influxdb_template_field(t, "u", IF_TYPE_FIELD_FLOAT, 2);
+    int ah = influxdb_template_field(t, "AH", IF_TYPE_FIELD_INTEGER, 0);
+    ...
+    v[u].f = 52.1; v[ah].i = 50;
+    influxdb_template_line(c, t, v, timestamp);     // Battery,Module=1 AH=50i,u=52.10 <timestamp>
+*/
+typedef union {
+    double f;           // IF_TYPE_FIELD_FLOAT
+    long long i;        // IF_TYPE_FIELD_INTEGER, IF_TYPE_FIELD_BOOLEAN
+} influx_value_t;
+
+typedef struct influx_template_s influx_template_t;
+
+influx_template_t * influxdb_template_new(const char *measurement);
+void influxdb_template_free(influx_template_t *t);
+int influxdb_template_tag(influx_template_t *t, const char *key, const char *value);
+// returns the index of the field in the values array or -1, precision is used for floats only
+int influxdb_template_field(influx_template_t *t, const char *key, int type, int precision);
+int influxdb_template_numFields(influx_template_t *t);
+// append one line to the buffer as influxdb_format_line does, timestamp 0 = none
+int influxdb_template_line(influx_client_t* c, influx_template_t *t, const influx_value_t *values, long long timestamp);
+
 #ifdef INFLUXDB_POST_LIBCURL
-typedef enum {proto_http,proto_https,proto_ws,proto_wss,proto_none,proto_unknown} transport_proto_t;
+typedef enum {proto_http,proto_https,proto_ws,proto_wss,proto_tcp,proto_none,proto_unknown} transport_proto_t;
 
 transport_proto_t getTransportProto (const char *url);
 transport_proto_t changeTransportProto (char **url, transport_proto_t t);
@@ -153,6 +215,12 @@ const char *getTransportProtoStr(transport_proto_t t);
 // buffer will be free'd or added to queue if influxdb server is unavailable
 int influxdb_post_http_line(influx_client_t* c);
 
+// hand the formatted lines over to another client, e.g. one used by a sender thread
+// returns the buffer (to be posted with influxdb_post_http_buffer or free'd) or NULL if empty
+char * influxdb_post_takeBuffer(influx_client_t *c);
+// post a buffer returned by influxdb_post_takeBuffer, as influxdb_post_http_line it is free'd or queued
+int influxdb_post_http_buffer(influx_client_t *c, char *buf);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,255 @@
+/*
+ * line protocol over a persistent tcp connection, see influxdb-tcp.h
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+#include "../log.h"
+#include "influxdb-tcp.h"
+
+struct influx_tcp_s {
+	char *host;
+	int port;
+	int noDelay;
+	int fd;								// -1 if not connected
+	int connectFailed;					// logged once until connected again
+	char *buf;							// lines not yet acknowledged by the peer
+	size_t len;
+	size_t size;
+	size_t sent;						// buf[0..sent) has been written on the current connection
+	size_t maxBytes;
+	uint64_t connects;
+	uint64_t resent;
+};
+
+
+static uint64_t nowMs() {
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+
+influx_tcp_t * influxdb_tcp_init(const char *host, int port, int noDelay, size_t maxBytes) {
+	influx_tcp_t *t;
+
+	t = calloc(1,sizeof(*t));
+	if (!t) return NULL;
+	t->host = strdup(host);
+	if (!t->host) {
+		free(t);
+		return NULL;
+	}
+	t->port = port ? port : INFLUX_TCP_PORT;
+	t->noDelay = noDelay;
+	t->maxBytes = maxBytes ? maxBytes : INFLUX_TCP_MAX_BYTES;
+	t->fd = -1;
+	return t;
+}
+
+
+static void disconnect(influx_tcp_t *t) {
+	if (t->fd >= 0) close(t->fd);
+	t->fd = -1;
+	t->sent = 0;						// everything not acknowledged is written again
+}
+
+
+// non-blocking connect with timeout to each address of host
+static int connectTo(influx_tcp_t *t, struct addrinfo *ai) {
+	struct pollfd pfd;
+	socklen_t len;
+	int fd,err,on = 1;
+
+	fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+	if (fd < 0) return -1;
+	if ((connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) && (errno != EINPROGRESS)) goto FAIL;
+	pfd.fd = fd; pfd.events = POLLOUT;
+	if (poll(&pfd, 1, INFLUX_TCP_CONNECT_SECONDS * 1000) != 1) {
+		errno = ETIMEDOUT;
+		goto FAIL;
+	}
+	len = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) goto FAIL;
+	if (err) {
+		errno = err;
+		goto FAIL;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &t->noDelay, sizeof(t->noDelay));
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	return fd;
+FAIL:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+
+int influxdb_tcp_connect(influx_tcp_t *t) {
+	struct addrinfo hints, *res, *ai;
+	char port[8];
+	int rc;
+
+	if (t->fd >= 0) return 0;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%d", t->port);
+	rc = getaddrinfo(t->host, port, &hints, &res);
+	if (rc != 0) {
+		if (!t->connectFailed) LOGN(0,"ILP: unable to resolve %s (%s)",t->host,gai_strerror(rc));
+		t->connectFailed = 1;
+		return INFLUX_TCP_ERR_CONNECT;
+	}
+	for (ai = res; ai && (t->fd < 0); ai = ai->ai_next) t->fd = connectTo(t, ai);
+	freeaddrinfo(res);
+	if (t->fd < 0) {
+		if (!t->connectFailed) LOGN(0,"ILP: unable to connect to %s:%d (%s)",t->host,t->port,strerror(errno));
+		t->connectFailed = 1;
+		return INFLUX_TCP_ERR_CONNECT;
+	}
+	LOGN(t->connectFailed ? 0 : 1,"ILP: connected to %s:%d",t->host,t->port);
+	t->connectFailed = 0;
+	t->connects++;
+	t->sent = 0;
+	if (t->len) {
+		LOGN(1,"ILP: writing %zu bytes not acknowledged by %s:%d again",t->len,t->host,t->port);
+		t->resent += t->len;
+	}
+	return 0;
+}
+
+
+// the receiver does not send anything, a readable socket means it has closed the connection
+static int peerClosed(influx_tcp_t *t) {
+	char tmp[256];
+	ssize_t n;
+
+	while ((n = recv(t->fd, tmp, sizeof(tmp), MSG_DONTWAIT)) > 0) LOGN(2,"ILP: %zd bytes received from %s:%d",n,t->host,t->port);
+	if (n == 0) return 1;
+	return (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR);
+}
+
+
+// remove the lines the tcp stack of the peer has acknowledged
+static void dropAcked(influx_tcp_t *t) {
+	size_t acked = t->sent;
+	int outq;
+
+	if ((t->fd < 0) || !t->sent) return;
+#ifdef SIOCOUTQ
+	if (ioctl(t->fd, SIOCOUTQ, &outq) != 0) return;
+	acked = (size_t)outq < t->sent ? t->sent - outq : 0;
+#endif
+	// a partially acknowledged line is written again after a reconnect
+	while (acked && (t->buf[acked-1] != '\n')) acked--;
+	if (!acked) return;
+	memmove(t->buf, t->buf + acked, t->len - acked);
+	t->len -= acked;
+	t->sent -= acked;
+}
+
+
+// write as much as the socket accepts without blocking
+static void flush(influx_tcp_t *t) {
+	ssize_t n;
+
+	while ((t->fd >= 0) && (t->sent < t->len)) {
+		n = send(t->fd, t->buf + t->sent, t->len - t->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n > 0) {
+			t->sent += n;
+			continue;
+		}
+		if ((n < 0) && (errno == EINTR)) continue;
+		if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) return;
+		LOGN(0,"ILP: writing to %s:%d failed (%s), reconnecting with the next send",t->host,t->port,strerror(errno));
+		disconnect(t);
+	}
+}
+
+
+int influxdb_tcp_send(influx_tcp_t *t, const char *buf, size_t len) {
+	size_t need = len + 1;
+	char *p;
+
+	dropAcked(t);
+	if ((t->fd >= 0) && peerClosed(t)) {
+		LOGN(0,"ILP: connection closed by %s:%d",t->host,t->port);
+		disconnect(t);
+	}
+	if (influxdb_tcp_connect(t) != 0) return INFLUX_TCP_ERR_CONNECT;
+	if (t->len + need > t->maxBytes) {
+		flush(t);
+		dropAcked(t);
+		if (t->len + need > t->maxBytes) {
+			LOGN(1,"ILP: %zu bytes not acknowledged by %s:%d",t->len,t->host,t->port);
+			return INFLUX_TCP_ERR_FULL;
+		}
+	}
+	if (t->len + need > t->size) {
+		p = realloc(t->buf, t->len + need);
+		if (!p) return -2;
+		t->buf = p;
+		t->size = t->len + need;
+	}
+	memcpy(t->buf + t->len, buf, len);
+	t->len += len;
+	if (len && (buf[len-1] != '\n')) t->buf[t->len++] = '\n';	// each line has to be terminated
+	flush(t);
+	return 0;
+}
+
+
+void influxdb_tcp_setNoDelay(influx_tcp_t *t, int noDelay) {
+	t->noDelay = noDelay;
+	if (t->fd >= 0) setsockopt(t->fd, IPPROTO_TCP, TCP_NODELAY, &t->noDelay, sizeof(t->noDelay));
+}
+
+
+void influxdb_tcp_stats(influx_tcp_t *t, uint64_t *connects, size_t *pending, uint64_t *resent) {
+	if (connects) *connects = t->connects;
+	if (pending) *pending = t->len;
+	if (resent) *resent = t->resent;
+}
+
+
+void influxdb_tcp_free(influx_tcp_t *t) {
+	struct pollfd pfd;
+	uint64_t end;
+	size_t unwritten;
+	int ms;
+
+	if (!t) return;
+	if (t->len && (influxdb_tcp_connect(t) == 0)) {
+		end = nowMs() + INFLUX_TCP_CONNECT_SECONDS * 1000;
+		flush(t);
+		while ((t->fd >= 0) && (t->sent < t->len) && ((ms = (int64_t)(end - nowMs())) > 0)) {
+			pfd.fd = t->fd; pfd.events = POLLOUT;
+			if (poll(&pfd, 1, ms) > 0) flush(t);
+		}
+		dropAcked(t);
+	}
+	// written but not acknowledged lines are still delivered by the kernel after close
+	unwritten = t->fd < 0 ? t->len : t->len - t->sent;
+	if (unwritten) LOGN(0,"ILP: %zu bytes not written to %s:%d",unwritten,t->host,t->port);
+	disconnect(t);
+	free(t->buf);
+	free(t->host);
+	free(t);
+}
@@ -0,0 +1,57 @@
+#ifndef _INFLUXDB_TCP_H_
+#define _INFLUXDB_TCP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * line protocol over a persistent tcp connection, e.g. the ILP port 9009 of QuestDB
+ *
+ * The lines of each send are appended to a buffer (terminated by \n) and written with one non-blocking
+ * send(), what the socket does not accept is written with the next call. The receiver does not answer,
+ * so the lines are kept until the tcp stack of the peer has acknowledged them (SIOCOUTQ). If the
+ * connection is lost they are written again after reconnecting, a line may be received twice.
+ * At most maxBytes are kept, further sends fail until the receiver has read enough.
+ *
+ *     influx_tcp_t *t = influxdb_tcp_init("questdb", 9009, 1, 1024*1024);
+ *     if (influxdb_tcp_send(t, buf, len) != 0) queue(buf);
+ *     influxdb_tcp_free(t);
+ *
+ * Not thread safe.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define INFLUX_TCP_PORT 9009
+#define INFLUX_TCP_MAX_BYTES (1024*1024)
+#define INFLUX_TCP_CONNECT_SECONDS 5
+
+#define INFLUX_TCP_ERR_CONNECT -20			// not connected and unable to connect
+#define INFLUX_TCP_ERR_FULL -21				// more than maxBytes not acknowledged
+
+typedef struct influx_tcp_s influx_tcp_t;
+
+// host without tcp://, noDelay sets TCP_NODELAY
+influx_tcp_t * influxdb_tcp_init(const char *host, int port, int noDelay, size_t maxBytes);
+// tries to write the lines not yet written within INFLUX_TCP_CONNECT_SECONDS
+void influxdb_tcp_free(influx_tcp_t *t);
+
+// connect if not connected, returns 0 or INFLUX_TCP_ERR_CONNECT
+int influxdb_tcp_connect(influx_tcp_t *t);
+
+// returns 0 if the lines have been taken over (written or kept to be written), the caller may free buf
+int influxdb_tcp_send(influx_tcp_t *t, const char *buf, size_t len);
+
+void influxdb_tcp_setNoDelay(influx_tcp_t *t, int noDelay);
+
+// connections made, bytes kept for a reconnect (acknowledged ones are removed by the next send),
+// bytes written again after a reconnect
+void influxdb_tcp_stats(influx_tcp_t *t, uint64_t *connects, size_t *pending, uint64_t *resent);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INFLUXDB_TCP_H_
@@ -0,0 +1,417 @@
+/*
+ * disk queue for posts that could not be sent, see influxdb-wal.h
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../log.h"
+#include "influxdb-wal.h"
+
+#define WAL_MAGIC 0x4c415749			// "IWAL"
+#define WAL_CURSOR_MAGIC 0x52435749		// "IWCR"
+#define WAL_ALIGN 4
+#define WAL_MIN_SEGMENTS 2
+
+typedef struct {
+	uint32_t magic;
+	uint32_t len;						// payload bytes
+	uint32_t crc;						// crc32 of the payload
+} recHdrT;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t id;						// segment of the oldest record not yet posted
+	uint32_t off;						// and its offset
+	uint32_t crc;						// of id and off
+} cursorT;
+
+typedef struct {
+	uint32_t id;						// file name
+	uint32_t size;						// file size
+	uint32_t end;						// bytes used
+	uint32_t records;					// not yet acknowledged
+} segmentT;
+
+struct influx_wal_s {
+	char *dir;
+	int maxSegments;
+	segmentT *seg;						// oldest first, the last one is written
+	int numSegments;
+	char *wmap;							// mapping of the last segment
+	char *rmap;							// of the first segment if not the same
+	uint32_t readOff;					// in the first segment
+	int cursorFd;
+	int cursorDirty;
+	uint32_t syncedEnd;					// of the last segment
+	uint64_t lastSyncMs;
+	uint64_t records;
+	uint64_t bytes;
+	uint64_t dropped;
+};
+
+#define RECSIZE(len) ((sizeof(recHdrT) + (len) + WAL_ALIGN-1) & ~(WAL_ALIGN-1))
+
+
+static uint32_t crcTable[256];
+
+static uint32_t crc32(const void *data, size_t len) {
+	const uint8_t *p = (const uint8_t *)data;
+	uint32_t crc = 0xffffffff;
+	uint32_t c;
+	int i,k;
+
+	if (!crcTable[1])
+		for (i=0;i<256;i++) {
+			for (c=i,k=0;k<8;k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			crcTable[i] = c;
+		}
+	while (len--) crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+
+static uint64_t nowMs() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void segmentName(influx_wal_t *w, uint32_t id, char *name, size_t size) {
+	snprintf(name,size,"%s/%08u.wal",w->dir,id);
+}
+
+
+// map a segment, creates the file if size is > 0
+static char * segmentMap(influx_wal_t *w, segmentT *s, uint32_t size) {
+	char name[PATH_MAX];
+	struct stat st;
+	char *map;
+	int fd;
+
+	segmentName(w,s->id,name,sizeof(name));
+	fd = open(name,size ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDWR | O_CLOEXEC,0644);
+	if (fd < 0) {
+		LOGN(0,"disk queue: unable to open %s (%s)",name,strerror(errno));
+		return NULL;
+	}
+	if (size && (ftruncate(fd,size) != 0)) {
+		LOGN(0,"disk queue: unable to create %s (%s)",name,strerror(errno));
+		close(fd);
+		unlink(name);
+		return NULL;
+	}
+	if ((fstat(fd,&st) != 0) || (st.st_size < (off_t)sizeof(recHdrT))) {
+		LOGN(0,"disk queue: %s is empty, ignored",name);
+		close(fd);
+		return NULL;
+	}
+	s->size = st.st_size;
+	map = mmap(NULL,s->size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		LOGN(0,"disk queue: unable to map %s (%s)",name,strerror(errno));
+		return NULL;
+	}
+	return map;
+}
+
+
+// record at off or NULL if there is none (end of the written part or damaged)
+static recHdrT * record(char *map, uint32_t size, uint32_t off) {
+	recHdrT *r = (recHdrT *)(map + off);
+
+	if (off + sizeof(recHdrT) > size) return NULL;
+	if ((r->magic != WAL_MAGIC) || (r->len > size - off - sizeof(recHdrT))) return NULL;
+	if (crc32(r+1,r->len) != r->crc) return NULL;
+	return r;
+}
+
+
+// count the records from off, sets the end of the segment
+static void segmentScan(segmentT *s, char *map, uint32_t off) {
+	recHdrT *r;
+
+	s->records = 0;
+	while ((r = record(map,s->size,off)) != NULL) {
+		s->records++;
+		off += RECSIZE(r->len);
+	}
+	s->end = off;
+}
+
+
+static void cursorWrite(influx_wal_t *w) {
+	cursorT c;
+
+	if (!w->cursorDirty || (w->cursorFd < 0)) return;
+	c.magic = WAL_CURSOR_MAGIC;
+	c.id = w->seg[0].id;
+	c.off = w->readOff;
+	c.crc = crc32(&c.id,sizeof(c.id) + sizeof(c.off));
+	if ((pwrite(w->cursorFd,&c,sizeof(c),0) != sizeof(c)) || (fdatasync(w->cursorFd) != 0))
+		LOGN(0,"disk queue: unable to write the cursor in %s (%s)",w->dir,strerror(errno));
+	w->cursorDirty = 0;
+}
+
+
+void influxdb_wal_sync(influx_wal_t *w, int force) {
+	segmentT *s;
+	uint32_t from;
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (!w) return;
+	s = &w->seg[w->numSegments-1];
+	if (!force && (s->end - w->syncedEnd < INFLUX_WAL_SYNC_BYTES) && (nowMs() - w->lastSyncMs < INFLUX_WAL_SYNC_MS)) return;
+	if (s->end > w->syncedEnd) {
+		from = w->syncedEnd - w->syncedEnd % page;
+		if (msync(w->wmap + from,s->end - from,MS_SYNC) != 0)
+			LOGN(0,"disk queue: msync in %s failed (%s)",w->dir,strerror(errno));
+		w->syncedEnd = s->end;
+	}
+	cursorWrite(w);
+	w->lastSyncMs = nowMs();
+}
+
+
+// remove the first segment, its records not yet acknowledged are lost
+static void segmentDrop(influx_wal_t *w) {
+	char name[PATH_MAX];
+	segmentT *s = &w->seg[0];
+
+	w->records -= s->records;
+	w->bytes -= s->end - w->readOff;
+	w->dropped += s->records;
+	if (w->rmap) munmap(w->rmap,s->size);
+	w->rmap = NULL;
+	segmentName(w,s->id,name,sizeof(name));
+	unlink(name);
+	w->numSegments--;
+	memmove(&w->seg[0],&w->seg[1],sizeof(*w->seg) * w->numSegments);
+	w->readOff = 0;
+	w->cursorDirty = 1;
+	if (w->numSegments > 1) {
+		w->rmap = segmentMap(w,&w->seg[0],0);
+		if (!w->rmap) segmentDrop(w);		// unreadable, continue with the next one
+	}
+}
+
+
+// start a new segment, drops the oldest one if the queue is full
+static int segmentNew(influx_wal_t *w) {
+	segmentT s,*seg;
+	char *map;
+
+	seg = realloc(w->seg,sizeof(*w->seg) * (w->numSegments+1));
+	if (!seg) return -1;
+	w->seg = seg;
+	memset(&s,0,sizeof(s));
+	s.id = w->numSegments ? w->seg[w->numSegments-1].id + 1 : 1;
+	map = segmentMap(w,&s,INFLUX_WAL_SEGMENT_SIZE);
+	if (!map) return -1;
+	if (w->numSegments) {
+		influxdb_wal_sync(w,1);
+		if (w->numSegments == 1) w->rmap = w->wmap;		// the last segment becomes the first one to read
+		else munmap(w->wmap,w->seg[w->numSegments-1].size);
+	}
+	w->wmap = map;
+	w->syncedEnd = 0;
+	w->seg[w->numSegments++] = s;
+	while (w->numSegments > w->maxSegments) {
+		if (w->seg[0].records) LOGN(0,"disk queue %s full, %u records dropped",w->dir,w->seg[0].records);
+		segmentDrop(w);
+	}
+	return 0;
+}
+
+
+static int idCompare(const void *a, const void *b) {
+	uint32_t x = ((const segmentT *)a)->id;
+	uint32_t y = ((const segmentT *)b)->id;
+	return x < y ? -1 : x > y;
+}
+
+
+influx_wal_t * influxdb_wal_open(const char *dir, size_t maxBytes) {
+	influx_wal_t *w;
+	char name[PATH_MAX];
+	struct dirent *de;
+	cursorT c;
+	uint32_t id;
+	char *map,*p;
+	DIR *d;
+	int i,n;
+
+	if ((mkdir(dir,0755) != 0) && (errno != EEXIST)) {
+		LOGN(0,"disk queue: unable to create %s (%s)",dir,strerror(errno));
+		return NULL;
+	}
+	w = calloc(1,sizeof(*w));
+	if (!w) return NULL;
+	w->dir = strdup(dir);
+	w->maxSegments = maxBytes / INFLUX_WAL_SEGMENT_SIZE;
+	if (w->maxSegments < WAL_MIN_SEGMENTS) w->maxSegments = WAL_MIN_SEGMENTS;
+	snprintf(name,sizeof(name),"%s/cursor",dir);
+	w->cursorFd = open(name,O_RDWR | O_CREAT | O_CLOEXEC,0644);
+	d = opendir(dir);
+	if (!w->dir || (w->cursorFd < 0) || !d) {
+		LOGN(0,"disk queue: unable to open %s (%s)",dir,strerror(errno));
+		if (d) closedir(d);
+		influxdb_wal_close(w);
+		return NULL;
+	}
+
+	// existing segments, oldest first
+	n = 0;
+	while ((de = readdir(d)) != NULL) {
+		id = strtoul(de->d_name,&p,10);
+		if ((p != de->d_name + 8) || strcmp(p,".wal") || !id) continue;
+		if (w->numSegments == n) {
+			n = n ? n*2 : 16;
+			w->seg = realloc(w->seg,sizeof(*w->seg) * (n+1));
+			if (!w->seg) { closedir(d); influxdb_wal_close(w); return NULL; }
+		}
+		memset(&w->seg[w->numSegments],0,sizeof(*w->seg));
+		w->seg[w->numSegments++].id = id;
+	}
+	closedir(d);
+	if (w->numSegments) qsort(w->seg,w->numSegments,sizeof(*w->seg),idCompare);
+
+	// segments before the cursor have been posted, without a valid cursor all are read
+	if ((pread(w->cursorFd,&c,sizeof(c),0) == sizeof(c)) && (c.magic == WAL_CURSOR_MAGIC) && (c.crc == crc32(&c.id,sizeof(c.id) + sizeof(c.off))))
+		while (w->numSegments && (w->seg[0].id <= c.id)) {
+			if (w->seg[0].id == c.id) { w->readOff = c.off; break; }
+			segmentName(w,w->seg[0].id,name,sizeof(name));
+			unlink(name);
+			w->numSegments--;
+			memmove(&w->seg[0],&w->seg[1],sizeof(*w->seg) * w->numSegments);
+		}
+
+	for (i=0;i<w->numSegments;i++) {
+		map = segmentMap(w,&w->seg[i],0);
+		if (!map) {
+			memmove(&w->seg[i],&w->seg[i+1],sizeof(*w->seg) * (w->numSegments-i-1));
+			w->numSegments--; i--;
+			if (i < 0) w->readOff = 0;
+			continue;
+		}
+		if ((i == 0) && (w->readOff > w->seg[0].size)) w->readOff = 0;
+		segmentScan(&w->seg[i],map,i ? 0 : w->readOff);
+		w->records += w->seg[i].records;
+		w->bytes += w->seg[i].end - (i ? 0 : w->readOff);
+		if (i == w->numSegments-1) {
+			uint32_t end;
+			// clear a record partially written before a crash, it would be seen as valid after a shorter one
+			for (end=w->seg[i].size;(end > w->seg[i].end) && !map[end-1];end--);
+			if (end > w->seg[i].end) memset(map + w->seg[i].end,0,end - w->seg[i].end);
+			w->wmap = map;
+			w->syncedEnd = w->seg[i].end;
+		} else if (i == 0) w->rmap = map;
+		else munmap(map,w->seg[i].size);
+	}
+	if (!w->numSegments) {
+		w->readOff = 0;
+		if (segmentNew(w) != 0) { influxdb_wal_close(w); return NULL; }
+	}
+	w->cursorDirty = 1;
+	influxdb_wal_sync(w,1);
+	if (w->records) LOGN(0,"disk queue %s: %llu records (%llu kB) not yet posted",dir,(unsigned long long)w->records,(unsigned long long)w->bytes / 1024);
+	return w;
+}
+
+
+void influxdb_wal_close(influx_wal_t *w) {
+	if (!w) return;
+	if (w->numSegments) {
+		influxdb_wal_sync(w,1);
+		if (w->rmap) munmap(w->rmap,w->seg[0].size);
+		if (w->wmap) munmap(w->wmap,w->seg[w->numSegments-1].size);
+	}
+	if (w->cursorFd >= 0) close(w->cursorFd);
+	free(w->seg);
+	free(w->dir);
+	free(w);
+}
+
+
+int influxdb_wal_append(influx_wal_t *w, const char *data, size_t len) {
+	segmentT *s;
+	recHdrT *r;
+	size_t size = RECSIZE(len);
+
+	if (!w || (size > INFLUX_WAL_SEGMENT_SIZE)) return -1;
+	s = &w->seg[w->numSegments-1];
+	if (s->end + size > s->size) {
+		if (segmentNew(w) != 0) return -1;
+		s = &w->seg[w->numSegments-1];
+	}
+	r = (recHdrT *)(w->wmap + s->end);
+	memcpy(r+1,data,len);
+	r->len = len;
+	r->crc = crc32(data,len);
+	r->magic = WAL_MAGIC;
+	s->end += size;
+	s->records++;
+	w->records++;
+	w->bytes += size;
+	influxdb_wal_sync(w,0);
+	return 0;
+}
+
+
+int influxdb_wal_peek(influx_wal_t *w, uint32_t *pos, const char **data, size_t *len) {
+	recHdrT *r;
+	char *map;
+	uint32_t off;
+
+	if (!w) return 0;
+	while (w->records) {
+		off = *pos ? *pos : w->readOff;
+		map = w->numSegments > 1 ? w->rmap : w->wmap;
+		r = off < w->seg[0].end ? record(map,w->seg[0].size,off) : NULL;
+		if (r) {
+			*data = (const char *)(r+1);
+			*len = r->len;
+			*pos = off + RECSIZE(r->len);
+			return 1;
+		}
+		if (*pos || (w->numSegments == 1)) break;		// the following records are in the next segment
+		if (w->seg[0].records) LOGN(0,"disk queue: segment %u of %s damaged, %u records lost",w->seg[0].id,w->dir,w->seg[0].records);
+		segmentDrop(w);
+	}
+	return 0;
+}
+
+
+void influxdb_wal_ack(influx_wal_t *w, int n) {
+	recHdrT *r;
+
+	if (!w) return;
+	while ((n-- > 0) && w->records && (w->readOff < w->seg[0].end)) {
+		r = (recHdrT *)((w->numSegments > 1 ? w->rmap : w->wmap) + w->readOff);
+		w->readOff += RECSIZE(r->len);
+		w->bytes -= RECSIZE(r->len);
+		w->seg[0].records--;
+		w->records--;
+		w->cursorDirty = 1;
+		if ((w->readOff >= w->seg[0].end) && (w->numSegments > 1)) segmentDrop(w);
+	}
+	// once drained, nothing else would write the cursor until the next outage and a restart would post everything again
+	influxdb_wal_sync(w,!w->records);
+}
+
+
+void influxdb_wal_stats(influx_wal_t *w, uint64_t *records, uint64_t *bytes, uint64_t *dropped) {
+	*records = w ? w->records : 0;
+	*bytes = w ? w->bytes : 0;
+	*dropped = w ? w->dropped : 0;
+}
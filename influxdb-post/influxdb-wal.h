@@ -0,0 +1,63 @@
+#ifndef _INFLUXDB_WAL_H_
+#define _INFLUXDB_WAL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * disk queue for posts that could not be sent
+ *
+ * Records are appended to segment files (<dir>/00000001.wal, ...) of INFLUX_WAL_SEGMENT_SIZE that are
+ * mmap'd, each record has a header with its length and a crc32. The position of the oldest record not
+ * yet posted is kept in <dir>/cursor, after a restart reading resumes there. Appended records and the
+ * cursor are written to disk together (group commit), at most every INFLUX_WAL_SYNC_MS or when
+ * INFLUX_WAL_SYNC_BYTES have been appended, to limit the writes to flash. A power failure loses the
+ * records since the last sync, records already posted may be posted again.
+ * If the queue exceeds its size, the oldest segment is dropped.
+ *
+ *     influx_wal_t *w = influxdb_wal_open("/data/pylon2influx", 64*1024*1024);
+ *     influxdb_wal_append(w, buf, len);
+ *     pos = 0;
+ *     for (n = 0; influxdb_wal_peek(w, &pos, &data, &len) > 0; n++) append(body, data, len);
+ *     if (post(body) == 0) influxdb_wal_ack(w, n);
+ *     influxdb_wal_close(w);
+ *
+ * Not thread safe.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define INFLUX_WAL_SEGMENT_SIZE (1024*1024)
+#define INFLUX_WAL_SYNC_MS 30000
+#define INFLUX_WAL_SYNC_BYTES (64*1024)
+
+typedef struct influx_wal_s influx_wal_t;
+
+// open or create the queue in dir, maxBytes limits the size of all segments
+influx_wal_t * influxdb_wal_open(const char *dir, size_t maxBytes);
+void influxdb_wal_close(influx_wal_t *w);
+
+// returns 0 or -1 if the record is larger than a segment or the segment can not be created
+int influxdb_wal_append(influx_wal_t *w, const char *data, size_t len);
+
+// records not yet acknowledged, oldest first: pos is 0 for the oldest one and advanced to the next
+// data is valid until the next call of append or ack
+// returns 1 or 0 if there are no more records in the segment of the oldest one
+int influxdb_wal_peek(influx_wal_t *w, uint32_t *pos, const char **data, size_t *len);
+
+// remove the n oldest records, the cursor is written to disk at once when the queue becomes empty
+void influxdb_wal_ack(influx_wal_t *w, int n);
+
+// write appended records and the cursor to disk, if force is 0 only if due
+void influxdb_wal_sync(influx_wal_t *w, int force);
+
+// records and bytes queued, records dropped because the queue was full
+void influxdb_wal_stats(influx_wal_t *w, uint64_t *records, uint64_t *bytes, uint64_t *dropped);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INFLUXDB_WAL_H_
@@ -1,18 +1,36 @@
 #include "log.h"
 #include <syslog.h>
 #include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
 
-int log_verbosity = 0;
-int log_syslog = 0;
+#define LOG_LINELEN 1024
+#define LOG_TAGLEN 32
+
+static atomic_int log_verbosity;
+static atomic_int log_syslog;
+
+static __thread char threadTag[LOG_TAGLEN];
+
+int log_getVerboseLevel() {
+    return atomic_load_explicit(&log_verbosity, memory_order_relaxed);
+}
 
 void log_setVerboseLevel (int verboseLevel) {
-    log_verbosity = verboseLevel;
+    atomic_store(&log_verbosity, verboseLevel);
 }
 
 void log_incVerboseLevel() {
     log_verbosity++;
 }
 
+void log_decVerboseLevel() {
+    int v = log_verbosity;
+
+    while ((v > 0) && !atomic_compare_exchange_weak(&log_verbosity, &v, v - 1));
+}
+
 void log_setSyslogTarget (const char * progName) {
 #ifndef ESP
     if (log_syslog == 0) {
@@ -23,12 +41,63 @@ void log_setSyslogTarget (const char * progName) {
 #endif
 }
 
+void log_setThreadTag (const char * tag) {
+	if (tag) snprintf(threadTag,sizeof(threadTag),"[%s] ",tag);
+	else threadTag[0] = 0;
+}
+
+// thread tag and message in buf, messages longer than buf (e.g. usage) on the heap,
+// size is the size of the returned line with room for a newline, free it if it is not buf
+static char * log_format(char *buf, size_t *size, const char *format, va_list args)
+{
+	char *line;
+	va_list args2;
+	int len,n;
+
+	va_copy(args2,args);
+	len = snprintf(buf,*size,"%s",threadTag);
+	n = vsnprintf(buf+len,*size-len,format,args);
+	if ((n < 0) || (len + n + 2 <= (int)*size)) {
+		va_end(args2);
+		return buf;
+	}
+	line = malloc(len + n + 2);
+	if (line) {
+		*size = len + n + 2;
+		strcpy(line,threadTag);
+		vsnprintf(line+len,*size-len,format,args2);
+	} else line = buf;					// truncated
+	va_end(args2);
+	return line;
+}
+
+// format the whole message first and write it with one call, messages of different threads are not mixed
+static void log_vprintf(FILE *stream, int priority, int newline, const char *format, va_list args)
+{
+	char buf[LOG_LINELEN];
+	size_t size = sizeof(buf);
+	char *line = log_format(buf,&size,format,args);
+	int len;
+
+	if (log_syslog) {
+		syslog(priority,"%s",line);
+	} else {
+		if (newline) {
+			len = strlen(line);
+			if (len >= (int)size-1) len = size-2;
+			line[len++] = '\n';
+			line[len] = 0;
+		}
+		fputs(line,stream);
+	}
+	if (line != buf) free(line);
+}
+
 void log_fprintf(FILE *stream, int priority, const char *format, ...)
 {
 	va_list args;
     va_start(args, format);
-    if (log_syslog) vsyslog(priority,format,args);
-	else vfprintf(stream,format,args);
+    log_vprintf(stream,priority,0,format,args);
     va_end(args);
 }
 
@@ -36,12 +105,7 @@ void log_fprintfn(FILE *stream, int priority, const char *format, ...)
 {
 	va_list args;
     va_start(args, format);
-    if (log_syslog) {
-		vsyslog(priority,format,args);
-    } else {
-    	vfprintf(stream,format,args);
-    	fprintf(stream,"\n");
-    }
+    log_vprintf(stream,priority,1,format,args);
     va_end(args);
 }
 
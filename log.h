@@ -16,21 +16,22 @@ extern "C" {
 
 #include <stdio.h>
 
-extern int log_verbosity;
-extern int log_syslog;
-
-#define verbose log_verbosity
-
+// the verbosity is process wide and may be changed by a signal handler while other threads log
+int log_getVerboseLevel();
 void log_setVerboseLevel (int verboseLevel);
 void log_incVerboseLevel();
+void log_decVerboseLevel();
 void log_setSyslogTarget (const char * progName);
 void log_close();
+// prefix for all messages of the calling thread, e.g. the port a worker polls, NULL for none
+void log_setThreadTag (const char * tag);
+// messages are not limited in length, each one is written with one call
 void log_fprintf(FILE *stream, int priority, const char *format, ...);
 void log_fprintfn(FILE *stream, int priority, const char *format, ...);
 
-#define VPRINTF(LEVEL, FORMAT, ...) if (log_verbosity >= LEVEL) log_fprintf(stdout, LOG_INFO, FORMAT, ##__VA_ARGS__)
-#define VPRINTFN(LEVEL, FORMAT, ...) if (log_verbosity >= LEVEL) log_fprintfn(stdout, LOG_INFO, FORMAT, ##__VA_ARGS__)
-#define PRINTF(FORMAT, ...) if (log_verbosity >= 0) log_fprintf(stdout, LOG_INFO, FORMAT, ##__VA_ARGS__)
+#define VPRINTF(LEVEL, FORMAT, ...) if (log_getVerboseLevel() >= LEVEL) log_fprintf(stdout, LOG_INFO, FORMAT, ##__VA_ARGS__)
+#define VPRINTFN(LEVEL, FORMAT, ...) if (log_getVerboseLevel() >= LEVEL) log_fprintfn(stdout, LOG_INFO, FORMAT, ##__VA_ARGS__)
+#define PRINTF(FORMAT, ...) if (log_getVerboseLevel() >= 0) log_fprintf(stdout, LOG_INFO, FORMAT, ##__VA_ARGS__)
 #define PRINTFN(FORMAT, ...) log_fprintfn(stdout, LOG_INFO, FORMAT, ##__VA_ARGS__)
 #define EPRINTF(FORMAT, ...)  log_fprintf(stderr, LOG_ERR, FORMAT, ##__VA_ARGS__)
 #define EPRINTFN(FORMAT, ...) log_fprintfn(stderr, LOG_ERR, FORMAT, ##__VA_ARGS__)
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "modhistory.h"
+
+// columns of a module, followed by cellsCount cell voltages and tempCount temperatures
+#define COL_TIME 0				// in MODHIST_TIME_RESOLUTION_MS since the start of the block
+#define COL_VOLTAGE 1
+#define COL_CURRENT 2
+#define COL_REMAINING 3
+#define COL_CELLS 4
+
+#define MAX_COLS (COL_CELLS + CELLS_MAX + TEMPS_MAX)
+
+typedef struct {
+	int cols;					// 0 = nothing stored yet
+	uint8_t cellsCount;
+	uint8_t tempCount;
+	int first;					// oldest block
+	int used;					// blocks in use, the newest one may be partially filled
+	uint64_t *blockMs;			// time of the first sample of each block
+	uint16_t *blockCount;		// samples in each block
+	int32_t *base;				// blocks * cols, values of the first sample
+	int16_t *delta;				// blocks * (MODHIST_BLOCK_SAMPLES-1) * cols, to the previous sample
+	int32_t last[MAX_COLS];		// values of the newest sample
+} moduleT;
+
+struct MODHIST_S {
+	int blocksPerModule;
+	int numModules;
+	moduleT *modules;
+};
+
+
+MODHIST_T * modhist_init(int samplesPerModule) {
+	MODHIST_T *h;
+
+	if (samplesPerModule < 1) return NULL;
+	h = calloc(1,sizeof(*h));
+	if (!h) return NULL;
+	// one more for the block being filled
+	h->blocksPerModule = (samplesPerModule + MODHIST_BLOCK_SAMPLES-1) / MODHIST_BLOCK_SAMPLES + 1;
+	return h;
+}
+
+
+static void moduleFree(moduleT *m) {
+	free(m->blockMs);
+	free(m->blockCount);
+	free(m->base);
+	free(m->delta);
+	memset(m,0,sizeof(*m));
+}
+
+
+void modhist_free(MODHIST_T *h) {
+	int i;
+
+	if (!h) return;
+	for (i=0;i<h->numModules;i++) moduleFree(&h->modules[i]);
+	free(h->modules);
+	free(h);
+}
+
+
+static int moduleAlloc(MODHIST_T *h, moduleT *m, int cellsCount, int tempCount) {
+	int n = h->blocksPerModule;
+
+	moduleFree(m);
+	m->cols = COL_CELLS + cellsCount + tempCount;
+	m->cellsCount = cellsCount;
+	m->tempCount = tempCount;
+	m->blockMs = malloc(sizeof(*m->blockMs) * n);
+	m->blockCount = malloc(sizeof(*m->blockCount) * n);
+	m->base = malloc(sizeof(*m->base) * n * m->cols);
+	m->delta = malloc(sizeof(*m->delta) * n * (MODHIST_BLOCK_SAMPLES-1) * m->cols);
+	if (!m->blockMs || !m->blockCount || !m->base || !m->delta) {
+		moduleFree(m);
+		return PYL_ERR;
+	}
+	return PYL_OK;
+}
+
+
+int modhist_add(MODHIST_T *h, int idx, uint64_t timestampMs, const PYL_AnalogDataT *ad) {
+	int32_t v[MAX_COLS];
+	int cellsCount,tempCount,b,c,count,newBlock;
+	int16_t *d;
+	moduleT *m;
+
+	if (!h || (idx < 0)) return PYL_ERR;
+	timestampMs -= timestampMs % MODHIST_TIME_RESOLUTION_MS;
+	if (idx >= h->numModules) {
+		m = realloc(h->modules,sizeof(*m) * (idx+1));
+		if (!m) return PYL_ERR;
+		memset(m + h->numModules,0,sizeof(*m) * (idx+1 - h->numModules));
+		h->modules = m;
+		h->numModules = idx+1;
+	}
+	m = &h->modules[idx];
+
+	cellsCount = ad->cellsCount < 0 ? 0 : ad->cellsCount > CELLS_MAX ? CELLS_MAX : ad->cellsCount;
+	tempCount = ad->tempCount < 0 ? 0 : ad->tempCount > TEMPS_MAX ? TEMPS_MAX : ad->tempCount;
+	if (!m->cols || (cellsCount != m->cellsCount) || (tempCount != m->tempCount))
+		if (moduleAlloc(h,m,cellsCount,tempCount) != PYL_OK) return PYL_ERR;
+
+	v[COL_VOLTAGE] = ad->voltage;
+	v[COL_CURRENT] = ad->current;
+	v[COL_REMAINING] = ad->remainingCapacity;
+	for (c=0;c<cellsCount;c++) v[COL_CELLS+c] = ad->cellVoltage[c];
+	for (c=0;c<tempCount;c++) v[COL_CELLS+cellsCount+c] = ad->temp[c];
+
+	// continue the newest block if all differences fit
+	b = (m->first + m->used-1) % h->blocksPerModule;
+	count = m->used ? m->blockCount[b] : 0;
+	newBlock = !m->used || (count == MODHIST_BLOCK_SAMPLES) || (timestampMs < m->blockMs[b]);
+	if (!newBlock) {
+		v[COL_TIME] = (timestampMs - m->blockMs[b]) / MODHIST_TIME_RESOLUTION_MS;
+		for (c=0;c<m->cols;c++)
+			if ((v[c] - m->last[c] < INT16_MIN) || (v[c] - m->last[c] > INT16_MAX)) { newBlock = 1; break; }
+	}
+
+	if (newBlock) {
+		if (m->used == h->blocksPerModule) {
+			m->first = (m->first + 1) % h->blocksPerModule;
+			m->used--;
+		}
+		b = (m->first + m->used) % h->blocksPerModule;
+		m->used++;
+		m->blockMs[b] = timestampMs;
+		m->blockCount[b] = 1;
+		v[COL_TIME] = 0;
+		memcpy(&m->base[b * m->cols],v,sizeof(*v) * m->cols);
+	} else {
+		d = &m->delta[(b * (MODHIST_BLOCK_SAMPLES-1) + count-1) * m->cols];
+		for (c=0;c<m->cols;c++) d[c] = v[c] - m->last[c];
+		m->blockCount[b]++;
+	}
+	memcpy(m->last,v,sizeof(*v) * m->cols);
+	return PYL_OK;
+}
+
+
+typedef void (*sampleFn)(const MODHIST_SampleT *s, void *arg);
+
+// decode the samples of module idx within the window and call fn for each, oldest first
+// max limits the number of samples, returns the number of samples passed to fn
+static int forEach(MODHIST_T *h, int idx, uint64_t fromMs, uint64_t toMs, int max, sampleFn fn, void *arg) {
+	int32_t v[MAX_COLS];
+	MODHIST_SampleT s;
+	int lo,hi,mid,i,k,c,b,n = 0;
+	const int16_t *d;
+	moduleT *m;
+
+	if (!h || (idx < 0) || (idx >= h->numModules)) return 0;
+	m = &h->modules[idx];
+	if (!m->used) return 0;
+	fromMs -= fromMs % MODHIST_TIME_RESOLUTION_MS;
+
+	// last block starting at or before fromMs, the blocks before only have older samples
+	lo = 0;
+	hi = m->used-1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (m->blockMs[(m->first + mid) % h->blocksPerModule] <= fromMs) lo = mid;
+		else hi = mid-1;
+	}
+
+	memset(&s,0,sizeof(s));
+	s.cellsCount = m->cellsCount;
+	s.tempCount = m->tempCount;
+	for (i=lo;(i<m->used) && (n<max);i++) {
+		b = (m->first + i) % h->blocksPerModule;
+		if (m->blockMs[b] > toMs) break;
+		memcpy(v,&m->base[b * m->cols],sizeof(*v) * m->cols);
+		d = &m->delta[b * (MODHIST_BLOCK_SAMPLES-1) * m->cols];
+		for (k=0;(k<m->blockCount[b]) && (n<max);k++) {
+			if (k > 0) {
+				for (c=0;c<m->cols;c++) v[c] += d[c];
+				d += m->cols;
+			}
+			s.timestamp = m->blockMs[b] + (uint64_t)v[COL_TIME] * MODHIST_TIME_RESOLUTION_MS;
+			if (s.timestamp < fromMs) continue;
+			if (s.timestamp > toMs) break;
+			s.voltage = v[COL_VOLTAGE];
+			s.current = v[COL_CURRENT];
+			s.remainingCapacity = v[COL_REMAINING];
+			for (c=0;c<m->cellsCount;c++) s.cellVoltage[c] = v[COL_CELLS+c];
+			for (c=0;c<m->tempCount;c++) s.temp[c] = v[COL_CELLS+m->cellsCount+c];
+			fn(&s,arg);
+			n++;
+		}
+	}
+	return n;
+}
+
+
+typedef struct {
+	MODHIST_SampleT *out;
+	int n;
+} queryT;
+
+static void querySample(const MODHIST_SampleT *s, void *arg) {
+	queryT *q = (queryT *)arg;
+	q->out[q->n++] = *s;
+}
+
+
+int modhist_query(MODHIST_T *h, int idx, uint64_t fromMs, uint64_t toMs, MODHIST_SampleT *out, int max) {
+	queryT q = { out, 0 };
+
+	if (!out || (max < 1)) return 0;
+	return forEach(h,idx,fromMs,toMs,max,querySample,&q);
+}
+
+
+typedef struct {
+	MODHIST_SummaryT *sum;
+	int64_t voltageSum;
+	int64_t currentSum;
+} summaryT;
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+static void summarySample(const MODHIST_SampleT *s, void *arg) {
+	summaryT *st = (summaryT *)arg;
+	MODHIST_SummaryT *sum = st->sum;
+	int first = sum->samples == 0;
+	int i;
+
+	if (first) {
+		sum->firstMs = s->timestamp;
+		sum->voltageMin = sum->voltageMax = s->voltage;
+		sum->currentMin = sum->currentMax = s->current;
+		sum->remainingFirst = s->remainingCapacity;
+		sum->cellVoltageMin = sum->tempMin = INT32_MAX;
+		sum->cellVoltageMax = sum->tempMax = INT32_MIN;
+	}
+	sum->samples++;
+	sum->lastMs = s->timestamp;
+	sum->voltageMin = MIN(sum->voltageMin,s->voltage);
+	sum->voltageMax = MAX(sum->voltageMax,s->voltage);
+	sum->currentMin = MIN(sum->currentMin,s->current);
+	sum->currentMax = MAX(sum->currentMax,s->current);
+	sum->remainingLast = s->remainingCapacity;
+	st->voltageSum += s->voltage;
+	st->currentSum += s->current;
+	for (i=0;i<s->cellsCount;i++) {
+		sum->cellVoltageMin = MIN(sum->cellVoltageMin,s->cellVoltage[i]);
+		sum->cellVoltageMax = MAX(sum->cellVoltageMax,s->cellVoltage[i]);
+	}
+	for (i=0;i<s->tempCount;i++) {
+		sum->tempMin = MIN(sum->tempMin,s->temp[i]);
+		sum->tempMax = MAX(sum->tempMax,s->temp[i]);
+	}
+}
+
+
+int modhist_summary(MODHIST_T *h, int idx, uint64_t fromMs, uint64_t toMs, MODHIST_SummaryT *sum) {
+	summaryT st;
+
+	if (!sum) return PYL_ERR;
+	memset(sum,0,sizeof(*sum));
+	memset(&st,0,sizeof(st));
+	st.sum = sum;
+	if (forEach(h,idx,fromMs,toMs,INT32_MAX,summarySample,&st) == 0) return PYL_OK;
+	sum->voltageAvg = st.voltageSum / sum->samples;
+	sum->currentAvg = st.currentSum / sum->samples;
+	if (sum->cellVoltageMin > sum->cellVoltageMax) sum->cellVoltageMin = sum->cellVoltageMax = 0;
+	if (sum->tempMin > sum->tempMax) sum->tempMin = sum->tempMax = 0;
+	return PYL_OK;
+}
+
+
+void modhist_usage(MODHIST_T *h, uint64_t *samples, size_t *bytes) {
+	moduleT *m;
+	int i,k;
+
+	*samples = 0;
+	*bytes = 0;
+	if (!h) return;
+	*bytes = sizeof(*h) + sizeof(*m) * h->numModules;
+	for (i=0;i<h->numModules;i++) {
+		m = &h->modules[i];
+		if (!m->cols) continue;
+		for (k=0;k<m->used;k++) *samples += m->blockCount[(m->first + k) % h->blocksPerModule];
+		*bytes += (sizeof(*m->blockMs) + sizeof(*m->blockCount) + sizeof(*m->base) * m->cols
+			+ sizeof(*m->delta) * (MODHIST_BLOCK_SAMPLES-1) * m->cols) * h->blocksPerModule;
+	}
+}
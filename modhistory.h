@@ -0,0 +1,75 @@
+#ifndef MODHISTORY_H_INCLUDED
+#define MODHISTORY_H_INCLUDED
+
+/*
+ * module history
+ *
+ * recent samples of each module in memory, one ring per module (same index as in the module registry).
+ * The values are stored in columns (time, voltage, current, remaining capacity, cell voltages, temperatures)
+ * as int16 difference to the previous sample. Samples are grouped in blocks of MODHIST_BLOCK_SAMPLES, each
+ * block starts with the absolute values of its first sample, so a block can be decoded on its own. A
+ * difference that does not fit into int16 starts a new block. The ring has room for samplesPerModule
+ * samples in full blocks plus the block being filled, when it is full the oldest block is dropped. So at
+ * least samplesPerModule samples are kept only as long as no block was started early (a jump of a value
+ * by more than 32767, a timestamp going back or more than 3276.7 s between two samples), each early block
+ * holds fewer samples and shortens the history.
+ *
+ *     MODHIST_T *h = modhist_init(samplesPerModule);
+ *     modhist_add(h, idx, timestampMs, &ad);
+ *     n = modhist_query(h, idx, fromMs, toMs, samples, max);
+ *     modhist_summary(h, idx, fromMs, toMs, &sum);
+ *
+ * A module with 15 cells and 5 temperatures needs about 50 bytes per sample (48 for the differences and
+ * the absolute values of the first sample of each block), 24 h with a poll interval of 5 s about 0.85 MB.
+ * Not thread safe, the caller has to lock if several threads use the same history.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pylontechapi.h"
+
+#define MODHIST_BLOCK_SAMPLES 64
+#define MODHIST_TIME_RESOLUTION_MS 100		// timestamps are rounded down to this
+
+typedef struct {
+	uint64_t timestamp;					// ms since epoch
+	int voltage;						// mV
+	int current;						// 100 mA
+	int remainingCapacity;				// mAh
+	uint8_t cellsCount;
+	uint8_t tempCount;
+	int16_t cellVoltage[CELLS_MAX];		// mV
+	int16_t temp[TEMPS_MAX];			// degree celsius
+} MODHIST_SampleT;
+
+typedef struct {
+	uint32_t samples;					// in the window, the other fields are only valid if > 0
+	uint64_t firstMs;
+	uint64_t lastMs;
+	int voltageMin,voltageMax,voltageAvg;
+	int currentMin,currentMax,currentAvg;
+	int cellVoltageMin,cellVoltageMax;	// over all cells
+	int tempMin,tempMax;
+	int remainingFirst,remainingLast;
+} MODHIST_SummaryT;
+
+typedef struct MODHIST_S MODHIST_T;
+
+MODHIST_T * modhist_init(int samplesPerModule);
+void modhist_free(MODHIST_T *h);
+
+// append a sample of module idx (grows the history as needed), timestampMs should be increasing
+// a change of the number of cells or temperatures clears the history of the module
+int modhist_add(MODHIST_T *h, int idx, uint64_t timestampMs, const PYL_AnalogDataT *ad);
+
+// samples of module idx with fromMs <= timestamp <= toMs, oldest first
+// returns the number of samples copied to out (at most max)
+int modhist_query(MODHIST_T *h, int idx, uint64_t fromMs, uint64_t toMs, MODHIST_SampleT *out, int max);
+
+// statistics of the samples of module idx with fromMs <= timestamp <= toMs
+int modhist_summary(MODHIST_T *h, int idx, uint64_t fromMs, uint64_t toMs, MODHIST_SummaryT *sum);
+
+// samples stored and bytes allocated for all modules
+void modhist_usage(MODHIST_T *h, uint64_t *samples, size_t *bytes);
+
+#endif // MODHISTORY_H_INCLUDED
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "modregistry.h"
+
+#define MODREG_INITIAL_SIZE 16
+
+
+MODREG_T * modreg_init(int numPorts) {
+	MODREG_T *reg;
+	int i;
+
+	if (numPorts < 1) return NULL;
+	reg = calloc(1,sizeof(*reg));
+	if (!reg) return NULL;
+	reg->numPorts = numPorts;
+	reg->index = malloc(sizeof(*reg->index) * numPorts * MODREG_SLOTS_PER_PORT);
+	if (!reg->index) { free(reg); return NULL; }
+	for (i=0;i<numPorts * MODREG_SLOTS_PER_PORT;i++) reg->index[i] = -1;
+	return reg;
+}
+
+
+void modreg_free(MODREG_T *reg) {
+	if (!reg) return;
+	free(reg->entries);
+	free(reg->index);
+	free(reg);
+}
+
+
+static int slot(MODREG_T *reg, int port, int group, int adr) {
+	if ((port < 0) || (port >= reg->numPorts)) return -1;
+	if ((group < 0) || (group >= PYL_MAX_GROUPS)) return -1;
+	if ((adr < 1) || (adr > MODREG_ADR_PER_GROUP)) return -1;
+	return port * MODREG_SLOTS_PER_PORT + group * MODREG_ADR_PER_GROUP + adr-1;
+}
+
+
+int modreg_find(MODREG_T *reg, int port, int group, int adr) {
+	int s = slot(reg,port,group,adr);
+	return s < 0 ? -1 : reg->index[s];
+}
+
+
+int modreg_add(MODREG_T *reg, int port, int group, int adr) {
+	MODREG_EntryT *e;
+	int s = slot(reg,port,group,adr);
+
+	if (s < 0) return -1;
+	if (reg->index[s] >= 0) return reg->index[s];
+
+	if (reg->count == reg->size) {
+		int size = reg->size ? reg->size * 2 : MODREG_INITIAL_SIZE;
+		e = realloc(reg->entries, sizeof(*e) * size);
+		if (!e) return -1;
+		reg->entries = e;
+		reg->size = size;
+	}
+	e = &reg->entries[reg->count];
+	memset(e,0,sizeof(*e));
+	e->port = port;
+	e->group = group;
+	e->adr = adr;
+	reg->index[s] = reg->count;
+	return reg->count++;
+}
+
+
+int modreg_update(MODREG_EntryT *m, int rc, uint32_t latencyMs) {
+	int health = m->health;
+
+	m->polls++;
+	if (rc == PYL_OK) {
+		m->consecutiveErrors = 0;
+		m->latencyLastMs = latencyMs;
+		if (latencyMs > m->latencyMaxMs) m->latencyMaxMs = latencyMs;
+		m->latencySumMs += latencyMs;
+		m->health = MODREG_HEALTH_OK;
+	} else {
+		m->errors++;
+		if (m->consecutiveErrors < UINT16_MAX) m->consecutiveErrors++;
+		m->health = m->consecutiveErrors >= MODREG_FAIL_THRESHOLD ? MODREG_HEALTH_FAILED : MODREG_HEALTH_DEGRADED;
+	}
+	// degraded is reported only in the statistics
+	return (health != m->health) && (health == MODREG_HEALTH_FAILED || m->health == MODREG_HEALTH_FAILED);
+}
+
+
+const char * modreg_healthStr(int health) {
+	switch (health) {
+		case MODREG_HEALTH_OK: return "ok";
+		case MODREG_HEALTH_DEGRADED: return "degraded";
+		case MODREG_HEALTH_FAILED: return "failed";
+	}
+	return "unknown";
+}
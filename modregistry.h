@@ -0,0 +1,76 @@
+#ifndef MODREGISTRY_H_INCLUDED
+#define MODREGISTRY_H_INCLUDED
+
+/*
+ * module registry
+ *
+ * per-module state (last sample, last sample sent, health and latency) of all modules on all ports
+ * in one contiguous table, growing as modules are added. Modules are found by (port, group, adr)
+ * through an index map with one slot per possible address, so lookups are O(1) regardless of the
+ * number of modules.
+ *
+ *     MODREG_T *reg = modreg_init(numPorts);
+ *     int idx = modreg_add(reg, port, group, adr);
+ *     MODREG_EntryT *m = modreg_get(reg, idx);
+ *
+ * Entry pointers are invalidated by modreg_add, indices are stable.
+ */
+
+#include <stdint.h>
+#include "pylontechapi.h"
+
+#define MODREG_ADR_PER_GROUP 16
+#define MODREG_SLOTS_PER_PORT (PYL_MAX_GROUPS * MODREG_ADR_PER_GROUP)
+
+// consecutive failed polls until a module is marked as failed
+#define MODREG_FAIL_THRESHOLD 3
+
+#define MODREG_HEALTH_OK 0
+#define MODREG_HEALTH_DEGRADED 1		// last poll(s) failed
+#define MODREG_HEALTH_FAILED 2			// MODREG_FAIL_THRESHOLD polls in a row failed
+
+typedef struct {
+	uint16_t port;
+	uint8_t group;
+	uint8_t adr;						// first module is 1
+	uint8_t health;
+	uint16_t consecutiveErrors;
+	uint32_t polls;
+	uint32_t errors;
+	uint32_t latencyLastMs;				// time for a successful request
+	uint32_t latencyMaxMs;
+	uint64_t latencySumMs;				// of successful polls, for the average
+	PYL_AnalogDataT ad;					// last sample
+	PYL_AnalogDataT adSent;				// last sample written to influxdb
+	uint8_t valid;						// PYL_SHM_VALID_x, alarm and charge info are polled for --shm and --dbus only
+	PYL_AlarmInfoT ai;
+	PYL_ChargeDischargeInfoT cd;
+} MODREG_EntryT;
+
+typedef struct {
+	int numPorts;
+	int count;
+	int size;							// allocated entries
+	MODREG_EntryT *entries;
+	int32_t *index;						// numPorts * MODREG_SLOTS_PER_PORT, -1 = no module
+} MODREG_T;
+
+MODREG_T * modreg_init(int numPorts);
+void modreg_free(MODREG_T *reg);
+
+// add a module, returns its index (the existing one if already registered) or -1
+int modreg_add(MODREG_T *reg, int port, int group, int adr);
+
+// index of a module or -1
+int modreg_find(MODREG_T *reg, int port, int group, int adr);
+
+static inline int modreg_count(MODREG_T *reg) { return reg->count; }
+static inline MODREG_EntryT * modreg_get(MODREG_T *reg, int idx) { return &reg->entries[idx]; }
+
+// update the statistics after a poll, rc is the result of the request
+// returns 1 if the health of the module changed
+int modreg_update(MODREG_EntryT *m, int rc, uint32_t latencyMs);
+
+const char * modreg_healthStr(int health);
+
+#endif // MODREGISTRY_H_INCLUDED
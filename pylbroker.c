@@ -0,0 +1,168 @@
+/*
+ * pylbroker.c
+ *
+ * client side of the broker and the commands it forwards, see pylbroker.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "pylbroker.h"
+#include "util.h"
+
+static const int brokerCmds[PYL_BROKER_NUM_CMDS] = {
+	PYL_CMD_ANALOGDATA, PYL_CMD_ALARMINFO, PYL_CMD_CHARGEDISCHARGEINFO, PYL_CMD_SYSTEMPARAMETER,
+	PYL_CMD_MANUFACTURERINFO, PYL_CMD_SERIALNUMBER, PYL_CMD_PROTOCOLVERSION };
+
+
+int pylb_cmdIndex(int cmd) {
+	int i;
+
+	for (i=0;i<PYL_BROKER_NUM_CMDS;i++)
+		if (brokerCmds[i] == cmd) return i;
+	return -1;
+}
+
+
+int pylb_execute(PYL_HandleT *pyl, int cmd, PYL_BrokerDataT *data) {
+	memset(data,0,sizeof(*data));
+	switch (cmd) {
+		case PYL_CMD_ANALOGDATA: return pyl_getAnalogData(pyl,&data->ad);
+		case PYL_CMD_ALARMINFO: return pyl_getAlarmInfo(pyl,&data->ai);
+		case PYL_CMD_CHARGEDISCHARGEINFO: return pyl_getChargeDischargeInfo(pyl,&data->cd);
+		case PYL_CMD_SYSTEMPARAMETER: return pyl_getSystemParameter(pyl,&data->sp);
+		case PYL_CMD_MANUFACTURERINFO: return pyl_getManufacturerInformation(pyl,&data->mi);
+		case PYL_CMD_SERIALNUMBER: return pyl_getSerialNumber(pyl,&data->sn);
+		case PYL_CMD_PROTOCOLVERSION: return pyl_getProtocolVersion(pyl);
+	}
+	return PYL_ERR;
+}
+
+
+// static data does not change while the module is running
+static uint32_t maxAge(int cmd) {
+	switch (cmd) {
+		case PYL_CMD_SYSTEMPARAMETER:
+		case PYL_CMD_MANUFACTURERINFO:
+		case PYL_CMD_SERIALNUMBER:
+		case PYL_CMD_PROTOCOLVERSION:
+			return PYL_BROKER_MAXAGE_STATIC_MS;
+	}
+	return PYL_BROKER_MAXAGE_MS;
+}
+
+
+static uint32_t lastSeq;
+
+static int transaction(int fd, PYL_BrokerRequestT *req, PYL_BrokerResponseT *res) {
+	struct pollfd pfd;
+	uint64_t end;
+	ssize_t len;
+	int ms;
+
+	req->magic = PYL_BROKER_MAGIC;
+	req->seq = ++lastSeq;
+	if (send(fd, req, sizeof(*req), MSG_NOSIGNAL) != sizeof(*req)) {
+		LOG(0,"pylb_request: send failed (%s)\n",strerror(errno));
+		return PYL_ERR;
+	}
+	// responses to earlier requests that timed out may still arrive
+	end = getMonotonicMs() + PYL_BROKER_TIMEOUT_MS;
+	do {
+		ms = (int64_t)(end - getMonotonicMs());
+		pfd.fd = fd; pfd.events = POLLIN;
+		if ((ms <= 0) || (poll(&pfd,1,ms) <= 0)) {
+			LOG(0,"pylb_request: no response from the broker\n");
+			return PYL_TIMEOUT;
+		}
+		len = recv(fd, res, sizeof(*res), 0);
+		if ((len != sizeof(*res)) || (res->magic != PYL_BROKER_MAGIC)) {
+			LOG(0,"pylb_request: invalid response from the broker\n");
+			return PYL_ERR;
+		}
+		if (res->seq != req->seq) LOG(1,"pylb_request: late response %u dropped, waiting for %u\n",res->seq,req->seq);
+	} while (res->seq != req->seq);
+	return res->rc;
+}
+
+
+static int request(PYL_HandleT *pyl, int cmd, uint32_t maxAgeMs, void *dest, int size) {
+	PYL_BrokerRequestT req;
+	PYL_BrokerResponseT res;
+	int rc;
+
+	memset(&req,0,sizeof(req));
+	req.cmd = cmd;
+	req.group = pyl->group;
+	req.adr = pyl->adr;
+	req.maxAgeMs = maxAgeMs;
+	memset(&res,0,sizeof(res));
+	if (pyl->portname) strncpy(req.portname,pyl->portname,sizeof(req.portname)-1);
+	rc = transaction(pyl->broker->fd,&req,&res);
+	VPRINTF(2,"pylb_request: cmd 0x%02x group %d adr %d, rc %d, age %u ms\n",cmd,pyl->group,pyl->adr,rc,res.ageMs);
+	if ((rc == PYL_OK) && dest) memcpy(dest,&res.data,size < (int)sizeof(res.data) ? size : (int)sizeof(res.data));
+	return rc;
+}
+
+
+int pylb_request(PYL_HandleT *pyl, int cmd, void *dest, int size) {
+	return request(pyl,cmd,maxAge(cmd),dest,size);
+}
+
+
+int pylb_history(PYL_HandleT *pyl, uint32_t windowMs, MODHIST_SummaryT *sum) {
+	return request(pyl,PYL_BROKER_CMD_HISTORY,windowMs,sum,sizeof(*sum));
+}
+
+
+int pyl_connectBroker(PYL_HandleT *pyl, const char *socketPath, const char *portname, int groupNum) {
+	struct sockaddr_un addr;
+	PYL_BrokerRequestT req;
+	PYL_BrokerResponseT res;
+	int fd;
+
+	if (!pyl || strlen(socketPath) >= sizeof(addr.sun_path)) return -1;
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path,socketPath);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		VPRINTF(1,"pyl_connectBroker: no broker at %s (%s)\n",socketPath,strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	memset(&req,0,sizeof(req));
+	req.cmd = PYL_BROKER_CMD_INFO;
+	req.group = groupNum;
+	if (portname) strncpy(req.portname,portname,sizeof(req.portname)-1);
+	if (transaction(fd,&req,&res) != PYL_OK) {
+		VPRINTF(1,"pyl_connectBroker: broker at %s does not serve %s group %d\n",socketPath,portname && *portname ? portname : "-",groupNum);
+		close(fd);
+		return -1;
+	}
+
+	pyl->broker = calloc(1,sizeof(*pyl->broker));
+	if (!pyl->broker) { close(fd); return -1; }
+	pyl->broker->fd = fd;
+	if (portname && *portname) pyl->portname = strdup(portname);
+	pyl->group = groupNum;
+	pyl->numDevicesFound = res.data.numDevices;
+	if ((groupNum >= 0) && (groupNum < PYL_MAX_GROUPS)) pyl->groupDevices[groupNum] = pyl->numDevicesFound;
+	pyl->initialized = 1;
+	return pyl->numDevicesFound;
+}
+
+
+void pylb_close(PYL_HandleT *pyl) {
+	if (!pyl->broker) return;
+	close(pyl->broker->fd);
+	free(pyl->broker);
+	pyl->broker = NULL;
+}
@@ -0,0 +1,83 @@
+/*
+ * pylbroker.h
+ *
+ * requests to the process owning the serial port (pylon2influx --socket) instead of the port itself
+ *
+ * The broker answers from its cache if the data is not older than the age the client accepts,
+ * identical requests of several clients result in one request on the bus and requests of clients
+ * are sent before the next request of the poll cycle. Used by pylontechapi.c if pyl->broker is set,
+ * see pyl_connectBroker. The pyl_get... functions work as with a directly connected port.
+ *
+ * The messages are sent as one packet each over a SOCK_SEQPACKET unix socket, both sides are
+ * on the same host and use the structures of pylontechapi.h as they are.
+ */
+
+#ifndef PYLBROKER_H_INCLUDED
+#define PYLBROKER_H_INCLUDED
+
+#include <stdint.h>
+#include "pylontechapi.h"
+#include "modhistory.h"
+
+#define PYL_BROKER_SOCKET "/run/pylontech.sock"
+#define PYL_BROKER_MAGIC 0x504c4202			// incremented if the messages change
+#define PYL_BROKER_TIMEOUT_MS 10000			// max wait for a response
+
+// max age of cached data accepted by pylb_request
+#define PYL_BROKER_MAXAGE_MS 2000				// analog data, alarm and charge info
+#define PYL_BROKER_MAXAGE_STATIC_MS 3600000		// manufacturer info, serial number, system parameter
+
+#define PYL_BROKER_CMD_INFO 0				// number of modules in the group, numDevices
+#define PYL_BROKER_CMD_HISTORY 1			// summary of the last maxAgeMs of the history (--history), hist
+#define PYL_BROKER_NUM_CMDS 7				// commands forwarded to the bus, see pylb_cmdIndex
+
+typedef union {
+	PYL_AnalogDataT ad;
+	PYL_AlarmInfoT ai;
+	PYL_ChargeDischargeInfoT cd;
+	PYL_SystemParameterT sp;
+	PYL_ManufacturerInformationT mi;
+	PYL_SerialNumberT sn;
+	MODHIST_SummaryT hist;
+	int numDevices;
+} PYL_BrokerDataT;
+
+typedef struct {
+	uint32_t magic;
+	uint8_t cmd;						// PYL_CMD_x, PYL_BROKER_CMD_INFO or PYL_BROKER_CMD_HISTORY
+	uint8_t group;
+	uint8_t adr;						// first device is 1
+	uint8_t reserved;
+	uint32_t maxAgeMs;					// cached data up to this age is fine, 0 = query the module, window for history
+	char portname[64];					// empty for the first port of the broker
+	uint32_t seq;						// returned in the response
+} PYL_BrokerRequestT;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;						// of the request, a late response to a request that timed out is dropped
+	int32_t rc;							// PYL_OK or error
+	uint32_t ageMs;						// of the data, 0 if queried for this request
+	PYL_BrokerDataT data;
+} PYL_BrokerResponseT;
+
+struct PYL_Broker {
+	int fd;
+};
+
+// connect to the broker at socketPath serving portname (NULL or "" for its first port) and group
+// returns the number of modules in the group or -1 if there is no broker or it does not serve the port
+int pyl_connectBroker(PYL_HandleT *pyl, const char *socketPath, const char *portname, int groupNum);
+
+// send cmd for pyl->group/pyl->adr to the broker, the result (size bytes) is copied to dest
+int pylb_request(PYL_HandleT *pyl, int cmd, void *dest, int size);
+// summary of the history the broker keeps for pyl->group/pyl->adr over the last windowMs
+int pylb_history(PYL_HandleT *pyl, uint32_t windowMs, MODHIST_SummaryT *sum);
+void pylb_close(PYL_HandleT *pyl);
+
+// broker side: 0..PYL_BROKER_NUM_CMDS-1 for the commands forwarded to the bus, -1 for others
+int pylb_cmdIndex(int cmd);
+// broker side: run cmd on a directly connected handle
+int pylb_execute(PYL_HandleT *pyl, int cmd, PYL_BrokerDataT *data);
+
+#endif // PYLBROKER_H_INCLUDED
@@ -16,20 +16,37 @@
 #include <getopt.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include "util.h"
 #include <signal.h>
 #include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <fcntl.h>
 #include "uart.h"
+#include "hotplug.h"
+#include "pyloncan.h"
+#include "modregistry.h"
+#include "modhistory.h"
+#include "spscring.h"
+#include "pylshm.h"
+#include "pylbroker.h"
+#include "vedbus.h"
 #include "pylontechapi.h"
 #include "influxdb-post/influxdb-post.h"
 
-#define VER "1.05 Armin Diehl <ad@ardiehl.de> Oct 23,2024 - compiled " __DATE__ " " __TIME__
+#define VERNUM "1.05"
+#define VER VERNUM " Armin Diehl <ad@ardiehl.de> Oct 23,2024 - compiled " __DATE__ " " __TIME__
 char * ME = "pylon2influx";
 
 
 
-PYL_HandleT* pyl;		// pylontech api handle
-influx_client_t *iClient;
+PYL_CanT *can;			// set if listening on CAN instead of polling
+influx_client_t *iClient;		// lines are formatted by the main thread and posted by the sender thread of each sink
 
 //#define queryIntervalSeconds 15
 #define QUERY_INTERVAL_SECONDS 5
@@ -41,17 +58,31 @@ influx_client_t *iClient;
 
 int queryIntervalSeconds = QUERY_INTERVAL_SECONDS;
 
-// buffer max 2 days
-#define NUM_RECS_TO_BUFFER_ON_FAILURE 2*24*60 / sendIntervalSeconds
+#define HISTORY_HOURS 24
+#define DISKQUEUE_DIR "/var/lib/pylon2influx"
+#define DISKQUEUE_MB 64
 
+#define CACHE_MB 8
+#define MAX_SINKS 4
+
+
+#ifdef HAVE_DBUS
+#define USAGE_DBUS "  -D, --dbus[=bus]      publish the batteries on the Victron D-Bus, system, session or an address (system)\n"
+#else
+#define USAGE_DBUS
+#endif
 
 void usage(void) {
         PRINTF("Usage: pylon2influx [OPTION]...\n" \
         "  -h, --help            display help and exit\n" \
-        "  -d, --device          specify device (%s)\n" \
+        "  -d, --device          specify device(s) (%s), e.g. /dev/ttyUSB0,/dev/ttyUSB1\n" \
         "  -b, --baud            specify serial baudrate (%d)\n" \
-        "  -g, --group           Pylontech group address (0-15)\n" \
-		"  -s, --server          influxdb server name or ip\n" \
+        "  -g, --group           Pylontech group address(es) (0-15), e.g. 0,1\n" \
+        "  -C, --console         use the console port (pwr/bat commands) instead of RS485\n" \
+        "  -N, --can             CAN interface, listen to the stack data sent to the inverter\n" \
+        "  -I, --isslverifypeer  0: do not check ssl certificate, 1=check\n" \
+		"  -s, --server          influxdb server name or ip, repeat for up to %d servers,\n" \
+		"                        -p..-z following -s apply to this server\n" \
 		"  -p, --port            influxdb port (8086)\n" \
         "  -n, --db              database name\n" \
         "  -u, --user            influxdb user name\n" \
@@ -60,43 +91,196 @@ void usage(void) {
         "  -O, --org             influxdb v2 org\n" \
         "  -T, --token           influxdb v2 auth api token\n" \
 		"  -A, --influxapi       api string for influx, replaces db..token\n" \
-        "  -I, --isslverifypeer  0: do not check ssl certificate, 1=check\n" \
-        "  -c, --cache           #entries for influxdb cache (%d)\n" \
+        "  -x, --tcpnodelay      0: wait for more data before sending to tcp://server (1)\n" \
+        "  -c, --cache           max memory for the influxdb cache in MB (%d)\n" \
+        "  -P, --postsize        max size of a request sending the cache in kB (%d)\n" \
+        "  -z, --gzip[=bytes]    compress posts of at least bytes (%d)\n" \
         "  -v, --verbose[=x]     increase verbose level\n" \
         "  -y, --syslog          log to syslog insead of stderr\n" \
         "  -Y, --syslogtest      send a testtext to syslog and exit\n" \
         "  -e, --version         show version\n" \
         "  -q, --query           query interval in seconds (%d)\n" \
-        "  -t, --try             try to connect returns 0 on success\n\n" \
+        "  -t, --try             try to connect returns 0 on success\n" \
+        "  -H, --hotplug         suspend polling while the usb adapter is unplugged\n" \
+        "  -m, --shm[=name]      publish the module data in shared memory (%s)\n" \
+        "  -k, --socket[=path]   answer requests of other programs, e.g. pylontech (%s)\n" \
+        "  -R, --history[=hours] keep the samples of the last hours in memory for --socket (%d)\n" \
+        "  -W, --diskqueue[=dir] cache on disk instead of memory, kept over a restart (%s)\n" \
+        "  -Q, --diskqueuesize   max size of the disk cache in MB (%d)\n" \
+        USAGE_DBUS "\n" \
         "The cache will be used in case the influxdb server is down. In\n" \
         "that case data will be send when the server is reachable again.\n"
-        ,PYL_DEFPORTNAME,PYL_DEFBAUDRATE,NUM_RECS_TO_BUFFER_ON_FAILURE,QUERY_INTERVAL_SECONDS);
+        ,PYL_DEFPORTNAME,PYL_DEFBAUDRATE,MAX_SINKS,CACHE_MB,INFLUX_POST_MAX_BYTES / 1024,INFLUX_GZIP_MIN_BYTES,QUERY_INTERVAL_SECONDS,PYL_SHM_NAME,PYL_BROKER_SOCKET,HISTORY_HOURS,DISKQUEUE_DIR,DISKQUEUE_MB);
         exit (1);
 }
 
 
 int baudrate = PYL_DEFBAUDRATE;
-char * portname = NULL;
-int group = 0;
+int groupMask = 1;						// groups to poll, bit 0 = group 0
+char * shmName = NULL;					// set if the module data is published in shared memory
+PYL_ShmT *shm;
+char * dbusBus = NULL;					// set if the batteries are published on the Victron D-Bus
+int historyHours = 0;					// samples kept in memory, 0 = no history
+MODHIST_T *hist;
+char * diskQueueDir = NULL;				// set if the data not yet sent is kept on disk
+int diskQueueMB = DISKQUEUE_MB;
+pthread_mutex_t histLock = PTHREAD_MUTEX_INITIALIZER;	// hist is written by the sender and read by the broker
+
+#define MAX_PORTS 8
+#define RING_CYCLES 4					// poll cycles a worker may be ahead of the sender
+
+typedef struct {
+	uint8_t group;
+	uint8_t adr;
+} scheduleEntryT;
+
+#define BROKER_MAX_CLIENTS 16
+#define BROKER_MAX_INFLIGHT 64
+
+// results of one module, for broker requests
+typedef struct {
+	uint64_t time[PYL_BROKER_NUM_CMDS];			// ms, CLOCK_MONOTONIC, 0 if not cached, index pylb_cmdIndex
+	PYL_BrokerDataT data[PYL_BROKER_NUM_CMDS];
+} brokerCacheT;
+
+// a request of one or more clients waiting for the bus
+typedef struct brokerReqS {
+	struct brokerReqS *next;			// in the queue of the worker or in doneList
+	int port;
+	uint8_t group;
+	uint8_t adr;
+	uint8_t cmd;
+	int rc;
+	PYL_BrokerDataT data;
+	int numWaiters;
+	int waiter[BROKER_MAX_CLIENTS];		// client sockets, -1 if the client has gone
+	uint32_t seq[BROKER_MAX_CLIENTS];	// of the request of each waiter
+} brokerReqT;
+
+// one per serial port, polls the modules in its own thread and passes the samples to the sender (main thread)
+typedef struct {
+	int port;							// index in workers and port in the registry
+	char * portname;
+	char name[HOTPLUG_DEVNAMELEN];		// basename of portname, Port tag and log prefix
+	PYL_HandleT *pyl;
+	pthread_t thread;
+	int running;
+	SPSC_T *ring;						// sampleT to the sender
+	int numModules;
+	scheduleEntryT *schedule;
+	atomic_uint dropped;				// samples lost because the ring was full
+
+	int hotplugFd;						// netlink socket, -1 if hotplug is disabled
+	char hotplugId[HOTPLUG_IDLEN];		// usb adapter we are waiting for
+	char hotplugDev[HOTPLUG_DEVNAMELEN];// current kernel name of the tty
+	int parked;							// 1: adapter removed, 2: adapter back but port not yet opened
+
+	int reqFd;							// eventfd, broker request queued, -1 without --socket
+	brokerReqT *reqQueue;				// brokerLock
+	brokerCacheT *cache[MODREG_SLOTS_PER_PORT];	// brokerLock, allocated on first use
+} workerT;
+
+// result of one request, written by a worker, read by the sender
+typedef struct {
+	uint8_t group;
+	uint8_t adr;
+	int16_t rc;
+	uint32_t latencyMs;
+	uint64_t timestamp;					// start of the poll cycle
+	PYL_AnalogDataT ad;
+	uint8_t valid;						// PYL_SHM_VALID_ALARM, PYL_SHM_VALID_CHARGE, only polled for --shm and --dbus
+	PYL_AlarmInfoT ai;
+	PYL_ChargeDischargeInfoT cd;
+} sampleT;
+
+workerT workers[MAX_PORTS];
+int numWorkers;
+int wakeFd = -1;						// eventfd, a worker finished a poll cycle
+int stopFd = -1;						// eventfd, readable when the workers have to terminate
+
+#define SEND_RING_BATCHES 16			// batches the main thread may be ahead of the sender thread
+#define PENDING_MAX_BYTES (1024*1024)	// kept for a sink whose sender is busy
+
+// an influxdb server (or other line protocol receiver), posted to by its own thread
+typedef struct {
+	char *server;
+	int port;
+	char *db;
+	char *user;
+	char *password;
+	char *bucket;
+	char *org;
+	char *token;
+	char *apiStr;
+	char name[80];						// server:port for the log
+	int cacheMB;						// batching and cache options following its -s
+	int postKB;
+	int gzipMinBytes;
+	int tcpNoDelay;
+	influx_client_t *client;			// owns the queue of failed posts
+	SPSC_T *ring;						// batches to post, char *
+	int fd;								// eventfd, a batch was queued
+	pthread_t thread;
+	int running;
+	char *pending;						// batches not yet queued because the sender was busy
+	size_t pendingLen;
+	atomic_uint sendCount;				// counters written by the sender thread, read by sighup_handler
+	atomic_uint errs;
+	atomic_uint dropped;				// batches dropped because pending was full
+} sinkT;
+
+sinkT sinks[MAX_SINKS];
+int numSinks;
+
+char * socketPath = NULL;				// set if requests of other programs are answered
+int listenFd = -1;
+int doneFd = -1;						// eventfd, a worker finished a broker request
+pthread_t brokerThreadId;
+int brokerRunning;
+pthread_mutex_t brokerLock = PTHREAD_MUTEX_INITIALIZER;	// request queues, doneList and caches
+brokerReqT *doneList;
+
+// iClient only formats, each sink has its own client with the queue of failed posts
+void initSinks(int verifyPeer) {
+	sinkT *s = sinks;
+
+	iClient = influxdb_post_init (s->server, s->port, s->db, s->user, s->password, s->org, s->bucket, s->token, 0, s->apiStr, verifyPeer);
+	for (; s < sinks + numSinks; s++) {
+		s->fd = -1;
+		s->client = influxdb_post_init (s->server, s->port, s->db, s->user, s->password, s->org, s->bucket, s->token, INT_MAX, s->apiStr, verifyPeer);
+		if (!s->client) {
+			EPRINTF("unable to initialize the client for %s\n",s->server);
+			exit(1);
+		}
+		snprintf(s->name,sizeof(s->name),"%s:%d",s->server ? s->server : "",s->client->port);
+		influxdb_post_setTcpNoDelay(s->client, s->tcpNoDelay);
+		influxdb_post_setQueueLimits(s->client, (size_t)s->cacheMB * 1024*1024, (size_t)s->postKB * 1024);	// limited by size, not entries
+		if (influxdb_post_setGzip(s->client, s->gzipMinBytes) != 0) exit(1);
+	}
+}
 
 int parseArgs (int argc, char **argv) {
 	int res = 0;
-	int c;
+	int c,i;
 	int option_index = 0;
-	char * dbName = NULL;
-	char * serverName = NULL;
-	char * userName = NULL;
-	char * password = NULL;
-	char * bucket = NULL;
-	char * org = NULL;
-	char * token = NULL;
+	sinkT *sink = sinks;					// -s starts the next one
 	int syslog = 0;
-	int port = 8086;
-	int numQueueEntries = NUM_RECS_TO_BUFFER_ON_FAILURE;
 	int try=0;
-	int influxapi=1;
-	char *influxApiStr = NULL;
+	int influxapi;
 	int iVerifyPeer = 1;
+	int hotplug = 0;
+	int console = 0;
+	char *canIf = NULL;
+	workerT *w;
+	sinkT *s;
+	char *p;
+
+	numSinks = 1;							// port 0: 8086, 9009 for tcp://
+	for (s = sinks; s < sinks + MAX_SINKS; s++) {
+		s->cacheMB = CACHE_MB;
+		s->postKB = INFLUX_POST_MAX_BYTES / 1024;
+		s->tcpNoDelay = 1;
+	}
 
     static struct option long_options[] =
         {
@@ -114,17 +298,32 @@ int parseArgs (int argc, char **argv) {
                 {"token",       	required_argument, 0, 'T'},
                 {"influxapi",   	required_argument, 0, 'A'},
                 {"isslverifypeer",	required_argument, 0, 'I'},
+                {"tcpnodelay",  	required_argument, 0, 'x'},
                 {"port",        	required_argument, 0, 'o'},
+                {"cache",       	required_argument, 0, 'c'},
+                {"postsize",    	required_argument, 0, 'P'},
+                {"gzip",        	optional_argument, 0, 'z'},
                 {"syslog",      	no_argument      , 0, 'y'},
                 {"syslogtest",  	no_argument      , 0, 'Y'},
                 {"version",     	no_argument      , 0, 'e'},
                 {"try",         	no_argument      , 0, 't'},
                 {"query",       	required_argument, 0, 'q'},
+                {"hotplug",     	no_argument      , 0, 'H'},
+                {"console",     	no_argument      , 0, 'C'},
+                {"can",         	required_argument, 0, 'N'},
+                {"shm",         	optional_argument, 0, 'm'},
+                {"socket",      	optional_argument, 0, 'k'},
+                {"history",     	optional_argument, 0, 'R'},
+                {"diskqueue",   	optional_argument, 0, 'W'},
+                {"diskqueuesize",	required_argument, 0, 'Q'},
+#ifdef HAVE_DBUS
+                {"dbus",        	optional_argument, 0, 'D'},
+#endif
 
                 {0, 0, 0, 0}
         };
 
-    while ((c = getopt_long (argc, argv, "hd:v::b:gs:n:u:p:o:yYetq:B:O:T:A:I:",long_options, &option_index)) != -1) {
+    while ((c = getopt_long (argc, argv, "hd:v::b:g:s:n:u:p:o:c:P:z::yYetq:B:O:T:A:I:x:HCN:m::k::R::W::Q:D::",long_options, &option_index)) != -1) {
 		errno=0;
         switch ((char)c) {
 			case 'v':
@@ -136,26 +335,70 @@ int parseArgs (int argc, char **argv) {
 					log_setVerboseLevel(res);
 				} else log_incVerboseLevel();
 				break;
-			case 's': serverName = strdup(optarg); break;
-			case 'n': dbName = strdup(optarg); break;
-			case 'u': userName = strdup(optarg); break;
-			case 'p': password = strdup(optarg); break;
-			case 'B': bucket = strdup(optarg); break;
-			case 'O': org = strdup(optarg); break;
-			case 'T': token = strdup(optarg); break;
-			case 'A': influxApiStr = strdup(optarg); break;
+			case 's':
+				if (sink->server) {
+					if (numSinks >= MAX_SINKS) {
+						EPRINTF("too many servers, max %d\n",MAX_SINKS); usage();
+					}
+					sink = &sinks[numSinks++];
+				}
+				sink->server = strdup(optarg);
+				break;
+			case 'n': sink->db = strdup(optarg); break;
+			case 'u': sink->user = strdup(optarg); break;
+			case 'p': sink->password = strdup(optarg); break;
+			case 'B': sink->bucket = strdup(optarg); break;
+			case 'O': sink->org = strdup(optarg); break;
+			case 'T': sink->token = strdup(optarg); break;
+			case 'A': sink->apiStr = strdup(optarg); break;
 			case 't': try++; break;
+			case 'H': hotplug++; break;
+			case 'C': console++; break;
+			case 'N': canIf = strdup(optarg); break;
+			case 'm': shmName = strdup(optarg ? optarg : PYL_SHM_NAME); break;
+			case 'k': socketPath = strdup(optarg ? optarg : PYL_BROKER_SOCKET); break;
+			case 'R':
+				historyHours = optarg ? strtol (optarg,NULL,10) : HISTORY_HOURS;
+				if ((errno) || (historyHours < 1)) {
+					EPRINTF("history: invalid number of hours (%s)\n",optarg); usage();
+				}
+				break;
+			case 'W': diskQueueDir = strdup(optarg ? optarg : DISKQUEUE_DIR); break;
+			case 'Q':
+				diskQueueMB = strtol (optarg,NULL,10);
+				if ((errno) || (diskQueueMB < 1)) {
+					EPRINTF("disk queue size: invalid number of MB (%s)\n",optarg); usage();
+				}
+				break;
+			case 'D': dbusBus = strdup(optarg ? optarg : "system"); break;
             case 'h': usage(); break;
-            case 'd': portname = strdup(optarg); break;
+            case 'd':
+				for (p = strtok(optarg,","); p; p = strtok(NULL,",")) {
+					if (numWorkers >= MAX_PORTS) {
+						EPRINTF("too many devices, max %d\n",MAX_PORTS); usage();
+					}
+					workers[numWorkers++].portname = strdup(p);
+				}
+				break;
 			case 'g':
-				group = strtol (optarg,NULL,10);
-				if ((errno) || (group < 0) || (group > 15)) {
-					EPRINTF("Invalid group, not between 0 and 15\n"); usage();
+				{
+					char *p = optarg, *end;
+					int group;
+					groupMask = 0;
+					do {
+						errno = 0;
+						group = strtol (p,&end,10);
+						if ((errno) || (end == p) || ((*end != ',') && (*end != 0)) || (group < 0) || (group >= PYL_MAX_GROUPS)) {
+							EPRINTF("Invalid group list (%s), groups between 0 and 15 separated by ,\n",optarg); usage();
+						}
+						groupMask |= 1 << group;
+						p = end;
+					} while (*p++ == ',');
 				}
 				break;
 			case 'o':
-				port = strtol (optarg,NULL,10);
-				if ((errno) || (port < 0) || (port > 0xffff)) {
+				sink->port = strtol (optarg,NULL,10);
+				if ((errno) || (sink->port < 0) || (sink->port > 0xffff)) {
 					EPRINTF("Invalid port number\n"); usage();
 				}
 				break;
@@ -166,6 +409,30 @@ int parseArgs (int argc, char **argv) {
 					EPRINTF("I or isslverifypeer: 0 or 1 required\n"); usage();
 				}
 				break;
+			case 'x':
+				sink->tcpNoDelay = strtol (optarg,NULL,10);
+				if ((errno) || (sink->tcpNoDelay < 0) || (sink->tcpNoDelay > 1)) {
+					EPRINTF("x or tcpnodelay: 0 or 1 required\n"); usage();
+				}
+				break;
+			case 'c':
+				sink->cacheMB = strtol (optarg,NULL,10);
+				if ((errno) || (sink->cacheMB < 0)) {
+					EPRINTF("cache: invalid number of MB (%s)\n",optarg); usage();
+				}
+				break;
+			case 'P':
+				sink->postKB = strtol (optarg,NULL,10);
+				if ((errno) || (sink->postKB < 1)) {
+					EPRINTF("post size: invalid number of kB (%s)\n",optarg); usage();
+				}
+				break;
+			case 'z':
+				sink->gzipMinBytes = optarg ? strtol (optarg,NULL,10) : INFLUX_GZIP_MIN_BYTES;
+				if ((errno) || (sink->gzipMinBytes < 1)) {
+					EPRINTF("gzip: invalid number of bytes (%s)\n",optarg); usage();
+				}
+				break;
 			case 'q':
 				queryIntervalSeconds = strtol (optarg,NULL,10);
 				if ((errno) || (queryIntervalSeconds < 1)) {
@@ -191,52 +458,87 @@ int parseArgs (int argc, char **argv) {
 		}
 	}
 
-	if (portname == NULL) portname = strdup(PYL_DEFPORTNAME);
-
-
-
-	if (!influxApiStr)
-		if (try==0) {
-			if (org || token || bucket) influxapi++;
-			if (serverName == NULL) { EPRINTF("influx server name not specified\n"); usage(); }
-			if (influxapi == 1) {
-				if (!dbName) { EPRINTF("influxdb database name not specified\n"); exit(1); }
-			} else {
-				if (!org) { EPRINTF("influxdb org not specified\n"); exit(1); }
-				if (!bucket) { EPRINTF("influxdb bucket not specified\n"); exit(1); }
-				if (!token) { EPRINTF("influxdb token not specified\n"); exit(1); }
-				//printf("api: %d org:'%s' bucket:'%s' token:'%s'\n",influxapi,org,bucket,token);
-				if (dbName) EPRINTF("Warning: database name ignored for influxdb v2 api\n");
-				if (userName) EPRINTF("Warning: user name ignored for influxdb v2 api\n");
-				if (password) EPRINTF("Warning: password ignored for influxdb v2 api\n");
-			}
+	if (numWorkers == 0) workers[numWorkers++].portname = strdup(PYL_DEFPORTNAME);
+
+
+
+	if (try==0) for (s = sinks; s < sinks + numSinks; s++) {
+		if (s->apiStr || (getTransportProto(s->server) == proto_tcp)) continue;
+		influxapi = 1;
+		if (s->org || s->token || s->bucket) influxapi++;
+		if (s->server == NULL) { EPRINTF("influx server name not specified\n"); usage(); }
+		if (influxapi == 1) {
+			if (!s->db) { EPRINTF("%s: influxdb database name not specified\n",s->server); exit(1); }
+		} else {
+			if (!s->org) { EPRINTF("%s: influxdb org not specified\n",s->server); exit(1); }
+			if (!s->bucket) { EPRINTF("%s: influxdb bucket not specified\n",s->server); exit(1); }
+			if (!s->token) { EPRINTF("%s: influxdb token not specified\n",s->server); exit(1); }
+			//printf("api: %d org:'%s' bucket:'%s' token:'%s'\n",influxapi,s->org,s->bucket,s->token);
+			if (s->db) EPRINTF("Warning: database name ignored for influxdb v2 api\n");
+			if (s->user) EPRINTF("Warning: user name ignored for influxdb v2 api\n");
+			if (s->password) EPRINTF("Warning: password ignored for influxdb v2 api\n");
 		}
-
-	// init pylontech api
-	pyl = pyl_initHandle();
-	res =  pyl_connect(pyl, group, portname);
-	if (res < 0) {
-		EPRINTF("error opening serial port %s\n",portname);
-		exit (1);
 	}
-	if (res < 1) {
-		/*if (try==0)*/ EPRINTF("no pylontech devices found on %s\n",portname);
-		pyl_freeHandle(pyl);
-		exit(2);
+
+	if (canIf) {
+		can = pyl_canInit(canIf);
+		if (!can) {
+			EPRINTF("unable to listen on CAN interface %s\n",canIf);
+			exit(1);
+		}
+		if (try) exit(0);
+		numWorkers = 0;						// no serial ports in CAN mode
+		if (syslog) log_setSyslogTarget(ME);
+		PRINTF("listening on %s\n\n",canIf);
+		initSinks(iVerifyPeer);
+		return 0;
 	}
 
-	if (try) {
-		pyl_freeHandle(pyl);
-		exit(0);
+	if (console && (groupMask != 1)) { EPRINTF("only group 0 is available on the console port\n"); exit(1); }
+
+	// init pylontech api, one handle per port
+	for (w = workers; w < workers + numWorkers; w++) {
+		w->port = w - workers;
+		w->hotplugFd = -1;
+		w->reqFd = -1;
+		p = strrchr(w->portname,'/');
+		strncpy(w->name,p ? p+1 : w->portname,sizeof(w->name)-1);
+		w->pyl = pyl_initHandle();
+		if (console) res = pyl_connectConsole(w->pyl, w->portname);
+		else res = pyl_connectGroups(w->pyl, groupMask, w->portname);
+		if (res < 0) {
+			EPRINTF("error opening serial port %s\n",w->portname);
+			exit (1);
+		}
+		if (res < 1) {
+			/*if (try==0)*/ EPRINTF("no pylontech devices found on %s\n",w->portname);
+			exit(2);
+		}
 	}
 
-	// set device for commands below
-	//pyl_setAdr(pyl,adr);
+	if (try) exit(0);
+
 	if (syslog) log_setSyslogTarget(ME);
 
-	PRINTF("%d devices found in group %d\n\n",pyl_numDevices(pyl),group);
+	for (w = workers; w < workers + numWorkers; w++)
+		for (i = 0; i < PYL_MAX_GROUPS; i++)
+			if (groupMask & (1 << i)) {
+				if (numWorkers > 1) PRINTF("%s: ",w->portname);
+				PRINTF("%d devices found in group %d\n",pyl_numDevicesInGroup(w->pyl,i),i);
+			}
+	PRINTF("\n");
+
+	if (hotplug) for (w = workers; w < workers + numWorkers; w++) {
+		if (hotplug_getAdapterId(w->portname,w->hotplugId,sizeof(w->hotplugId)) != HOTPLUG_OK) {
+			EPRINTF("Warning: %s is not an usb device, hotplug disabled\n",w->portname);
+		} else {
+			hotplug_getDevname(w->portname,w->hotplugDev,sizeof(w->hotplugDev));
+			w->hotplugFd = hotplug_open();
+			if (w->hotplugFd >= 0) LOG(1,"hotplug: watching adapter %s (%s)\n",w->hotplugId,w->hotplugDev);
+		}
+	}
 
-	iClient = influxdb_post_init (serverName, port, dbName, userName, password, org, bucket, token, numQueueEntries, influxApiStr, iVerifyPeer);
+	initSinks(iVerifyPeer);
 
     return 0;
 }
@@ -246,12 +548,83 @@ uint64_t timestamp;
 
 #define NAMELEN 20
 #define SETNAME(c,d) snprintf(name,NAMELEN,c,d)
-int appendAnalogData(int adr, PYL_AnalogDataT * ad) {
+
+// values of a module line, cells and temperatures follow F_CELL0
+#define F_I 0
+#define F_U 1
+#define F_AH 2
+#define F_KWH 3
+#define F_CYCLECOUNT 4
+#define F_CELL0 5
+
+// line protocol template of a module, rebuilt if the number of cells or temperatures changes
+typedef struct {
+	influx_template_t *t;
+	int cellsCount;
+	int tempCount;
+} moduleTemplateT;
+
+moduleTemplateT *templates;				// same index as in the registry
+int numTemplates;
+
+influx_template_t * moduleTemplate(int idx, int port, int group, int adr, PYL_AnalogDataT * ad) {
 	char name[NAMELEN+1];
+	moduleTemplateT *mt;
+	int i,err = 0;
+
+	if (idx >= numTemplates) {
+		mt = realloc(templates,sizeof(*mt) * (idx+1));
+		if (!mt) return NULL;
+		memset(mt + numTemplates,0,sizeof(*mt) * (idx+1 - numTemplates));
+		templates = mt;
+		numTemplates = idx+1;
+	}
+	mt = &templates[idx];
+	if (mt->t && (mt->cellsCount == ad->cellsCount) && (mt->tempCount == ad->tempCount)) return mt->t;
+
+	influxdb_template_free(mt->t);
+	mt->t = influxdb_template_new("Battery");
+	if (!mt->t) return NULL;
+	mt->cellsCount = ad->cellsCount;
+	mt->tempCount = ad->tempCount;
+	// Group and Port only if more than one group or port is polled, keeps the series of existing installations
+	if (groupMask & (groupMask - 1)) {
+		SETNAME("%d",group);
+		err |= influxdb_template_tag(mt->t, "Group", name);
+	}
 	SETNAME("%d",adr);
-	int i,designVoltage;
+	err |= influxdb_template_tag(mt->t, "Module", name);
+	if (numWorkers > 1) err |= influxdb_template_tag(mt->t, "Port", workers[port].name);
+
+	// added in the order of F_x
+	err |= influxdb_template_field(mt->t, "i", IF_TYPE_FIELD_FLOAT, 1);
+	err |= influxdb_template_field(mt->t, "u", IF_TYPE_FIELD_FLOAT, 2);
+	err |= influxdb_template_field(mt->t, "AH", IF_TYPE_FIELD_INTEGER, 0);
+	err |= influxdb_template_field(mt->t, "kWH", IF_TYPE_FIELD_FLOAT, 2);
+	err |= influxdb_template_field(mt->t, "CycleCount", IF_TYPE_FIELD_INTEGER, 0);
+	for (i=0;(i<ad->cellsCount) && (i<CELLS_MAX);i++) {
+		SETNAME("u%d",i);		// cell voltage
+		err |= influxdb_template_field(mt->t, name, IF_TYPE_FIELD_FLOAT, 3);
+	}
+	for (i=0;(i<ad->tempCount) && (i<TEMPS_MAX);i++) {
+		if (i==0) SETNAME("%s","temp_bms"); else SETNAME("temp_%d",i);
+		err |= influxdb_template_field(mt->t, name, IF_TYPE_FIELD_INTEGER, 0);
+	}
+	if (err < 0) {
+		influxdb_template_free(mt->t);
+		mt->t = NULL;
+	}
+	return mt->t;
+}
+
+int appendAnalogData(int idx, int port, int group, int adr, PYL_AnalogDataT * ad) {
+	influx_value_t v[F_CELL0 + CELLS_MAX + TEMPS_MAX];
+	influx_template_t *t;
+	int i,n,designVoltage;
 	float remaining_kWh;
-	int rc;
+
+	t = moduleTemplate(idx,port,group,adr,ad);
+	if (!t) { EPRINTFN("unable to create the influxdb template"); return 1; }
 
 	if (ad->voltage <= 15) designVoltage = 12; /* FIXME */
 	else if (ad->voltage <= 30) designVoltage = 24;
@@ -261,36 +634,16 @@ int appendAnalogData(int adr, PYL_AnalogDataT * ad) {
 
 	remaining_kWh = (float)(ad->capacity-capacityNotUsableAH) * designVoltage / PYL_MODULE_CAPACITY_DIVIDER / 1000;
 
-	rc = influxdb_format_line(iClient,
-		INFLUX_MEAS("Battery"),
-		INFLUX_TAG("Module", name),
-		INFLUX_F_FLT("i", (float)ad->current/PYL_MODULE_CURRENT_DIVIDER, 1),
-		INFLUX_F_FLT("u", (float)ad->voltage/PYL_MODULE_VOLTAGE_DIVIDER, 2),
-		INFLUX_F_INT("AH", ad->remainingCapacity),
-		INFLUX_F_FLT("kWH", remaining_kWh, 2),
-		INFLUX_END);
-
-	for (i=0;i<ad->cellsCount;i++) {
-		if (rc >= 0) {
-			snprintf(name,NAMELEN,"u%d",i);		// cell voltage
-			rc = influxdb_format_line(iClient, INFLUX_F_FLT(name, (float)ad->cellVoltage[i] / PYL_MODULE_VOLTAGE_DIVIDER, 3), INFLUX_END);
-		}
-	}
-	for (i=0;i<ad->tempCount;i++) {
-		if (rc >= 0) {
-			if (i==0) SETNAME("%s","temp_bms"); else SETNAME("temp_%d",i);
-			rc = influxdb_format_line(iClient, INFLUX_F_INT(name, ad->temp[i]), INFLUX_END);
-		}
-	}
-
-	if (rc >= 0)
-	  rc = influxdb_format_line(iClient,
-		INFLUX_F_INT("CycleCount", ad->cycleCount),
-		INFLUX_TS(timestamp), INFLUX_END);
-
-	if (rc < 0) { EPRINTFN("influxdb_format_line failed"); return 1; }
-	//printf("%s\n\nlen: %d used: %zu\n",influxBuf,influxBufLen,influxBufUsed);
+	v[F_I].f = (float)ad->current/PYL_MODULE_CURRENT_DIVIDER;
+	v[F_U].f = (float)ad->voltage/PYL_MODULE_VOLTAGE_DIVIDER;
+	v[F_AH].i = ad->remainingCapacity;
+	v[F_KWH].f = remaining_kWh;
+	v[F_CYCLECOUNT].i = ad->cycleCount;
+	n = F_CELL0;
+	for (i=0;(i<ad->cellsCount) && (i<CELLS_MAX);i++) v[n++].f = (float)ad->cellVoltage[i] / PYL_MODULE_VOLTAGE_DIVIDER;
+	for (i=0;(i<ad->tempCount) && (i<TEMPS_MAX);i++) v[n++].i = ad->temp[i];
 
+	if (influxdb_template_line(iClient, t, v, timestamp) < 0) { EPRINTFN("influxdb_template_line failed"); return 1; }
 	return 0;
 }
 
@@ -366,74 +719,1155 @@ int analogDataChanged (PYL_AnalogDataT *a1, PYL_AnalogDataT *a2) {
 
 }
 
-int errs_http;
 int errs_pylon;
-int http_sendCount;
 
 volatile sig_atomic_t mainloopDone = 0;
+volatile sig_atomic_t showStats = 0;		// SIGHUP, printed by the main loop
+volatile sig_atomic_t showVerbose = 0;		// SIGUSR1/2
 
-void mainloop() {
-	PYL_AnalogDataT ad[PYL_MAX_DEVICES_IN_GROUP];
-	PYL_AnalogDataT adSent[PYL_MAX_DEVICES_IN_GROUP];
-	int rc, deviceNo, entriesAdded;
-	int numDvices = pyl_numDevices(pyl);
-	memset(&ad,0,sizeof(ad)); memset(&adSent,0,sizeof(adSent));
+void showStatistics();
 
-	LOGN(0,"mainloop started (%s %s)",ME,VER);
+// the signal handlers only set flags, the statistics are printed outside of signal context
+void handleSignals() {
+	if (showVerbose) {
+		showVerbose = 0;
+		LOG(0,"verbose: %d\n",log_getVerboseLevel());
+	}
+	if (showStats) {
+		showStats = 0;
+		showStatistics();
+	}
+}
 
-	while(mainloopDone == 0) {
-		timestamp = influxdb_getTimestamp();
-		entriesAdded = 0;
-		for (deviceNo=0;deviceNo<numDvices;deviceNo++) {
-			pyl_setAdr(pyl,deviceNo+1);							// set target device
-			//if (deviceNo > 0) usleep(1000 * 50);				// 50ms delay between queries
-			rc = pyl_getAnalogData(pyl,&ad[deviceNo]);			// and get analog values
-			if (rc == PYL_OK) {
-				ad[deviceNo].infoflag = 0;
-				ad[deviceNo].commandValue = 0;					// ignore these ones
-				if (analogDataChanged (&ad[deviceNo],&adSent[deviceNo])) {
-					rc = appendAnalogData(deviceNo+1,&ad[deviceNo]);
-					if (rc != 0) {
-						LOG(0,"appendAnalogData failed for device %d, entriesAdded: %d\n",deviceNo,entriesAdded);
-						break;
-					} else entriesAdded++;
+
+void hotplugReattach(workerT *w) {
+	if (pyl_openSerialPort(w->pyl) != PYL_OK) {
+		LOG(1,"hotplug: unable to open %s, will retry\n",w->pyl->portname);
+		return;
+	}
+	w->parked = 0;
+	LOG(0,"adapter %s reattached as %s, polling resumed\n",w->hotplugId,w->pyl->portname);
+}
+
+
+void hotplugEvent(workerT *w, HOTPLUG_EventT *ev) {
+	char id[HOTPLUG_IDLEN];
+	char dev[HOTPLUG_DEVNAMELEN+5];
+
+	if (ev->action == HOTPLUG_REMOVE) {
+		if (w->parked == 1 || strcmp(ev->devname,w->hotplugDev) != 0) return;
+		LOG(0,"%s removed, polling suspended\n",w->pyl->portname);
+		pyl_closeSerialPort(w->pyl);
+		w->parked = 1;
+		return;
+	}
+	if (!w->parked) return;
+	snprintf(dev,sizeof(dev),"/dev/%s",ev->devname);
+	if (hotplug_getAdapterId(dev,id,sizeof(id)) != HOTPLUG_OK) return;
+	if (strcmp(id,w->hotplugId) != 0) return;
+	// use the kernel name, udev may not have created symlinks yet
+	strcpy(w->hotplugDev,ev->devname);
+	free(w->pyl->portname);
+	w->pyl->portname = strdup(dev);
+	w->parked = 2;
+	hotplugReattach(w);
+}
+
+
+// handle pending uevents, returns 1 if the adapter is unplugged
+int hotplugCheck(workerT *w) {
+	HOTPLUG_EventT ev;
+	int rc;
+
+	if (w->hotplugFd < 0) return 0;
+	while ((rc = hotplug_read(w->hotplugFd,&ev)) != HOTPLUG_ERR)
+		if (rc > 0) hotplugEvent(w,&ev);
+	return w->parked;
+}
+
+
+// store a result in the cache of the port, brokerLock must be held
+void cacheStore(workerT *w, int group, int adr, int cmd, const void *data, int size) {
+	brokerCacheT **c = &w->cache[group * MODREG_ADR_PER_GROUP + adr-1];
+	int idx = pylb_cmdIndex(cmd);
+
+	if (idx < 0) return;
+	if (!*c) *c = calloc(1,sizeof(**c));
+	if (!*c) return;
+	memcpy(&(*c)->data[idx],data,size);
+	(*c)->time[idx] = getMonotonicMs();
+}
+
+
+// the polled data answers broker requests as well
+void cacheSample(workerT *w, sampleT *s) {
+	pthread_mutex_lock(&brokerLock);
+	cacheStore(w,s->group,s->adr,PYL_CMD_ANALOGDATA,&s->ad,sizeof(s->ad));
+	if (s->valid & PYL_SHM_VALID_ALARM) cacheStore(w,s->group,s->adr,PYL_CMD_ALARMINFO,&s->ai,sizeof(s->ai));
+	if (s->valid & PYL_SHM_VALID_CHARGE) cacheStore(w,s->group,s->adr,PYL_CMD_CHARGEDISCHARGEINFO,&s->cd,sizeof(s->cd));
+	pthread_mutex_unlock(&brokerLock);
+}
+
+
+// send the queued broker requests, called before each request of the poll cycle
+void workerServeBroker(workerT *w) {
+	brokerReqT *r;
+
+	for (;;) {
+		pthread_mutex_lock(&brokerLock);
+		r = w->reqQueue;
+		if (r) w->reqQueue = r->next;
+		pthread_mutex_unlock(&brokerLock);
+		if (!r) return;
+
+		if (w->parked) r->rc = PYL_ERR;
+		else {
+			pyl_selectModule(w->pyl,r->group,r->adr);
+			r->rc = pylb_execute(w->pyl,r->cmd,&r->data);
+		}
+		pthread_mutex_lock(&brokerLock);
+		if (r->rc == PYL_OK) cacheStore(w,r->group,r->adr,r->cmd,&r->data,sizeof(r->data));
+		r->next = doneList;
+		doneList = r;
+		pthread_mutex_unlock(&brokerLock);
+		eventfd_write(doneFd,1);
+	}
+}
+
+
+// sleep until the next query is due, returns early if the adapter was plugged in again
+// while parked, wait for uevents only. Returns 1 if the worker has to terminate
+int waitForNextQuery(workerT *w) {
+	uint64_t next = getMonotonicMs() + queryIntervalSeconds * 1000;
+	struct pollfd pfd[3];
+	int timeoutMs,wasParked,nfds = 1;
+	int hp = -1, rq = -1;
+	uint64_t now;
+	eventfd_t v;
+
+	pfd[0].fd = stopFd; pfd[0].events = POLLIN;
+	if (w->hotplugFd >= 0) {
+		hp = nfds++;
+		pfd[hp].fd = w->hotplugFd; pfd[hp].events = POLLIN;
+	}
+	if (w->reqFd >= 0) {
+		rq = nfds++;
+		pfd[rq].fd = w->reqFd; pfd[rq].events = POLLIN;
+	}
+	for (;;) {
+		now = getMonotonicMs();
+		if (w->parked == 1) timeoutMs = -1;
+		else if (now >= next) {
+			if (w->parked == 2) { hotplugReattach(w); if (!w->parked) return 0; next = now + queryIntervalSeconds * 1000; continue; }
+			return 0;
+		} else timeoutMs = next - now;
+
+		if (poll(pfd,nfds,timeoutMs) > 0) {
+			if (pfd[0].revents) return 1;
+			if ((rq >= 0) && pfd[rq].revents) {
+				eventfd_read(w->reqFd,&v);
+				workerServeBroker(w);
+			}
+			if ((hp >= 0) && pfd[hp].revents) {
+				wasParked = w->parked;
+				if (hotplugCheck(w) == 0 && wasParked) return 0;
+			}
+		}
+	}
+}
+
+MODREG_T *reg;			// all modules polled, used by the sender only
+
+// schedule the modules ordered adr 1 of all groups, adr 2 of all groups ... so the requests
+// of one poll cycle are interleaved across the groups
+int buildSchedule(workerT *w) {
+	int adr,group,maxAdr = 0;
+
+	w->schedule = malloc(sizeof(*w->schedule) * PYL_MAX_GROUPS * MODREG_ADR_PER_GROUP);
+	if (!w->schedule) return 0;
+	for (group = 0; group < PYL_MAX_GROUPS; group++)
+		if (pyl_numDevicesInGroup(w->pyl,group) > maxAdr) maxAdr = pyl_numDevicesInGroup(w->pyl,group);
+	if (maxAdr > MODREG_ADR_PER_GROUP) maxAdr = MODREG_ADR_PER_GROUP;
+	for (adr = 1; adr <= maxAdr; adr++)
+		for (group = 0; group < PYL_MAX_GROUPS; group++)
+			if ((groupMask & (1 << group)) && (adr <= pyl_numDevicesInGroup(w->pyl,group))) {
+				if (modreg_add(reg,w->port,group,adr) < 0) {
+					LOG(0,"unable to register group %d module %d\n",group,adr);
+					continue;
 				}
+				w->schedule[w->numModules].group = group;
+				w->schedule[w->numModules++].adr = adr;
+			}
+	w->ring = spsc_init(w->numModules * RING_CYCLES, sizeof(sampleT));
+	return w->ring ? w->numModules : 0;
+}
+
+
+// "group 0 module 1", prefixed by the port if more than one port is polled, main thread only
+const char * moduleName(int port, int group, int adr) {
+	static char name[HOTPLUG_DEVNAMELEN+32];
+
+	if (numWorkers > 1) snprintf(name,sizeof(name),"%s group %d module %d",workers[port].name,group,adr);
+	else snprintf(name,sizeof(name),"group %d module %d",group,adr);
+	return name;
+}
+
+
+void * workerThread(void *arg) {
+	workerT *w = arg;
+	PYL_ModuleDataT md;
+	sampleT s;
+	int i,cmds = PYL_POLL_ANALOG;
+
+	if (numWorkers > 1) log_setThreadTag(w->name);
+	if (shmName || dbusBus) cmds |= PYL_POLL_ALARM | PYL_POLL_CHARGE;
+	memset(&s,0,sizeof(s));
+	do {
+		s.timestamp = influxdb_getTimestamp();
+		for (i=0;i<w->numModules;i++) {
+			if (w->reqFd >= 0) workerServeBroker(w);			// requests of other programs first
+			if (hotplugCheck(w)) break;							// adapter removed, skip remaining queries
+			pyl_pollModule(w->pyl,w->schedule[i].group,w->schedule[i].adr,cmds,&md);
+			s.group = md.group;
+			s.adr = md.adr;
+			s.rc = md.rc;
+			s.latencyMs = md.latencyMs;
+			s.ad = md.ad;
+			s.ai = md.ai;
+			s.cd = md.cd;
+			s.valid = 0;
+			if (md.valid & PYL_POLL_ALARM) s.valid |= PYL_SHM_VALID_ALARM;
+			if (md.valid & PYL_POLL_CHARGE) s.valid |= PYL_SHM_VALID_CHARGE;
+			if ((w->reqFd >= 0) && (s.rc == PYL_OK)) cacheSample(w,&s);
+			if (!spsc_push(w->ring,&s)) w->dropped++;			// sender is stuck in a http request
+		}
+		eventfd_write(wakeFd,1);
+	} while (waitForNextQuery(w) == 0);
+	return NULL;
+}
+
+
+int brokerClients[BROKER_MAX_CLIENTS];		// broker thread only
+int brokerNumClients;
+brokerReqT *brokerInflight[BROKER_MAX_INFLIGHT];	// sent to a worker, not yet answered
+unsigned int brokerRequests, brokerCacheHits, brokerCoalesced;
+
+
+void brokerRespond(int fd, uint32_t seq, int rc, uint32_t ageMs, PYL_BrokerDataT *data) {
+	PYL_BrokerResponseT res;
+
+	memset(&res,0,sizeof(res));
+	res.magic = PYL_BROKER_MAGIC;
+	res.seq = seq;
+	res.rc = rc;
+	res.ageMs = ageMs;
+	if (data) res.data = *data;
+	if (send(fd,&res,sizeof(res),MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(res))
+		LOG(1,"broker: unable to send the response (%s)\n",strerror(errno));
+}
+
+
+// empty name is the first port, otherwise the name as given with --device, its basename or the device it links to
+workerT * brokerFindPort(const char *portname) {
+	char real[PATH_MAX],realWorker[PATH_MAX];
+	workerT *w;
+
+	if (*portname == 0) return workers;
+	for (w = workers; w < workers + numWorkers; w++)
+		if ((strcmp(portname,w->portname) == 0) || (strcmp(portname,w->name) == 0)) return w;
+	if (!realpath(portname,real)) return NULL;
+	for (w = workers; w < workers + numWorkers; w++)
+		if (realpath(w->portname,realWorker) && (strcmp(real,realWorker) == 0)) return w;
+	return NULL;
+}
+
+
+void brokerRequest(int fd, PYL_BrokerRequestT *req) {
+	PYL_BrokerDataT data;
+	brokerCacheT *c;
+	brokerReqT *r,**q;
+	workerT *w;
+	uint64_t now;
+	int i,idx;
+
+	brokerRequests++;
+	req->portname[sizeof(req->portname)-1] = 0;
+	w = brokerFindPort(req->portname);
+	if (!w || !w->running || (req->group >= PYL_MAX_GROUPS)) {
+		brokerRespond(fd,req->seq,PYL_ERR,0,NULL);
+		return;
+	}
+	if (req->cmd == PYL_BROKER_CMD_INFO) {
+		memset(&data,0,sizeof(data));
+		data.numDevices = pyl_numDevicesInGroup(w->pyl,req->group);
+		brokerRespond(fd,req->seq,PYL_OK,0,&data);
+		return;
+	}
+	if (req->cmd == PYL_BROKER_CMD_HISTORY) {
+		// the registry index does not change once the workers are running
+		idx = modreg_find(reg,w->port,req->group,req->adr);
+		if (!hist || (idx < 0)) {
+			brokerRespond(fd,req->seq,PYL_ERR,0,NULL);
+			return;
+		}
+		memset(&data,0,sizeof(data));
+		now = influxdb_getTimestamp() / 1000000;
+		pthread_mutex_lock(&histLock);
+		modhist_summary(hist,idx,now - req->maxAgeMs,now,&data.hist);
+		pthread_mutex_unlock(&histLock);
+		brokerRespond(fd,req->seq,PYL_OK,0,&data);
+		return;
+	}
+	idx = pylb_cmdIndex(req->cmd);
+	if ((idx < 0) || (req->adr < 1) || (req->adr > MODREG_ADR_PER_GROUP)) {
+		brokerRespond(fd,req->seq,PYL_ERR,0,NULL);
+		return;
+	}
+
+	// recent enough for the client
+	now = getMonotonicMs();
+	pthread_mutex_lock(&brokerLock);
+	c = w->cache[req->group * MODREG_ADR_PER_GROUP + req->adr-1];
+	if (c && c->time[idx] && (now - c->time[idx] <= req->maxAgeMs)) {
+		data = c->data[idx];
+		pthread_mutex_unlock(&brokerLock);
+		brokerCacheHits++;
+		brokerRespond(fd,req->seq,PYL_OK,now - c->time[idx],&data);
+		return;
+	}
+	pthread_mutex_unlock(&brokerLock);
+
+	// the same request is already waiting for the bus
+	for (i=0;i<BROKER_MAX_INFLIGHT;i++) {
+		r = brokerInflight[i];
+		if (r && (r->port == w->port) && (r->group == req->group) && (r->adr == req->adr) && (r->cmd == req->cmd) && (r->numWaiters < BROKER_MAX_CLIENTS)) {
+			r->seq[r->numWaiters] = req->seq;
+			r->waiter[r->numWaiters++] = fd;
+			brokerCoalesced++;
+			return;
+		}
+	}
+
+	for (i=0;i<BROKER_MAX_INFLIGHT;i++)
+		if (!brokerInflight[i]) break;
+	r = i < BROKER_MAX_INFLIGHT ? calloc(1,sizeof(*r)) : NULL;
+	if (!r) {
+		brokerRespond(fd,req->seq,PYL_ERR,0,NULL);
+		return;
+	}
+	r->port = w->port;
+	r->group = req->group;
+	r->adr = req->adr;
+	r->cmd = req->cmd;
+	r->seq[r->numWaiters] = req->seq;
+	r->waiter[r->numWaiters++] = fd;
+	brokerInflight[i] = r;
+
+	pthread_mutex_lock(&brokerLock);
+	for (q = &w->reqQueue; *q; q = &(*q)->next);
+	*q = r;
+	pthread_mutex_unlock(&brokerLock);
+	eventfd_write(w->reqFd,1);
+}
+
+
+// answer the clients waiting for requests the workers have finished
+void brokerDone() {
+	brokerReqT *r,*next;
+	int i;
+
+	pthread_mutex_lock(&brokerLock);
+	r = doneList;
+	doneList = NULL;
+	pthread_mutex_unlock(&brokerLock);
+
+	for (; r; r = next) {
+		next = r->next;
+		for (i=0;i<r->numWaiters;i++)
+			if (r->waiter[i] >= 0) brokerRespond(r->waiter[i],r->seq[i],r->rc,0,&r->data);
+		for (i=0;i<BROKER_MAX_INFLIGHT;i++)
+			if (brokerInflight[i] == r) brokerInflight[i] = NULL;
+		free(r);
+	}
+}
+
+
+void brokerDropClient(int n) {
+	int i,j,fd = brokerClients[n];
+
+	for (i=0;i<BROKER_MAX_INFLIGHT;i++)
+		if (brokerInflight[i])
+			for (j=0;j<brokerInflight[i]->numWaiters;j++)
+				if (brokerInflight[i]->waiter[j] == fd) brokerInflight[i]->waiter[j] = -1;
+	close(fd);
+	brokerClients[n] = brokerClients[--brokerNumClients];
+}
+
+
+void * brokerThread(void *arg) {
+	struct pollfd pfd[3+BROKER_MAX_CLIENTS];
+	PYL_BrokerRequestT req;
+	eventfd_t v;
+	ssize_t len;
+	int i,fd;
+
+	for (;;) {
+		pfd[0].fd = stopFd; pfd[0].events = POLLIN;
+		pfd[1].fd = doneFd; pfd[1].events = POLLIN;
+		pfd[2].fd = listenFd; pfd[2].events = POLLIN;
+		for (i=0;i<brokerNumClients;i++) {
+			pfd[3+i].fd = brokerClients[i]; pfd[3+i].events = POLLIN;
+		}
+		if (poll(pfd,3+brokerNumClients,-1) <= 0) continue;
+		if (pfd[0].revents) break;
+		if (pfd[1].revents) {
+			eventfd_read(doneFd,&v);
+			brokerDone();
+		}
+		// backwards, a dropped client is replaced by the last one which is already handled
+		for (i=brokerNumClients-1;i>=0;i--) {
+			if (!pfd[3+i].revents) continue;
+			len = recv(brokerClients[i],&req,sizeof(req),0);
+			if ((len == sizeof(req)) && (req.magic == PYL_BROKER_MAGIC)) brokerRequest(brokerClients[i],&req);
+			else brokerDropClient(i);
+		}
+		if (pfd[2].revents) {
+			fd = accept(listenFd,NULL,NULL);
+			if (fd >= 0) {
+				fcntl(fd,F_SETFD,FD_CLOEXEC);
+				if (brokerNumClients < BROKER_MAX_CLIENTS) brokerClients[brokerNumClients++] = fd;
+				else { LOG(0,"broker: too many clients\n"); close(fd); }
+			}
+		}
+	}
+	for (i=0;i<brokerNumClients;i++) close(brokerClients[i]);
+	brokerNumClients = 0;
+	return NULL;
+}
+
+
+// listen on socketPath, refuses to take over the socket of a running broker
+int brokerInit() {
+	struct sockaddr_un addr;
+	workerT *w;
+	int fd;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+		LOG(0,"broker: socket path %s too long\n",socketPath);
+		return -1;
+	}
+	strcpy(addr.sun_path,socketPath);
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	if (connect(fd,(struct sockaddr *)&addr,sizeof(addr)) == 0) {
+		LOG(0,"broker: %s is in use by another process\n",socketPath);
+		close(fd);
+		return -1;
+	}
+	unlink(socketPath);
+	if ((bind(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0) || (listen(fd,BROKER_MAX_CLIENTS) < 0)) {
+		LOG(0,"broker: unable to listen on %s (%s)\n",socketPath,strerror(errno));
+		close(fd);
+		return -1;
+	}
+	listenFd = fd;
+	doneFd = eventfd(0,EFD_CLOEXEC);
+	for (w = workers; w < workers + numWorkers; w++) w->reqFd = eventfd(0,EFD_CLOEXEC);
+	LOG(1,"broker: listening on %s\n",socketPath);
+	return 0;
+}
+
+
+// posts the batches of the main thread to one sink, a slow or unreachable server does not delay polling
+// or the other sinks, the batches still queued when stopped are posted before the thread terminates
+void * senderThread(void *arg) {
+	sinkT *s = arg;
+	struct pollfd pfd[2];
+	eventfd_t v;
+	char *batch;
+	int rc,stop;
+
+	pfd[0].fd = s->fd; pfd[0].events = POLLIN;
+	pfd[1].fd = stopFd; pfd[1].events = POLLIN;
+	do {
+		stop = (poll(pfd,2,-1) > 0) && pfd[1].revents;
+		if (pfd[0].revents) eventfd_read(s->fd,&v);
+		while (spsc_pop(s->ring,&batch)) {
+			rc = influxdb_post_http_buffer(s->client,batch);
+			if (rc == INFLUX_ERR_SERVER_DOWN) {
+				LOG(2,"%s is down, post queued\n",s->name);		// influxdb-post logs the state changes
+				s->errs++;
+			} else
+			if (rc != 0) {
+				LOG(0,"%s: influxdb_post_http_line returned %d\n",s->name,rc);
+				s->errs++;
 			} else {
-				LOG(0,"getAnalogData for Module %d returned %d\n",deviceNo+1,rc);
-				errs_pylon++;
-				//log_setVerboseLevel(5);
-#if 0
-				memset(&ad[deviceNo],0,sizeof(PYL_AnalogDataT));  // write one empty record
-				if (analogDataChanged (&ad[deviceNo],&adSent[deviceNo])) {
-					appendAnalogData(deviceNo+1,&ad[deviceNo]);
-					if (influxBuf == NULL) {
-						LOG(0,"appendAnalogData failed for device %d, entriesAdded: %d\n",deviceNo,entriesAdded);
-						break;
-
-					} else entriesAdded++;
+				s->sendCount++;
+				VPRINTFN(1,"Post to %s: success",s->name);
+			}
+		}
+	} while (!stop);
+	return NULL;
+}
+
+
+// hand the formatted lines to the sender thread of each sink, as each sink queues failed posts
+// itself all but the last one get a copy. The batches for a busy sender are kept and sent with
+// the next batch, the other sinks get theirs immediately.
+void queueBatch() {
+	char *batch,*data;
+	size_t len;
+	sinkT *s;
+
+	if (!iClient->influxBuf || !iClient->influxBufUsed) return;
+	len = iClient->influxBufUsed;
+	batch = influxdb_post_takeBuffer(iClient);
+	for (s = sinks; s < sinks + numSinks; s++) {
+		if (s->pending) {
+			data = realloc(s->pending,s->pendingLen + 1 + len + 1);
+			if (!data) continue;
+			data[s->pendingLen++] = '\n';
+			memcpy(data + s->pendingLen,batch,len + 1);
+			s->pendingLen += len;
+			s->pending = NULL;
+		} else
+		if (s == sinks + numSinks - 1) {
+			data = batch;
+			batch = NULL;
+			s->pendingLen = len;
+		} else {
+			data = malloc(len + 1);
+			if (!data) continue;
+			memcpy(data,batch,len + 1);
+			s->pendingLen = len;
+		}
+		if (spsc_full(s->ring)) {
+			if (s->pendingLen > PENDING_MAX_BYTES) {
+				LOG(0,"influxdb sender for %s busy, %zu bytes dropped\n",s->name,s->pendingLen);
+				free(data);
+				s->pendingLen = 0;
+				s->dropped++;
+				continue;
+			}
+			LOG(1,"influxdb sender for %s busy, %zu bytes wait for the next batch\n",s->name,s->pendingLen);
+			s->pending = data;
+			continue;
+		}
+		spsc_push(s->ring,&data);
+		s->pendingLen = 0;
+		eventfd_write(s->fd,1);
+	}
+	free(batch);
+}
+
+
+int startWorkers() {
+	sigset_t all,old;
+	workerT *w;
+	sinkT *s;
+
+	wakeFd = eventfd(0,EFD_CLOEXEC);
+	stopFd = eventfd(0,EFD_CLOEXEC);
+	if ((wakeFd < 0) || (stopFd < 0)) {
+		LOG(0,"unable to create eventfd (%s)\n",strerror(errno));
+		return -1;
+	}
+	for (s = sinks; s < sinks + numSinks; s++) {
+		s->fd = eventfd(0,EFD_CLOEXEC);
+		if (s->fd < 0) {
+			LOG(0,"unable to create eventfd (%s)\n",strerror(errno));
+			return -1;
+		}
+		s->ring = spsc_init(SEND_RING_BATCHES,sizeof(char *));
+		if (!s->ring) {
+			LOG(0,"unable to allocate the send queue\n");
+			return -1;
+		}
+	}
+	// signals are handled by the main thread only
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK,&all,&old);
+	for (w = workers; w < workers + numWorkers; w++) {
+		if (!w->ring) continue;
+		if (pthread_create(&w->thread,NULL,workerThread,w) == 0) w->running = 1;
+		else LOG(0,"unable to start the worker for %s\n",w->portname);
+	}
+	if (listenFd >= 0) {
+		if (pthread_create(&brokerThreadId,NULL,brokerThread,NULL) == 0) brokerRunning = 1;
+		else LOG(0,"unable to start the broker\n");
+	}
+	for (s = sinks; s < sinks + numSinks; s++)
+		if (pthread_create(&s->thread,NULL,senderThread,s) == 0) s->running = 1;
+	pthread_sigmask(SIG_SETMASK,&old,NULL);
+	for (s = sinks; s < sinks + numSinks; s++)
+		if (!s->running) {
+			LOG(0,"unable to start the sender for %s\n",s->name);
+			return -1;
+		}
+	return 0;
+}
+
+
+void stopWorkers() {
+	workerT *w;
+	sinkT *s;
+
+	if (stopFd < 0) return;
+	// batches kept for a busy sender are posted by it before it stops
+	for (s = sinks; s < sinks + numSinks; s++)
+		if (s->pending && s->running && spsc_push(s->ring,&s->pending)) {
+			s->pending = NULL;
+			s->pendingLen = 0;
+			eventfd_write(s->fd,1);
+		}
+	eventfd_write(stopFd,1);
+	for (w = workers; w < workers + numWorkers; w++)
+		if (w->running) {
+			pthread_join(w->thread,NULL);
+			w->running = 0;
+		}
+	if (brokerRunning) {
+		pthread_join(brokerThreadId,NULL);
+		brokerRunning = 0;
+	}
+	for (s = sinks; s < sinks + numSinks; s++)
+		if (s->running) {
+			pthread_join(s->thread,NULL);
+			s->running = 0;
+		}
+	// the ring was full, post or queue the rest here, the client is no longer used by the sender
+	for (s = sinks; s < sinks + numSinks; s++)
+		if (s->pending) {
+			if (influxdb_post_http_buffer(s->client,s->pending) != 0) s->errs++;
+			else s->sendCount++;
+			s->pending = NULL;
+			s->pendingLen = 0;
+		}
+}
+
+
+// latest state of a module for other local processes, called between pyl_shmBeginWrite and pyl_shmEndWrite
+void publishSample(int idx, MODREG_EntryT *m, sampleT *s) {
+	PYL_ShmModuleT *sm = pyl_shmModule(shm,idx);
+
+	sm->consecutiveErrors = m->consecutiveErrors;
+	if (s->rc != PYL_OK) return;
+	sm->timestamp = s->timestamp;
+	sm->updates++;
+	sm->ad = m->ad;
+	sm->ai = m->ai;
+	sm->cd = m->cd;
+	sm->valid = m->valid;
+}
+
+
+#ifdef HAVE_DBUS
+// per module items, consecutive starting at dbusServiceT.module
+enum { MI_VOLTAGE, MI_CURRENT, MI_SOC, MI_TEMPERATURE, MI_MINCELLVOLTAGE, MI_MAXCELLVOLTAGE, MI_CYCLECOUNT, MI_CONNECTED, MI_NUM };
+
+#define DBUS_RETRY_MS 60000			// reconnect interval if the bus is not available
+
+// battery service of one port, com.victronenergy.battery.<port>, main thread only
+typedef struct {
+	VEDBUS_T *ve;
+	uint64_t retry;						// ms, CLOCK_MONOTONIC, next connection attempt
+	int connected, voltage, current, power, temperature, soc, capacity, installedCapacity, chargeCycles;
+	int modulesOnline, modulesOffline, minCellVoltage, maxCellVoltage, minCellTemperature, maxCellTemperature;
+	int maxChargeVoltage, maxChargeCurrent, maxDischargeCurrent, batteryLowVoltage, allowToCharge, allowToDischarge;
+	int alarmLowVoltage, alarmHighVoltage, alarmHighChargeCurrent, alarmHighDischargeCurrent, alarmLowTemperature, alarmHighTemperature;
+	int module[MODREG_SLOTS_PER_PORT];	// first item of a module, index group * MODREG_ADR_PER_GROUP + adr-1
+} dbusServiceT;
+
+dbusServiceT dbusServices[MAX_PORTS];
+
+
+// item number, err is set if the item could not be added
+static int dbusAddItem(VEDBUS_T *ve, const char *path, const char *unit, int decimals, int *err) {
+	int item = vedbus_addItem(ve,path,unit,decimals);
+
+	if (item == VEDBUS_ERR) *err = 1;
+	return item;
+}
+
+
+void dbusFree(dbusServiceT *d) {
+	vedbus_free(d->ve);
+	d->ve = NULL;
+}
+
+
+// connect and register the items, retried after DBUS_RETRY_MS if the bus is not available
+int dbusInit(workerT *w) {
+	dbusServiceT *d = &dbusServices[w->port];
+	VEDBUS_T *ve;
+	char name[128];
+	int i,j,item,err = 0;
+	int procName,procVersion,connection,instance,productId,productName;
+	static const char *moduleItems[MI_NUM][3] = {
+		{"Voltage","V","2"}, {"Current","A","1"}, {"Soc","%","0"}, {"Temperature","C","0"},
+		{"MinCellVoltage","V","3"}, {"MaxCellVoltage","V","3"}, {"CycleCount","","0"}, {"Connected","","0"} };
+
+	snprintf(name,sizeof(name),"com.victronenergy.battery.%s",w->name);
+	for (i=strlen("com.victronenergy.battery.");name[i];i++)
+		if (!isalnum((unsigned char)name[i])) name[i] = '_';	// bus names allow [A-Za-z0-9_-] only
+	if (getMonotonicMs() < d->retry) return -1;
+	ve = vedbus_init(dbusBus,name);
+	if (!ve) {
+		d->retry = getMonotonicMs() + DBUS_RETRY_MS;
+		return -1;
+	}
+	d->ve = ve;
+
+	procName = dbusAddItem(ve,"/Mgmt/ProcessName","",0,&err);
+	procVersion = dbusAddItem(ve,"/Mgmt/ProcessVersion","",0,&err);
+	connection = dbusAddItem(ve,"/Mgmt/Connection","",0,&err);
+	instance = dbusAddItem(ve,"/DeviceInstance","",0,&err);
+	productId = dbusAddItem(ve,"/ProductId","",0,&err);
+	productName = dbusAddItem(ve,"/ProductName","",0,&err);
+	d->connected = dbusAddItem(ve,"/Connected","",0,&err);
+	d->voltage = dbusAddItem(ve,"/Dc/0/Voltage","V",2,&err);
+	d->current = dbusAddItem(ve,"/Dc/0/Current","A",1,&err);
+	d->power = dbusAddItem(ve,"/Dc/0/Power","W",0,&err);
+	d->temperature = dbusAddItem(ve,"/Dc/0/Temperature","C",0,&err);
+	d->soc = dbusAddItem(ve,"/Soc","%",0,&err);
+	d->capacity = dbusAddItem(ve,"/Capacity","Ah",1,&err);
+	d->installedCapacity = dbusAddItem(ve,"/InstalledCapacity","Ah",1,&err);
+	d->chargeCycles = dbusAddItem(ve,"/History/ChargeCycles","",0,&err);
+	d->modulesOnline = dbusAddItem(ve,"/System/NrOfModulesOnline","",0,&err);
+	d->modulesOffline = dbusAddItem(ve,"/System/NrOfModulesOffline","",0,&err);
+	d->minCellVoltage = dbusAddItem(ve,"/System/MinCellVoltage","V",3,&err);
+	d->maxCellVoltage = dbusAddItem(ve,"/System/MaxCellVoltage","V",3,&err);
+	d->minCellTemperature = dbusAddItem(ve,"/System/MinCellTemperature","C",0,&err);
+	d->maxCellTemperature = dbusAddItem(ve,"/System/MaxCellTemperature","C",0,&err);
+	d->maxChargeVoltage = dbusAddItem(ve,"/Info/MaxChargeVoltage","V",2,&err);
+	d->maxChargeCurrent = dbusAddItem(ve,"/Info/MaxChargeCurrent","A",1,&err);
+	d->maxDischargeCurrent = dbusAddItem(ve,"/Info/MaxDischargeCurrent","A",1,&err);
+	d->batteryLowVoltage = dbusAddItem(ve,"/Info/BatteryLowVoltage","V",2,&err);
+	d->allowToCharge = dbusAddItem(ve,"/Io/AllowToCharge","",0,&err);
+	d->allowToDischarge = dbusAddItem(ve,"/Io/AllowToDischarge","",0,&err);
+	d->alarmLowVoltage = dbusAddItem(ve,"/Alarms/LowVoltage","",0,&err);
+	d->alarmHighVoltage = dbusAddItem(ve,"/Alarms/HighVoltage","",0,&err);
+	d->alarmHighChargeCurrent = dbusAddItem(ve,"/Alarms/HighChargeCurrent","",0,&err);
+	d->alarmHighDischargeCurrent = dbusAddItem(ve,"/Alarms/HighDischargeCurrent","",0,&err);
+	d->alarmLowTemperature = dbusAddItem(ve,"/Alarms/LowTemperature","",0,&err);
+	d->alarmHighTemperature = dbusAddItem(ve,"/Alarms/HighTemperature","",0,&err);
+
+	for (i=0;i<w->numModules;i++) {
+		int slot = w->schedule[i].group * MODREG_ADR_PER_GROUP + w->schedule[i].adr - 1;
+		for (j=0;j<MI_NUM;j++) {
+			snprintf(name,sizeof(name),"/Module/%d/%d/%s",w->schedule[i].group,w->schedule[i].adr,moduleItems[j][0]);
+			item = dbusAddItem(ve,name,moduleItems[j][1],atoi(moduleItems[j][2]),&err);
+			if (j == 0) d->module[slot] = item;
+		}
+	}
+	if (err) {
+		LOG(0,"dbus: unable to register the items of %s\n",w->name);
+		dbusFree(d);
+		d->retry = getMonotonicMs() + DBUS_RETRY_MS;
+		return -1;
+	}
+	vedbus_setString(ve,procName,ME);
+	vedbus_setString(ve,procVersion,VERNUM);
+	vedbus_setString(ve,connection,w->portname);
+	vedbus_setInt(ve,instance,512 + w->port);
+	vedbus_setInt(ve,productId,0);
+	vedbus_setString(ve,productName,"Pylontech battery");
+	vedbus_flush(ve);
+	LOG(1,"dbus: registered the battery service of %s with %d modules\n",w->name,w->numModules);
+	return 0;
+}
+
+
+// 2 (alarm) if any module reports status in an alarm field, 0 if none, invalid without alarm info
+static void dbusSetAlarm(VEDBUS_T *ve, int item, int numAlarmInfo, int alarm) {
+	if (numAlarmInfo) vedbus_setInt(ve,item,alarm ? 2 : 0);
+	else vedbus_setInvalid(ve,item);
+}
+
+
+// stack values of one port from the registry, the changed items are sent as one ItemsChanged signal
+void dbusPublish(workerT *w) {
+	dbusServiceT *d = &dbusServices[w->port];
+	VEDBUS_T *ve;
+	MODREG_EntryT *m;
+	int i,j,item,online = 0,offline = 0,numAi = 0,numCd = 0;
+	int64_t voltage = 0,current = 0,remaining = 0,capacity = 0;
+	int temp = 0,minCell = INT_MAX,maxCell = INT_MIN,minTemp = INT_MAX,maxTemp = INT_MIN,cycles = 0;
+	int maxChargeVoltage = INT_MAX,lowVoltage = 0,chargeCurrent = 0,dischargeCurrent = 0,status = 0xff;
+	int lowV = 0,highV = 0,highChargeI = 0,highDischargeI = 0,lowT = 0,highT = 0;
+
+	if (!d->ve && (dbusInit(w) != 0)) return;
+	ve = d->ve;
+	for (i=0;i<modreg_count(reg);i++) {
+		m = modreg_get(reg,i);
+		if (m->port != w->port) continue;
+		item = d->module[m->group * MODREG_ADR_PER_GROUP + m->adr - 1];
+		if ((m->health == MODREG_HEALTH_FAILED) || !(m->valid & PYL_SHM_VALID_ANALOG)) {
+			offline++;
+			for (j=0;j<MI_CONNECTED;j++) vedbus_setInvalid(ve,item+j);
+			vedbus_setInt(ve,item+MI_CONNECTED,0);
+			continue;
+		}
+		online++;
+		voltage += m->ad.voltage;
+		current += m->ad.current;
+		remaining += m->ad.remainingCapacity;
+		capacity += m->ad.capacity;
+		if (m->ad.tempCount) temp += m->ad.temp[0];
+		if (m->ad.cycleCount > cycles) cycles = m->ad.cycleCount;
+		int modMin = INT_MAX, modMax = INT_MIN;
+		for (j=0;j<m->ad.cellsCount;j++) {
+			if (m->ad.cellVoltage[j] < modMin) modMin = m->ad.cellVoltage[j];
+			if (m->ad.cellVoltage[j] > modMax) modMax = m->ad.cellVoltage[j];
+		}
+		if (modMin < minCell) minCell = modMin;
+		if (modMax > maxCell) maxCell = modMax;
+		for (j=1;j<m->ad.tempCount;j++) {					// temp[0] is the BMS
+			if (m->ad.temp[j] < minTemp) minTemp = m->ad.temp[j];
+			if (m->ad.temp[j] > maxTemp) maxTemp = m->ad.temp[j];
+		}
+		vedbus_setDouble(ve,item+MI_VOLTAGE,(double)m->ad.voltage/PYL_MODULE_VOLTAGE_DIVIDER);
+		vedbus_setDouble(ve,item+MI_CURRENT,(double)m->ad.current/PYL_MODULE_CURRENT_DIVIDER);
+		if (m->ad.capacity) vedbus_setInt(ve,item+MI_SOC,m->ad.remainingCapacity * 100 / m->ad.capacity);
+		if (m->ad.tempCount) vedbus_setInt(ve,item+MI_TEMPERATURE,m->ad.temp[0]);
+		if (m->ad.cellsCount) {
+			vedbus_setDouble(ve,item+MI_MINCELLVOLTAGE,(double)modMin/PYL_CELL_VOLTAGE_DIVIDER);
+			vedbus_setDouble(ve,item+MI_MAXCELLVOLTAGE,(double)modMax/PYL_CELL_VOLTAGE_DIVIDER);
+		}
+		vedbus_setInt(ve,item+MI_CYCLECOUNT,m->ad.cycleCount);
+		vedbus_setInt(ve,item+MI_CONNECTED,1);
+
+		if (m->valid & PYL_SHM_VALID_ALARM) {
+			numAi++;
+			if (m->ai.moduleVoltageStat == 1) lowV++;
+			if (m->ai.moduleVoltageStat == 2) highV++;
+			for (j=0;j<m->ai.cellsCount;j++) {
+				if (m->ai.cellVoltageStatus[j] == 1) lowV++;
+				if (m->ai.cellVoltageStatus[j] == 2) highV++;
+			}
+			for (j=0;j<m->ai.tempCount;j++) {
+				if (m->ai.tempStatus[j] == 1) lowT++;
+				if (m->ai.tempStatus[j] == 2) highT++;
+			}
+			if (m->ai.chargeCurrentStat == 2) highChargeI++;
+			if (m->ai.dischargeCurrentStat == 2) highDischargeI++;
+		}
+		if (m->valid & PYL_SHM_VALID_CHARGE) {
+			numCd++;
+			if (m->cd.chargeVoltageLimit < maxChargeVoltage) maxChargeVoltage = m->cd.chargeVoltageLimit;
+			if (m->cd.dischargeVoltageLimit > lowVoltage) lowVoltage = m->cd.dischargeVoltageLimit;
+			chargeCurrent += m->cd.chargeCurrentLimit;
+			dischargeCurrent += m->cd.dischargeCurrentLimit;
+			status &= m->cd.chargeDischargeStatus;		// allowed only if all modules allow it
+		}
+	}
+
+	vedbus_setInt(ve,d->connected,online ? 1 : 0);
+	vedbus_setInt(ve,d->modulesOnline,online);
+	vedbus_setInt(ve,d->modulesOffline,offline);
+	if (online) {
+		double u = (double)voltage / online / PYL_MODULE_VOLTAGE_DIVIDER;
+		double i = (double)current / PYL_MODULE_CURRENT_DIVIDER;
+		vedbus_setDouble(ve,d->voltage,u);
+		vedbus_setDouble(ve,d->current,i);
+		vedbus_setDouble(ve,d->power,u * i);
+		vedbus_setInt(ve,d->temperature,temp / online);
+		if (capacity) vedbus_setInt(ve,d->soc,remaining * 100 / capacity);
+		vedbus_setDouble(ve,d->capacity,(double)remaining / PYL_MODULE_CAPACITY_DIVIDER);
+		vedbus_setDouble(ve,d->installedCapacity,(double)capacity / PYL_MODULE_CAPACITY_DIVIDER);
+		vedbus_setInt(ve,d->chargeCycles,cycles);
+		if (minCell != INT_MAX) {
+			vedbus_setDouble(ve,d->minCellVoltage,(double)minCell / PYL_CELL_VOLTAGE_DIVIDER);
+			vedbus_setDouble(ve,d->maxCellVoltage,(double)maxCell / PYL_CELL_VOLTAGE_DIVIDER);
+		}
+		if (minTemp != INT_MAX) {
+			vedbus_setInt(ve,d->minCellTemperature,minTemp);
+			vedbus_setInt(ve,d->maxCellTemperature,maxTemp);
+		}
+	} else {
+		vedbus_setInvalid(ve,d->voltage);
+		vedbus_setInvalid(ve,d->current);
+		vedbus_setInvalid(ve,d->power);
+		vedbus_setInvalid(ve,d->temperature);
+		vedbus_setInvalid(ve,d->soc);
+	}
+	if (numCd) {
+		vedbus_setDouble(ve,d->maxChargeVoltage,(double)maxChargeVoltage / 1000);
+		vedbus_setDouble(ve,d->maxChargeCurrent,(double)chargeCurrent / 10);
+		vedbus_setDouble(ve,d->maxDischargeCurrent,(double)dischargeCurrent / 1000);	// see pylontech.c
+		vedbus_setDouble(ve,d->batteryLowVoltage,(double)lowVoltage / 1000);
+		vedbus_setInt(ve,d->allowToCharge,(status & 0x80) ? 1 : 0);
+		vedbus_setInt(ve,d->allowToDischarge,(status & 0x40) ? 1 : 0);
+	}
+	dbusSetAlarm(ve,d->alarmLowVoltage,numAi,lowV);
+	dbusSetAlarm(ve,d->alarmHighVoltage,numAi,highV);
+	dbusSetAlarm(ve,d->alarmHighChargeCurrent,numAi,highChargeI);
+	dbusSetAlarm(ve,d->alarmHighDischargeCurrent,numAi,highDischargeI);
+	dbusSetAlarm(ve,d->alarmLowTemperature,numAi,lowT);
+	dbusSetAlarm(ve,d->alarmHighTemperature,numAi,highT);
+
+	if (vedbus_flush(ve) < 0) {
+		LOG(0,"dbus: unable to send the values of %s\n",w->name);
+		dbusFree(d);
+	}
+}
+
+
+// method calls of other services, the connection is dropped and reestablished by dbusPublish on errors
+void dbusDispatch(workerT *w) {
+	dbusServiceT *d = &dbusServices[w->port];
+
+	if (d->ve && (vedbus_dispatch(d->ve) != VEDBUS_OK)) {
+		LOG(0,"dbus: connection of %s lost\n",w->name);
+		dbusFree(d);
+	}
+}
+#endif
+
+
+// take the samples of all workers, update the registry and post the changed ones
+void sendSamples() {
+	int i, idx, entriesAdded = 0;
+	MODREG_EntryT *m;
+	sampleT s;
+
+	if (shm) pyl_shmBeginWrite(shm);
+	for (i=0;i<numWorkers;i++) {
+		if (!workers[i].ring) continue;
+		while (spsc_pop(workers[i].ring,&s)) {
+			idx = modreg_find(reg,i,s.group,s.adr);
+			if (idx < 0) continue;
+			m = modreg_get(reg,idx);
+			if (modreg_update(m,s.rc,s.latencyMs))
+				LOG(0,"%s: %s\n",moduleName(i,s.group,s.adr),modreg_healthStr(m->health));
+			if (s.rc != PYL_OK) {
+				if (s.rc != PYL_QUARANTINED) {					// not queried after repeated failures
+					LOG(0,"getAnalogData for %s returned %d\n",moduleName(i,s.group,s.adr),s.rc);
+					errs_pylon++;
 				}
+				if (shm) publishSample(idx,m,&s);
+				continue;
+			}
+			m->ad = s.ad;
+			m->ad.infoflag = 0;
+			m->ad.commandValue = 0;							// ignore these ones
+			if (s.valid & PYL_SHM_VALID_ALARM) m->ai = s.ai;
+			if (s.valid & PYL_SHM_VALID_CHARGE) m->cd = s.cd;
+			m->valid |= PYL_SHM_VALID_ANALOG | s.valid;
+			if (shm) publishSample(idx,m,&s);
+			if (hist) {
+				pthread_mutex_lock(&histLock);
+				if (modhist_add(hist,idx,s.timestamp / 1000000,&m->ad) != PYL_OK)
+					LOG(0,"unable to add the sample of %s to the history\n",moduleName(i,s.group,s.adr));
+				pthread_mutex_unlock(&histLock);
+			}
+			if (analogDataChanged (&m->ad,&m->adSent)) {
+				timestamp = s.timestamp;
+				if (appendAnalogData(idx,i,s.group,s.adr,&m->ad) != 0) {
+					LOG(0,"appendAnalogData failed for %s, entriesAdded: %d\n",moduleName(i,s.group,s.adr),entriesAdded);
+				} else entriesAdded++;
+			}
+		}
+	}
+	if (shm) pyl_shmEndWrite(shm);
+#ifdef HAVE_DBUS
+	if (dbusBus) for (i=0;i<numWorkers;i++) dbusPublish(&workers[i]);
 #endif
+	// posts that fail are queued and retried by the sender
+	if (entriesAdded)
+		for (i=0;i<modreg_count(reg);i++) modreg_get(reg,i)->adSent = modreg_get(reg,i)->ad;
+	queueBatch();
+}
+
+
+void mainloop() {
+	struct pollfd pfd[1+MAX_PORTS];
+	int nfds = 1;
+	eventfd_t v;
+	workerT *w;
+
+	reg = modreg_init(numWorkers);
+	if (!reg) return;
+	for (w = workers; w < workers + numWorkers; w++)
+		if (buildSchedule(w) == 0) LOG(0,"no modules to poll on %s\n",w->portname);
+	if (shmName) {
+		// one slot per registered module, same index as in the registry
+		shm = pyl_shmCreate(shmName,modreg_count(reg));
+		if (shm) {
+			for (int i=0;i<modreg_count(reg);i++) {
+				pyl_shmModule(shm,i)->port = modreg_get(reg,i)->port;
+				pyl_shmModule(shm,i)->group = modreg_get(reg,i)->group;
+				pyl_shmModule(shm,i)->adr = modreg_get(reg,i)->adr;
 			}
+			LOG(1,"publishing %d modules in shared memory %s\n",modreg_count(reg),shmName);
 		}
-		if (entriesAdded) {
-			//printf("would send:\n%s\n",influxBuf);
-			//free(influxBuf); influxBuf = NULL;  // influx post would free
-			rc = influxdb_post_http_line(iClient);
-			if (rc != 0) {
-				LOG(0,"influxdb_post_http_line returned %d\n",rc);
-				errs_http++;
-			} else {
-				memmove(&adSent,&ad,sizeof(ad));
-				http_sendCount++;
-				VPRINTFN(1,"Post to influxdb: success");
+	}
+	if (historyHours) {
+		hist = modhist_init(historyHours * 3600 / queryIntervalSeconds);
+		if (!hist) { LOG(0,"unable to allocate the history\n"); return; }
+	}
+	if (socketPath && (brokerInit() != 0)) return;
+	if (startWorkers() != 0) return;
+
+	LOGN(0,"mainloop started (%s %s)",ME,VER);
+
+	pfd[0].fd = wakeFd; pfd[0].events = POLLIN;
+	while(mainloopDone == 0) {
+		handleSignals();
+#ifdef HAVE_DBUS
+		// services are (re)connected by dbusPublish
+		nfds = 1;
+		if (dbusBus) for (int i=0;i<numWorkers;i++) {
+			// read by vedbus_flush in dbusPublish, the fd is not readable for them
+			if (dbusServices[i].ve && vedbus_pending(dbusServices[i].ve)) dbusDispatch(&workers[i]);
+			pfd[i+1].fd = dbusServices[i].ve ? vedbus_fd(dbusServices[i].ve) : -1;
+			pfd[i+1].events = POLLIN;
+			nfds++;
+		}
+#endif
+		if (poll(pfd,nfds,-1) <= 0) continue;					// interrupted by a signal
+#ifdef HAVE_DBUS
+		for (int i=1;i<nfds;i++)
+			if (pfd[i].revents) dbusDispatch(&workers[i-1]);
+#endif
+		if (!pfd[0].revents) continue;
+		eventfd_read(wakeFd,&v);
+		sendSamples();
+	}
+	stopWorkers();
+}
+
+
+// the CAN data is sent about once per second, report if it stops
+#define CAN_SILENCE_MS 10000
+
+int appendCanData(PYL_CanT *c) {
+	int rc;
+
+	rc = influxdb_format_line(iClient,
+		INFLUX_MEAS("Battery"),
+		INFLUX_TAG("Module", "stack"),
+		INFLUX_F_FLT("i", (float)c->ad.current/PYL_MODULE_CURRENT_DIVIDER, 1),
+		INFLUX_F_FLT("u", (float)c->ad.voltage/PYL_MODULE_VOLTAGE_DIVIDER, 2),
+		INFLUX_F_INT("temp_bms", c->ad.temp[0]),
+		INFLUX_END);
+	if ((rc >= 0) && (c->seen & PYL_CAN_SEEN_SOC))
+		rc = influxdb_format_line(iClient, INFLUX_F_INT("SOC", c->soc), INFLUX_F_INT("SOH", c->soh), INFLUX_END);
+	if ((rc >= 0) && (c->seen & PYL_CAN_SEEN_LIMITS))
+		rc = influxdb_format_line(iClient,
+			INFLUX_F_FLT("chargeVoltageLimit", (float)c->cd.chargeVoltageLimit/1000, 1),
+			INFLUX_F_FLT("dischargeVoltageLimit", (float)c->cd.dischargeVoltageLimit/1000, 1),
+			INFLUX_F_FLT("chargeCurrentLimit", (float)c->cd.chargeCurrentLimit/10, 1),
+			INFLUX_F_FLT("dischargeCurrentLimit", (float)c->cd.dischargeCurrentLimit/1000, 1),
+			INFLUX_END);
+	if ((rc >= 0) && (c->seen & PYL_CAN_SEEN_REQUEST))
+		rc = influxdb_format_line(iClient, INFLUX_F_INT("chargeDischargeStatus", c->cd.chargeDischargeStatus), INFLUX_END);
+	if ((rc >= 0) && (c->seen & PYL_CAN_SEEN_ALARM))
+		rc = influxdb_format_line(iClient,
+			INFLUX_F_INT("Modules", c->numModules),
+			INFLUX_F_INT("protection", c->ai.status[0] | (c->ai.status[1] << 8)),
+			INFLUX_F_INT("alarm", c->ai.status[2] | (c->ai.status[3] << 8)),
+			INFLUX_END);
+	if (rc >= 0)
+		rc = influxdb_format_line(iClient, INFLUX_TS(timestamp), INFLUX_END);
+
+	if (rc < 0) { EPRINTFN("influxdb_format_line failed"); return 1; }
+	return 0;
+}
+
+
+int canDataChanged(PYL_CanT *c, PYL_CanT *sent) {
+	if (analogDataChanged(&c->ad,&sent->ad)) return 1;
+	if ((c->soc != sent->soc) || (c->soh != sent->soh) || (c->numModules != sent->numModules)) return 1;
+	if (memcmp(&c->cd,&sent->cd,sizeof(c->cd)) != 0) return 1;
+	if (memcmp(&c->ai.status,&sent->ai.status,sizeof(c->ai.status)) != 0) return 1;
+	return 0;
+}
+
+
+// same as mainloop but the data is received passively, nothing is sent on the bus
+void canloop() {
+	PYL_CanT sent;
+	struct pollfd pfd;
+	uint64_t now,next;
+	int silent = 0;
+
+	memset(&sent,0,sizeof(sent));
+	if (startWorkers() != 0) return;			// no workers, the sender only
+	LOGN(0,"mainloop started (%s %s)",ME,VER);
+
+	pfd.fd = pyl_canFd(can); pfd.events = POLLIN;
+	next = getMonotonicMs() + queryIntervalSeconds * 1000;
+	while (mainloopDone == 0) {
+		handleSignals();
+		now = getMonotonicMs();
+		if (now >= next) {
+			next = now + queryIntervalSeconds * 1000;
+			if (now - can->lastFrame > CAN_SILENCE_MS) {
+				if (!silent) LOG(0,"no CAN frames from the battery for %d seconds\n",CAN_SILENCE_MS/1000);
+				silent = 1;
+				errs_pylon++;
+			} else silent = 0;
+			if ((can->seen & PYL_CAN_SEEN_ANALOG) && !silent && canDataChanged(can,&sent)) {
+				timestamp = influxdb_getTimestamp();
+				if (appendCanData(can) == 0) {
+					queueBatch();
+					memcpy(&sent,can,sizeof(sent));
+				}
 			}
+			continue;
 		}
-		sleep(queryIntervalSeconds);
+		if (poll(&pfd,1,next - now) > 0)
+			if (pyl_canRead(can) < 0) errs_pylon++;
 	}
+	stopWorkers();
 }
 
-void sighup_handler(int signum) {
-	LOG(0,"Influxdb packets send: %d, http send errors: %d, pylontech query errors: %d",http_sendCount,errs_http,errs_pylon);
+
+void showStatistics() {
+	unsigned sendCount = 0, errs = 0;
+	for (sinkT *s = sinks; s < sinks + numSinks; s++) {
+		sendCount += s->sendCount;
+		errs += s->errs;
+	}
+	LOG(0,"Influxdb packets send: %u, http send errors: %u, pylontech query errors: %d",sendCount,errs,errs_pylon);
+	if (numSinks > 1) for (sinkT *s = sinks; s < sinks + numSinks; s++)
+		LOG(0,"%s: packets send: %u, http send errors: %u, dropped while busy: %u",s->name,s->sendCount,s->errs,s->dropped);
+	for (sinkT *s = sinks; s < sinks + numSinks; s++)
+		if (s->client && s->client->tcp) {
+			uint64_t connects,resent;
+			size_t pending;
+			influxdb_tcp_stats(s->client->tcp,&connects,&pending,&resent);
+			LOG(0,"%s: connects: %llu, kept for a reconnect: %zu bytes, written again: %llu bytes",s->name,(unsigned long long)connects,pending,(unsigned long long)resent);
+		}
+	if (can) LOG(0,"CAN frames decoded: %u",can->frames);
+	if (reg) for (int i=0;i<modreg_count(reg);i++) {
+		MODREG_EntryT *m = modreg_get(reg,i);
+		LOG(0,"%s: %s, polls: %u, errors: %u, latency avg: %u ms, max: %u ms",moduleName(m->port,m->group,m->adr),modreg_healthStr(m->health),m->polls,m->errors,
+			m->polls > m->errors ? (unsigned)(m->latencySumMs / (m->polls - m->errors)) : 0,m->latencyMaxMs);
+	}
+	for (workerT *w = workers; w < workers + numWorkers; w++) {
+		PYL_HandleT *pyl = w->pyl;
+		if (pyl) LOG(0,"Serial port %s busy: %d, settings checked: %d, altered externally: %d, samples dropped: %u",pyl->portname,pyl->stats.portBusy,pyl->stats.termiosChecks,pyl->stats.termiosAltered,w->dropped);
+	}
+	if (socketPath) LOG(0,"Broker requests: %u, from cache: %u, joined a pending request: %u",brokerRequests,brokerCacheHits,brokerCoalesced);
+	for (sinkT *s = sinks; s < sinks + numSinks; s++)
+		if (s->client && s->client->wal) {
+			uint64_t records,bytes,dropped;
+			influxdb_wal_stats(s->client->wal,&records,&bytes,&dropped);
+			LOG(0,"Disk queue%s%s: %llu records, %llu kB, dropped: %llu",numSinks > 1 ? " " : "",numSinks > 1 ? s->name : "",
+				(unsigned long long)records,(unsigned long long)bytes / 1024,(unsigned long long)dropped);
+		}
+	if (hist) {
+		uint64_t samples;
+		size_t bytes;
+		pthread_mutex_lock(&histLock);
+		modhist_usage(hist,&samples,&bytes);
+		pthread_mutex_unlock(&histLock);
+		LOG(0,"History: %llu samples, %zu kB",(unsigned long long)samples,bytes / 1024);
+	}
 }
 
 
@@ -441,27 +1875,90 @@ void sighup_handler(int signum) {
 void exit_handler(void) {
     LOG(2,"exit_handler called\n");
 
-	if(pyl)	pyl_freeHandle(pyl);
-	sighup_handler(0);
+	stopWorkers();
+	showStatistics();
+	for (workerT *w = workers; w < workers + numWorkers; w++) {
+		if (w->pyl) pyl_freeHandle(w->pyl);
+		w->pyl = NULL;
+		hotplug_close(w->hotplugFd);
+		w->hotplugFd = -1;
+		spsc_free(w->ring);
+		w->ring = NULL;
+		free(w->schedule);
+		w->schedule = NULL;
+		if (w->reqFd >= 0) close(w->reqFd);
+		w->reqFd = -1;
+		for (int i=0;i<MODREG_SLOTS_PER_PORT;i++) {
+			free(w->cache[i]);
+			w->cache[i] = NULL;
+		}
+	}
+	if (listenFd >= 0) {
+		// queued and answered requests are all in brokerInflight
+		for (int i=0;i<BROKER_MAX_INFLIGHT;i++) {
+			free(brokerInflight[i]);
+			brokerInflight[i] = NULL;
+		}
+		close(listenFd);
+		listenFd = -1;
+		unlink(socketPath);
+		close(doneFd);
+	}
+	for (sinkT *s = sinks; s < sinks + numSinks; s++) {
+		if (s->ring) {
+			char *batch;
+			while (spsc_pop(s->ring,&batch)) free(batch);
+			spsc_free(s->ring);
+			s->ring = NULL;
+		}
+		free(s->pending);
+		s->pending = NULL;
+		if (s->fd >= 0) close(s->fd);
+		s->fd = -1;
+		// closes the disk queue and writes the lines a tcp sink has not written yet
+		influxdb_post_free(s->client);
+		s->client = NULL;
+	}
+	influxdb_post_free(iClient);
+	iClient = NULL;
+	pyl_canFree(can);
+	can = NULL;
+	pyl_shmDestroy(shm,shmName);
+	shm = NULL;
+#ifdef HAVE_DBUS
+	for (int i=0;i<MAX_PORTS;i++) dbusFree(&dbusServices[i]);
+#endif
+	modhist_free(hist);
+	hist = NULL;
+	for (int i=0;i<numTemplates;i++) influxdb_template_free(templates[i].t);
+	free(templates);
+	templates = NULL;
+	numTemplates = 0;
+	modreg_free(reg);
+	reg = NULL;
 	LOG(0,"terminated");
 	mainloopDone++;
 }
 
 
 void sigterm_handler(int signum) {
-	LOG(2,"sigterm_handler called\n");
 	mainloopDone++;
 }
 
 
+void sighup_handler(int signum) {
+	showStats = 1;
+}
+
+
 void sigusr1_handler(int signum) {
-	log_verbosity++;
-	printf("verbose: %d\n",log_verbosity);
+	log_incVerboseLevel();
+	showVerbose = 1;
 }
 
 void sigusr2_handler(int signum) {
-	if (log_verbosity) log_verbosity--;
-	printf("verbose: %d\n",log_verbosity);
+	log_decVerboseLevel();
+	showVerbose = 1;
 }
 
 
@@ -470,6 +1967,16 @@ void sigusr2_handler(int signum) {
 
 int main (int argc, char **argv) {
 	if (parseArgs(argc,argv) != 0) exit(1);
+	// the first server uses diskQueueDir, the others a subdirectory sink2..
+	if (diskQueueDir) for (int i=0;i<numSinks;i++) {
+		char dir[PATH_MAX];
+		if (i) snprintf(dir,sizeof(dir),"%s/sink%d",diskQueueDir,i+1);
+		else snprintf(dir,sizeof(dir),"%s",diskQueueDir);
+		if (influxdb_post_openDiskQueue(sinks[i].client,dir,(size_t)diskQueueMB * 1024*1024) != 0) {
+			EPRINTF("unable to open the disk queue in %s\n",dir);
+			exit(1);
+		}
+	}
 
 	atexit(exit_handler);
 	signal(SIGTERM, sigterm_handler);
@@ -477,5 +1984,5 @@ int main (int argc, char **argv) {
 	signal(SIGUSR1, sigusr2_handler);
 	signal(SIGUSR2, sigusr1_handler);
 
-	mainloop();
+	if (can) canloop(); else mainloop();
 }
@@ -0,0 +1,177 @@
+/*
+ * pyloncan.c
+ *
+ * passive listener for the CAN frames a Pylontech master sends to the inverter
+ * all values are little endian, see pyloncan.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include "pyloncan.h"
+#include "util.h"
+
+static const uint32_t canIds[] = { PYL_CAN_ID_LIMITS, PYL_CAN_ID_SOC, PYL_CAN_ID_ANALOG, PYL_CAN_ID_ALARM, PYL_CAN_ID_REQUEST, PYL_CAN_ID_NAME };
+#define NUM_CAN_IDS (int)(sizeof(canIds)/sizeof(canIds[0]))
+
+
+PYL_CanT * pyl_canInit(const char *ifname) {
+	struct can_filter filter[NUM_CAN_IDS];
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+	PYL_CanT *can;
+	int i,fd;
+
+	if (strlen(ifname) >= IFNAMSIZ) return NULL;
+	fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+	if (fd < 0) {
+		LOG(0,"pyl_canInit: unable to create CAN socket (%s)\n",strerror(errno));
+		return NULL;
+	}
+
+	// let the kernel drop everything but the frames we decode
+	for (i=0;i<NUM_CAN_IDS;i++) {
+		filter[i].can_id = canIds[i];
+		filter[i].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+	}
+	if (setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, filter, sizeof(filter)) < 0) {
+		LOG(0,"pyl_canInit: unable to set CAN filter (%s)\n",strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	memset(&ifr,0,sizeof(ifr));
+	strcpy(ifr.ifr_name,ifname);
+	if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+		LOG(0,"pyl_canInit: CAN interface %s not found\n",ifname);
+		close(fd);
+		return NULL;
+	}
+	memset(&addr,0,sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		LOG(0,"pyl_canInit: unable to bind to %s (%s)\n",ifname,strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	can = calloc(1,sizeof(*can));
+	if (!can) { close(fd); return NULL; }
+	can->fd = fd;
+	return can;
+}
+
+
+void pyl_canFree(PYL_CanT *can) {
+	if (!can) return;
+	if (can->fd >= 0) close(can->fd);
+	free(can);
+}
+
+
+int pyl_canFd(PYL_CanT *can) {
+	return can->fd;
+}
+
+
+static int getU16(const uint8_t *data) {
+	return data[0] | (data[1] << 8);
+}
+
+static int getS16(const uint8_t *data) {
+	return (int16_t)(data[0] | (data[1] << 8));
+}
+
+
+// protection (byte 0,1) and alarm (byte 2,3) flags to the states of the RS485 alarm info
+static void decodeAlarm(PYL_AlarmInfoT *ai, const uint8_t *data) {
+	int i;
+
+	memset(ai,0,sizeof(*ai));
+	for (i=0;i<4;i++) ai->status[i] = data[i];
+	if ((data[0] | data[2]) & 0x02) ai->moduleVoltageStat = 2;
+	else if ((data[0] | data[2]) & 0x04) ai->moduleVoltageStat = 1;
+	ai->tempCount = 1;
+	if ((data[0] | data[2]) & 0x08) ai->tempStatus[0] = 2;
+	else if ((data[0] | data[2]) & 0x10) ai->tempStatus[0] = 1;
+	if ((data[0] | data[2]) & 0x80) ai->dischargeCurrentStat = 2;
+	if ((data[1] | data[3]) & 0x01) ai->chargeCurrentStat = 2;
+}
+
+
+int pyl_canDecode(PYL_CanT *can, uint32_t id, const uint8_t *data, int len) {
+	switch (id) {
+		case PYL_CAN_ID_LIMITS:
+			if (len < 6) return 0;
+			can->cd.chargeVoltageLimit = getU16(data) * 100;			// 0.1V -> mV
+			can->cd.chargeCurrentLimit = getS16(data+2);				// 0.1A
+			can->cd.dischargeCurrentLimit = getS16(data+4) * 100;		// 0.1A -> mA, as the RS485 response
+			if (len >= 8) can->cd.dischargeVoltageLimit = getU16(data+6) * 100;
+			can->seen |= PYL_CAN_SEEN_LIMITS;
+			break;
+		case PYL_CAN_ID_SOC:
+			if (len < 4) return 0;
+			can->soc = getU16(data);
+			can->soh = getU16(data+2);
+			can->seen |= PYL_CAN_SEEN_SOC;
+			break;
+		case PYL_CAN_ID_ANALOG:
+			if (len < 6) return 0;
+			can->ad.voltage = getS16(data) * 10;						// 0.01V -> mV
+			can->ad.current = getS16(data+2);							// 0.1A
+			can->ad.tempCount = 1;
+			can->ad.temp[0] = getS16(data+4) / 10;						// 0.1 degree
+			can->seen |= PYL_CAN_SEEN_ANALOG;
+			break;
+		case PYL_CAN_ID_ALARM:
+			if (len < 5) return 0;
+			decodeAlarm(&can->ai,data);
+			can->numModules = data[4];
+			can->seen |= PYL_CAN_SEEN_ALARM;
+			break;
+		case PYL_CAN_ID_REQUEST:
+			if (len < 1) return 0;
+			can->cd.chargeDischargeStatus = data[0];
+			can->seen |= PYL_CAN_SEEN_REQUEST;
+			break;
+		case PYL_CAN_ID_NAME:
+			memset(can->mi.manufacturerName,0,sizeof(can->mi.manufacturerName));
+			memcpy(can->mi.manufacturerName,data,len < 8 ? len : 8);
+			can->seen |= PYL_CAN_SEEN_NAME;
+			break;
+		default:
+			return 0;
+	}
+	can->frames++;
+	return 1;
+}
+
+
+int pyl_canRead(PYL_CanT *can) {
+	struct can_frame frame;
+	ssize_t len;
+	int num = 0;
+
+	for (;;) {
+		len = read(can->fd, &frame, sizeof(frame));
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR) break;
+			LOG(0,"pyl_canRead: read failed (%s)\n",strerror(errno));
+			return PYL_ERR;
+		}
+		if (len < (ssize_t)sizeof(frame)) continue;
+		if (frame.can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG)) continue;
+		num += pyl_canDecode(can, frame.can_id & CAN_SFF_MASK, frame.data, frame.can_dlc);
+	}
+	if (num) can->lastFrame = getMonotonicMs();
+	VPRINTF(3,"pyl_canRead: %d frames decoded\n",num);
+	return num;
+}
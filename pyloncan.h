@@ -0,0 +1,84 @@
+/*
+ * pyloncan.h
+ *
+ * passive listener for the CAN frames a Pylontech master sends to the inverter (500 kbit/s, about once per second)
+ *
+ * Usage:
+ *     PYL_CanT *can = pyl_canInit("can0");
+ *     poll for input on pyl_canFd(can), then
+ *     if (pyl_canRead(can) > 0) use can->ad, can->cd, can->ai, can->soc ...
+ *     pyl_canFree(can);
+ *
+ * Only the frames decoded here pass the kernel filter, everything else on the bus is dropped by the kernel.
+ * For testing:
+ *     ip link add dev vcan0 type vcan && ip link set up vcan0
+ *     cansend vcan0 356#8C1496FFEA00   (52.60 V, -10.6 A, 23.4 C)
+ */
+
+#ifndef PYLONCAN_H_INCLUDED
+#define PYLONCAN_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "pylontechapi.h"
+
+#define PYL_CAN_ID_LIMITS 0x351			// charge voltage, charge current, discharge current, discharge voltage
+#define PYL_CAN_ID_SOC 0x355			// state of charge, state of health
+#define PYL_CAN_ID_ANALOG 0x356			// voltage, current, temperature
+#define PYL_CAN_ID_ALARM 0x359			// protection and alarm flags, number of modules
+#define PYL_CAN_ID_REQUEST 0x35c		// charge/discharge enable, force charge request
+#define PYL_CAN_ID_NAME 0x35e			// manufacturer name
+
+// bits of PYL_CanT.seen
+#define PYL_CAN_SEEN_LIMITS 0x01
+#define PYL_CAN_SEEN_SOC 0x02
+#define PYL_CAN_SEEN_ANALOG 0x04
+#define PYL_CAN_SEEN_ALARM 0x08
+#define PYL_CAN_SEEN_REQUEST 0x10
+#define PYL_CAN_SEEN_NAME 0x20
+
+// bits of chargeDischargeStatus, same as in the response to GetChargeDischargeManagementInfo
+#define PYL_CAN_CHARGE_ENABLE 0x80
+#define PYL_CAN_DISCHARGE_ENABLE 0x40
+#define PYL_CAN_FORCE_CHARGE1 0x20
+#define PYL_CAN_FORCE_CHARGE2 0x10
+#define PYL_CAN_FULL_CHARGE 0x08
+
+typedef struct {
+	int fd;
+	unsigned int seen;					// PYL_CAN_SEEN_x of the frames received since pyl_canInit
+	uint64_t lastFrame;					// ms, CLOCK_MONOTONIC
+	unsigned int frames;				// number of frames decoded
+
+	// decoded to the units used by the RS485 api
+	PYL_AnalogDataT ad;					// stack voltage, current and temperature (no cell data)
+	PYL_ChargeDischargeInfoT cd;
+	PYL_AlarmInfoT ai;					// status[0..3]: protection and alarm flags as sent
+	PYL_ManufacturerInformationT mi;
+	int soc;							// %
+	int soh;							// %
+	int numModules;
+} PYL_CanT;
+
+// open a raw CAN socket on ifname with kernel filters for the ids above, NULL on failure
+PYL_CanT * pyl_canInit(const char *ifname);
+
+void pyl_canFree(PYL_CanT *can);
+
+// file descriptor to wait on for input
+int pyl_canFd(PYL_CanT *can);
+
+// read and decode all pending frames without blocking, returns the number of frames decoded or PYL_ERR
+int pyl_canRead(PYL_CanT *can);
+
+// decode one frame, returns 1 if the id is known
+int pyl_canDecode(PYL_CanT *can, uint32_t id, const uint8_t *data, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PYLONCAN_H_INCLUDED
@@ -0,0 +1,310 @@
+/*
+ * pylonconsole.c
+ *
+ * console port (RS232) text protocol backend for pylontechapi
+ *
+ * pwr output of a US3000C (columns differ between firmware versions, they are looked up by name):
+ *
+ *   Power Volt   Curr   Tempr  Tlow   Thigh  Vlow   Vhigh  Base.St  Volt.St  Curr.St  Temp.St  Coulomb  Time                 B.V.St   B.T.St
+ *   1     49800  -1120  23000  22000  23000  3316   3323   Dischg   Normal   Normal   Normal   89%      2021-12-02 12:34:56  Normal   Normal
+ *   2     -      -      -      -      -      -      -      Absent   -        -        -        -        -                    -        -
+ *
+ * bat <n> (header names contain blanks, the columns are fixed):
+ *
+ *   Battery  Volt     Curr     Tempr    Base State   Volt. State  Curr. State  Temp. State  Coulomb
+ *   0        3316     -373     23000    Dischg       Normal       Normal       Normal        89%      63211 mAH
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "pylonconsole.h"
+#include "uart.h"
+#include "util.h"
+
+#define MAX_TOKENS 32
+
+// a part of the receive buffer, not terminated
+typedef struct {
+	const char *p;
+	int len;
+} spanT;
+
+
+// get the next line from *pos, returns 0 at the end of the buffer
+static int nextLine(const char **pos, const char *end, spanT *line) {
+	const char *p = *pos;
+
+	if (p >= end) return 0;
+	line->p = p;
+	while (p < end && *p != '\n' && *p != '\r') p++;
+	line->len = p - line->p;
+	while (p < end && (*p == '\n' || *p == '\r')) p++;
+	*pos = p;
+	return 1;
+}
+
+
+// split a line into whitespace separated tokens, returns the number of tokens
+static int tokenize(spanT *line, spanT *tok, int maxTok) {
+	const char *p = line->p;
+	const char *end = p + line->len;
+	int n = 0;
+
+	while (n < maxTok) {
+		while (p < end && (*p == ' ' || *p == '\t')) p++;
+		if (p >= end) break;
+		tok[n].p = p;
+		while (p < end && *p != ' ' && *p != '\t') p++;
+		tok[n].len = p - tok[n].p;
+		n++;
+	}
+	return n;
+}
+
+
+static int spanEq(spanT *t, const char *s) {
+	int len = strlen(s);
+	return (t->len == len) && (memcmp(t->p,s,len) == 0);
+}
+
+
+// decimal number with optional sign, a trailing % is ignored, returns 0 if t is not a number (e.g. "-")
+static int spanInt(spanT *t, int *val) {
+	const char *p = t->p;
+	const char *end = p + t->len;
+	int neg = 0;
+	int v = 0;
+
+	if (p < end && *p == '-') { neg++; p++; }
+	if (p >= end || *p < '0' || *p > '9') return 0;
+	while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+	if (p < end && *p != '%') return 0;
+	*val = neg ? -v : v;
+	return 1;
+}
+
+
+// map a state column to the values of the alarm info
+// Normal or - is ok, names starting with L (low) or U (under) are below the limit,
+// H (high) or O (over) above. A leading B (battery/cell) or M (mosfet) is skipped
+static int spanState(spanT *t) {
+	const char *p = t->p;
+	int len = t->len;
+
+	if (len == 0 || spanEq(t,"Normal") || spanEq(t,"-")) return 0;
+	if (len > 1 && (*p == 'B' || *p == 'M')) { p++; len--; }
+	switch (*p) {
+		case 'L':
+		case 'U': return 1;
+		case 'H':
+		case 'O': return 2;
+	}
+	return 0xf0;
+}
+
+
+// send a command and read the response up to the "$$" end marker, the prompt following it
+// is discarded with the next command
+static int consoleCommand(PYL_HandleT *pyl, const char *cmd) {
+	struct PYL_Console *con = pyl->console;
+	uint64_t deadline,now;
+	int res,waitMs;
+
+	if (pyl->serFd <= 0)
+		if (pyl_openSerialPort(pyl) != PYL_OK) return PYL_ERR;
+
+	uart_flush(pyl->serFd);
+	VPRINTF(2,"consoleCommand: sending '%s'\n",cmd);
+	if (uart_write_bytes(pyl->serFd,(char *)cmd,strlen(cmd)) < 0 || uart_write_bytes(pyl->serFd,"\r",1) < 0) {
+		LOG(0,"consoleCommand: write to %s failed\n",pyl->portname);
+		return PYL_ERR;
+	}
+
+	con->rxLen = 0;
+	deadline = getMonotonicMs() + PYL_CONSOLE_TIMEOUT_MS;
+	while ((now = getMonotonicMs()) < deadline) {
+		waitMs = deadline - now;
+		if (waitMs > 500) waitMs = 500;			// uart_waiti does not support more than one second
+		if (uart_waiti(pyl->serFd,waitMs) != UART_OK) continue;
+		res = uart_read(pyl->serFd,con->rxBuf+con->rxLen,sizeof(con->rxBuf)-1-con->rxLen);
+		if (res < 0 && errno == EAGAIN) continue;
+		if (res <= 0) break;
+		con->rxLen += res;
+		con->rxBuf[con->rxLen] = 0;
+		if (strstr(con->rxBuf,"\n$$")) return PYL_OK;
+		if (con->rxLen >= (int)sizeof(con->rxBuf)-1) {
+			LOG(0,"consoleCommand: response to '%s' exceeds %zu bytes\n",cmd,sizeof(con->rxBuf)-1);
+			return PYL_ERR;
+		}
+	}
+	LOG(1,"consoleCommand: no complete response to '%s' (%d bytes received)\n",cmd,con->rxLen);
+	return PYL_ERR;
+}
+
+
+enum { COL_VOLT, COL_CURR, COL_TEMPR, COL_TLOW, COL_THIGH, COL_BASE, COL_VOLTST, COL_CURRST, COL_TEMPST, COL_COULOMB, COL_BTST, COL_COUNT };
+static const char *pwrColumns[COL_COUNT] = { "Volt", "Curr", "Tempr", "Tlow", "Thigh", "Base.St", "Volt.St", "Curr.St", "Temp.St", "Coulomb", "B.T.St" };
+
+
+int pylc_pwr(PYL_HandleT *pyl) {
+	struct PYL_Console *con = pyl->console;
+	const char *pos,*end;
+	spanT line,tok[MAX_TOKENS];
+	spanT *t;
+	int col[COL_COUNT];
+	int i,j,n,num,timeCol,haveHeader;
+	PYL_ConsolePackT *pack;
+	uint64_t now = getMonotonicMs();
+
+	if (con->pwrTime && now - con->pwrTime < PYL_CONSOLE_CACHE_MS) return PYL_OK;
+	if (consoleCommand(pyl,"pwr") != PYL_OK) return PYL_ERR;
+
+	memset(con->pack,0,sizeof(con->pack));
+	con->numPacks = 0;
+	for (i=0;i<COL_COUNT;i++) col[i] = -1;
+	timeCol = -1; haveHeader = 0;
+
+	pos = con->rxBuf; end = con->rxBuf + con->rxLen;
+	while (nextLine(&pos,end,&line)) {
+		n = tokenize(&line,tok,MAX_TOKENS);
+		if (n == 0) continue;
+		if (!haveHeader) {
+			if (!spanEq(&tok[0],"Power")) continue;
+			for (i=1;i<n;i++) {
+				if (spanEq(&tok[i],"Time")) timeCol = i;
+				for (j=0;j<COL_COUNT;j++)
+					if (spanEq(&tok[i],pwrColumns[j])) col[j] = i;
+			}
+			// the time value contains a blank, columns after it are shifted by one
+			if (timeCol > 0)
+				for (j=0;j<COL_COUNT;j++) if (col[j] > timeCol) col[j]++;
+			haveHeader++;
+			continue;
+		}
+		if (!spanInt(&tok[0],&num)) continue;
+		if (num < 1 || num > PYL_CONSOLE_MAX_PACKS) continue;
+		pack = &con->pack[num-1];
+
+		#define COLUMN(c) ((col[c] >= 0 && col[c] < n) ? &tok[col[c]] : NULL)
+		t = COLUMN(COL_BASE);
+		if (!t || spanEq(t,"Absent")) continue;
+		t = COLUMN(COL_VOLT);
+		if (!t || !spanInt(t,&pack->voltage)) continue;
+		pack->present = 1;
+		if ((t = COLUMN(COL_CURR))) spanInt(t,&pack->current);
+		if ((t = COLUMN(COL_TEMPR))) spanInt(t,&pack->temp);
+		if ((t = COLUMN(COL_TLOW))) spanInt(t,&pack->tempLow);
+		if ((t = COLUMN(COL_THIGH))) spanInt(t,&pack->tempHigh);
+		if ((t = COLUMN(COL_COULOMB))) spanInt(t,&pack->soc);
+		if ((t = COLUMN(COL_BASE))) pack->charging = spanEq(t,"Charge");
+		if ((t = COLUMN(COL_VOLTST))) pack->voltState = spanState(t);
+		if ((t = COLUMN(COL_CURRST))) pack->currState = spanState(t);
+		if ((t = COLUMN(COL_TEMPST))) pack->tempState = spanState(t);
+		if ((t = COLUMN(COL_BTST))) pack->cellTempState = spanState(t);
+		#undef COLUMN
+		if (num > con->numPacks) con->numPacks = num;
+	}
+	if (!haveHeader) {
+		LOG(0,"pylc_pwr: no pwr table in response\n");
+		return PYL_ERR;
+	}
+	con->pwrTime = now;
+	VPRINTF(2,"pylc_pwr: %d packs\n",con->numPacks);
+	return PYL_OK;
+}
+
+
+// cell lines of bat <adr>, pd and ai may be NULL
+static int consoleBat(PYL_HandleT *pyl, PYL_AnalogDataT *pd, PYL_AlarmInfoT *ai) {
+	struct PYL_Console *con = pyl->console;
+	const char *pos,*end;
+	spanT line,tok[MAX_TOKENS];
+	char cmd[16];
+	int i,n,num,cells,val;
+
+	snprintf(cmd,sizeof(cmd),"bat %d",pyl->adr);
+	if (consoleCommand(pyl,cmd) != PYL_OK) return PYL_ERR;
+
+	cells = 0;
+	pos = con->rxBuf; end = con->rxBuf + con->rxLen;
+	while (nextLine(&pos,end,&line)) {
+		n = tokenize(&line,tok,MAX_TOKENS);
+		if (n < 8 || !spanInt(&tok[0],&num) || !spanInt(&tok[1],&val)) continue;
+		if (cells >= CELLS_MAX) break;
+		if (pd) {
+			pd->cellVoltage[cells] = val;
+			// Coulomb is the percentage followed by the remaining capacity of the pack
+			for (i=8;i<n-1;i++)
+				if (tok[i].len && tok[i].p[tok[i].len-1] == '%') {
+					spanInt(&tok[i+1],&pd->remainingCapacity);
+					break;
+				}
+		}
+		if (ai) ai->cellVoltageStatus[cells] = spanState(&tok[5]);
+		cells++;
+	}
+	if (cells == 0) {
+		LOG(0,"pylc_bat: no cells in response to '%s'\n",cmd);
+		return PYL_ERR;
+	}
+	if (pd) pd->cellsCount = cells;
+	if (ai) ai->cellsCount = cells;
+	return PYL_OK;
+}
+
+
+static PYL_ConsolePackT * currentPack(PYL_HandleT *pyl) {
+	PYL_ConsolePackT *pack;
+
+	if (pylc_pwr(pyl) != PYL_OK) return NULL;
+	if (pyl->adr < 1 || pyl->adr > PYL_CONSOLE_MAX_PACKS) return NULL;
+	pack = &pyl->console->pack[pyl->adr-1];
+	return pack->present ? pack : NULL;
+}
+
+
+int pylc_packPresent(PYL_HandleT *pyl) {
+	return currentPack(pyl) != NULL;
+}
+
+
+// the console has the pack temperature, the lowest and the highest cell temperature.
+// The pack current is converted to the units of the binary protocol, cycle count is not available
+int pylc_getAnalogData(PYL_HandleT *pyl, PYL_AnalogDataT *pd) {
+	PYL_ConsolePackT *pack;
+
+	memset(pd,0,sizeof(*pd));
+	pack = currentPack(pyl);
+	if (!pack) return PYL_ERR;
+	if (consoleBat(pyl,pd,NULL) != PYL_OK) return PYL_ERR;
+
+	pd->tempCount = 3;
+	pd->temp[0] = pack->temp / 1000;
+	pd->temp[1] = pack->tempLow / 1000;
+	pd->temp[2] = pack->tempHigh / 1000;
+	pd->current = pack->current * PYL_MODULE_CURRENT_DIVIDER / 1000;
+	pd->voltage = pack->voltage;
+	if (pack->soc > 0) pd->capacity = (int)((int64_t)pd->remainingCapacity * 100 / pack->soc);
+	return PYL_OK;
+}
+
+
+int pylc_getAlarmInfo(PYL_HandleT *pyl, PYL_AlarmInfoT *ai) {
+	PYL_ConsolePackT *pack;
+
+	memset(ai,0,sizeof(*ai));
+	pack = currentPack(pyl);
+	if (!pack) return PYL_ERR;
+	if (consoleBat(pyl,NULL,ai) != PYL_OK) return PYL_ERR;
+
+	ai->tempCount = 3;							// same order as the temperatures of pylc_getAnalogData
+	ai->tempStatus[0] = pack->tempState;
+	ai->tempStatus[1] = pack->cellTempState;
+	ai->tempStatus[2] = pack->cellTempState;
+	ai->moduleVoltageStat = pack->voltState;
+	if (pack->charging) ai->chargeCurrentStat = pack->currState;
+	else ai->dischargeCurrentStat = pack->currState;
+	return PYL_OK;
+}
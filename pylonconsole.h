@@ -0,0 +1,58 @@
+/*
+ * pylonconsole.h
+ *
+ * console port (RS232) text protocol backend for pylontechapi
+ *
+ * The console of the master pack answers "pwr" with one line per pack of
+ * the stack and "bat <n>" with one line per cell of pack n. Responses are
+ * parsed in place, the tables are split into lines and tokens pointing
+ * into the receive buffer. Used by pylontechapi.c if pyl->console is set,
+ * see pyl_connectConsole.
+ */
+
+#ifndef PYLONCONSOLE_H_INCLUDED
+#define PYLONCONSOLE_H_INCLUDED
+
+#include "pylontechapi.h"
+
+#define PYL_CONSOLE_MAX_PACKS 16
+#define PYL_CONSOLE_BUFSIZE 8192
+#define PYL_CONSOLE_TIMEOUT_MS 2000
+// a pwr table is reused for requests within this time, one pwr per poll cycle for the whole stack
+#define PYL_CONSOLE_CACHE_MS 1000
+
+// one line of the pwr table, states are 0=ok, 1=below low limit, 2=above high limit, F0=other
+typedef struct {
+	int present;
+	int voltage;				// mV
+	int current;				// mA
+	int temp;					// m°C
+	int tempLow;
+	int tempHigh;
+	int soc;					// %
+	int charging;
+	int voltState;
+	int currState;
+	int tempState;
+	int cellTempState;			// B.T.St
+} PYL_ConsolePackT;
+
+struct PYL_Console {
+	uint64_t pwrTime;			// ms, CLOCK_MONOTONIC, time of the cached pwr table
+	int numPacks;				// highest pack number present
+	PYL_ConsolePackT pack[PYL_CONSOLE_MAX_PACKS];
+	int rxLen;
+	char rxBuf[PYL_CONSOLE_BUFSIZE];
+};
+
+// query the pwr table (if the cached one is outdated), returns PYL_OK or PYL_ERR
+int pylc_pwr(PYL_HandleT *pyl);
+
+// 1 if pack pyl->adr is listed in the pwr table
+int pylc_packPresent(PYL_HandleT *pyl);
+
+// module data of pyl->adr from pwr and bat <adr>
+int pylc_getAnalogData(PYL_HandleT *pyl, PYL_AnalogDataT *pd);
+int pylc_getAlarmInfo(PYL_HandleT *pyl, PYL_AlarmInfoT *ai);
+
+#endif // PYLONCONSOLE_H_INCLUDED
@@ -9,12 +9,18 @@
 #include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <glob.h>
 #include "uart.h"
 #include "pylontechapi.h"
+#include "pylbroker.h"
 //#define debug
 
 #define SCAN_MAX_DEVICES 32
 #define READ_INTERVAL_SECS 2
+#define DISCOVER_DEFAULT_PORTS "/dev/ttyU*"
+#define DISCOVER_MAX_RESULTS 64
+#define HISTORY_MINUTES 60
+#define HISTORY_MAX_MINUTES (UINT32_MAX / 60000)	// the window is passed in ms as uint32_t
 
 
 
@@ -160,6 +166,25 @@ void showChargeDischargeInfo(PYL_HandleT* pyl) {
 	}  else printf("failed to read charge discharge information from device %d, rc:%d\n",pyl->adr,res);
 }
 
+// the history is kept by the broker only (pylon2influx --socket --history)
+void showHistory(PYL_HandleT* pyl, int minutes) {
+	MODHIST_SummaryT sum;
+	int res;
+
+	if (!pyl->broker) { printf("the history is only available from pylon2influx --socket --history\n"); return; }
+	res = pylb_history(pyl, (uint32_t)minutes * 60000, &sum);
+	if (res != PYL_OK) { printf("failed to read the history of device %d, rc:%d\n",pyl->adr,res); return; }
+	if (sum.samples == 0) { printf("no samples of device %d in the last %d minutes\n",pyl->adr,minutes); return; }
+	printf("              samples: %u in %.1f minutes\n",sum.samples,(float)(sum.lastMs - sum.firstMs) / 60000);
+	printf("voltage min / avg / max: %.3f / %.3f / %.3f V\n",(float)sum.voltageMin/PYL_MODULE_VOLTAGE_DIVIDER,
+		(float)sum.voltageAvg/PYL_MODULE_VOLTAGE_DIVIDER,(float)sum.voltageMax/PYL_MODULE_VOLTAGE_DIVIDER);
+	printf("current min / avg / max: %.1f / %.1f / %.1f A\n",(float)sum.currentMin/PYL_MODULE_CURRENT_DIVIDER,
+		(float)sum.currentAvg/PYL_MODULE_CURRENT_DIVIDER,(float)sum.currentMax/PYL_MODULE_CURRENT_DIVIDER);
+	printf(" cell voltage min / max: %.3f / %.3f V\n",(float)sum.cellVoltageMin/PYL_CELL_VOLTAGE_DIVIDER,(float)sum.cellVoltageMax/PYL_CELL_VOLTAGE_DIVIDER);
+	printf("  temperature min / max: %d / %d C\n",sum.tempMin,sum.tempMax);
+	printf("   remaining first/last: %.3f / %.3f AH\n",(float)sum.remainingFirst/PYL_MODULE_CAPACITY_DIVIDER,(float)sum.remainingLast/PYL_MODULE_CAPACITY_DIVIDER);
+}
+
 void showSerialNumber(PYL_HandleT* pyl, int verb) {
 	int res;
 
@@ -200,10 +225,9 @@ int scan (PYL_HandleT* pyl, int scanVerbose) {
 
 
 void showSummary() {
-	int i,j,res;
-	PYL_ManufacturerInformationT mi;
+	int i,j,n;
+	PYL_ModuleDataT m[PYL_MAX_DEVICES_IN_GROUP];
 	PYL_AnalogDataT pd;
-	PYL_SerialNumberT sn;
 	float percentCharge;
 	int min,max;
 	int totalCapacity = 0;
@@ -217,15 +241,13 @@ void showSummary() {
 	printf(		"                                                    ---------pack--------- -cell voltage- -temperature-\n" \
 				"   manufacturer        model     serial             charge voltage current   min      max    min    max\n" \
 				"-------------------------------------------------------------------------------------------------------\n");
-	for (i=1;i<=pyl_numDevices(pyl);i++) {
-		pyl_setAdr(pyl,i);
-		pyl_getManufacturerInformation(pyl,&mi);
-		pyl_getSerialNumber(pyl,&sn);
-
-		printf("%2d %17s%s %18s ",i,mi.manufacturerName,mi.deviceName,sn.sn);
-		fflush(stdout);
-		res = pyl_getAnalogData(pyl,&pd);
-		if (res == PYL_OK) {
+	// manufacturer and serial number are not available on the console port, they stay empty
+	n = pyl_pollAll(pyl,PYL_POLL_ANALOG | PYL_POLL_MANUFACTURER | PYL_POLL_SERIAL,m,PYL_MAX_DEVICES_IN_GROUP);
+	for (i=0;i<n;i++) {
+		printf("%2d %17s%s %18s ",m[i].adr,m[i].mi.manufacturerName,m[i].mi.deviceName,m[i].sn.sn);
+		if (m[i].rc != PYL_OK) printf("no response (%d)\n",m[i].rc);
+		else {
+			pd = m[i].ad;
 			totalCapacity += pd.capacity;
 			remainingCapacity += pd.remainingCapacity;
 			totalCurrent += pd.current;
@@ -259,6 +281,30 @@ void showSummary() {
 }
 
 
+// probe all ports at once, ports from the command line or DISCOVER_DEFAULT_PORTS
+// prints one line per port and group with modules, returns 0 if at least one module was found
+int discover(char **ports, int numPorts, int group, int lockOwner) {
+	PYL_DiscoverResultT res[DISCOVER_MAX_RESULTS];
+	glob_t gl;
+	int i,numRes;
+
+	memset(&gl,0,sizeof(gl));
+	if (numPorts == 0) {
+		if (glob(DISCOVER_DEFAULT_PORTS,0,NULL,&gl) != 0) {
+			fprintf(stderr,"no serial ports found (%s)\n",DISCOVER_DEFAULT_PORTS);
+			return 2;
+		}
+		ports = gl.gl_pathv;
+		numPorts = gl.gl_pathc;
+	}
+	numRes = pyl_discover(ports,numPorts,1 << group,0,lockOwner,res,DISCOVER_MAX_RESULTS);
+	for (i=0;i<numRes;i++)
+		printf("%s group:%d devices:%d\n",res[i].portname,res[i].group,res[i].numDevices);
+	globfree(&gl);
+	return numRes ? 0 : 2;
+}
+
+
 void usage(void) {
         printf("Usage: pylontech [OPTION]...\n" \
         "  -h, --help         display help and exit\n" \
@@ -267,14 +313,20 @@ void usage(void) {
         "  -a, --adr          Pylontech device address (1-12)\n" \
         "  -g, --group        Pylontech group address (0-15)\n" \
         "  -s, --scan         Scan for devices at address 1 to 255\n" \
+        "  -D, --discover     probe all ports given as arguments (default %s) at once\n" \
+        "  -L, --lockowner    pid of the process that locked the ports for --discover\n" \
+        "  -C, --console      use the console port (pwr/bat commands) instead of RS485\n" \
         "  -y, --systemparam  Show system parameter\n" \
         "  -l, --alarm        Show alarm information\n" \
         "  -S, --serial       Show system serial number\n" \
         "  -P, --packdata     Show analog data\n" \
         "  -c, --charge       Show charge / discharge info\n" \
         "  -m, --manufact     Show manufacturer information\n" \
-        "  -v, --verbose[=x]  increase verbose level\n"
-        ,PYL_DEFPORTNAME,PYL_DEFBAUDRATE);
+        "  -H, --history[=m]  Show a summary of the last m minutes kept by the broker, default: %d\n" \
+        "  -v, --verbose[=x]  increase verbose level\n" \
+        "  -k, --socket       socket of the process owning the port, default: %s\n" \
+        "  -x, --direct       always open the serial port, even if a broker is running\n"
+        ,PYL_DEFPORTNAME,PYL_DEFBAUDRATE,DISCOVER_DEFAULT_PORTS,HISTORY_MINUTES,PYL_BROKER_SOCKET);
         exit (1);
 }
 
@@ -290,6 +342,11 @@ int main (int argc, char **argv) {
 	int adr = 1;
 	int group = 0;
 	char command = 0;
+	int console = 0;
+	char * socketPath = NULL;
+	int direct = 0;
+	int historyMinutes = HISTORY_MINUTES;
+	int lockOwner = 0;
 
 
 	//test();
@@ -301,6 +358,9 @@ int main (int argc, char **argv) {
                 {"device",      required_argument, 0, 'd'},
                 {"group",       required_argument, 0, 'g'},
                 {"scan",        no_argument,       0, 's'},
+                {"discover",    no_argument,       0, 'D'},
+                {"lockowner",   required_argument, 0, 'L'},
+                {"console",     no_argument,       0, 'C'},
                 {"systemparam", no_argument,       0, 'y'},
                 {"manufact",    no_argument,       0, 'm'},
                 {"serial",      no_argument,       0, 'S'},
@@ -310,11 +370,14 @@ int main (int argc, char **argv) {
                 {"verbose",     optional_argument, 0, 'v'},
                 {"baud",        required_argument, 0, 'b'},
                 {"adr",			required_argument, 0, 'a'},
+                {"socket",      required_argument, 0, 'k'},
+                {"direct",      no_argument,       0, 'x'},
+                {"history",     optional_argument, 0, 'H'},
 
                 {0, 0, 0, 0}
         };
 
-    while ((c = getopt_long (argc, argv, "hd:v::b:a:ymSPslcg:",long_options, &option_index)) != -1) {
+    while ((c = getopt_long (argc, argv, "hd:v::b:a:ymSPslcg:DL:Ck:xH::",long_options, &option_index)) != -1) {
         switch ((char)c) {
 			case 'v':
 				if (optarg) {
@@ -326,6 +389,15 @@ int main (int argc, char **argv) {
 				} else log_incVerboseLevel();
 				break;
             case 'h': usage(); break;
+            case 'C': console++; break;
+            case 'k': socketPath = strdup(optarg); break;
+            case 'x': direct++; break;
+			case 'L':
+				lockOwner = strtol (optarg,NULL,10);
+				if ((errno) || (lockOwner < 1)) {
+					fprintf(stderr,"Invalid lock owner pid\n"); usage();
+				}
+				break;
             case 'd': portname = strdup(optarg); break;
             case 'a':
 				adr = strtol (optarg,NULL,10);
@@ -346,7 +418,17 @@ int main (int argc, char **argv) {
 				}
 				break;
 			case '?': usage(); break;
+			case 'H':
+				if (optarg) {
+					historyMinutes = strtol (optarg,NULL,10);
+					if ((errno) || (historyMinutes < 1) || (historyMinutes > HISTORY_MAX_MINUTES)) {
+						fprintf(stderr,"Invalid number of minutes (1..%u)\n",HISTORY_MAX_MINUTES); usage();
+					}
+				}
+				command = (char)c;
+				break;
 			case 's':
+			case 'D':
 			case 'y':
 			case 'm':
 			case 'S':
@@ -356,15 +438,23 @@ int main (int argc, char **argv) {
 		}
 	}
 
-	if (portname == NULL) portname = strdup(PYL_DEFPORTNAME);
-
-
 	atexit(exit_handler);
 	signal(SIGTERM, sigterm_handler);
 
-	// init pylontech api
+	if (command == 'D') exit(discover(&argv[optind],argc-optind,group,lockOwner));
+
+	// init pylontech api, ask the process owning the port if there is one
 	pyl = pyl_initHandle();
-	res =  pyl_connect(pyl, group, portname);
+	res = -1;
+	if (!direct) {
+		res = pyl_connectBroker(pyl, socketPath ? socketPath : PYL_BROKER_SOCKET, portname, group);
+		if ((res < 0) && socketPath) { fprintf(stderr,"no broker at %s serving the port\n",socketPath); exit(1); }
+	}
+	if (portname == NULL) portname = strdup(PYL_DEFPORTNAME);
+	if (res < 0) {
+		if (console) res = pyl_connectConsole(pyl, portname);
+		else res =  pyl_connect(pyl, group, portname);
+	}
 	if (res < 0) { fprintf(stderr,"error opening serial port %s\n",portname); exit(1); }
 	if (res < 1) { fprintf(stderr,"no pylontech devices found\n"); exit(1); }
 
@@ -395,6 +485,9 @@ int main (int argc, char **argv) {
 		case 'c':
 			showChargeDischargeInfo(pyl);
 			break;
+		case 'H':
+			showHistory(pyl,historyMinutes);
+			break;
 		default:
 			showSummary();
 	}
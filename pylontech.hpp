@@ -0,0 +1,400 @@
+/*
+ * pylontech.hpp
+ *
+ * typed C++20 decoding of the RS485 responses, header only
+ *
+ * Usage:
+ *     auto r = pyl::analogData(pyl, group, adr);          // pyl is an initialized and connected PYL_HandleT*
+ *     if (r.ok()) {
+ *         printf("%7.3f V %6.1f A\n", r.value.voltage.value(), r.value.current.value());
+ *         for (pyl::MilliVolts u : r.value.cellVoltages()) printf(" %5.3f", u.value());
+ *     }
+ *
+ * Each response is described by field descriptors (byte offset, width, signedness, unit and scale),
+ * see the Layout of AnalogData, AlarmInfo, ChargeDischargeInfo and SystemParameter. Decoding is
+ * instantiated from the descriptors at compile time, there is no table interpreted at runtime.
+ * Values are fixed point quantities of a unit, e.g. MilliVolts or DeciCelsius, quantities of
+ * different units or scales can not be mixed up. Temperatures keep the 0.1 degree resolution
+ * of the module (the C structs are truncated to whole degrees).
+ *
+ * The requests are sent by pyl_getRawInfo of the C api (retries, port locking and reopening as
+ * for the pyl_get... functions). Not available on the console port or via the broker.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef PYLONTECH_HPP_INCLUDED
+#define PYLONTECH_HPP_INCLUDED
+
+#include <array>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include "pylontechapi.h"
+
+namespace pyl {
+
+template <typename T>
+struct Result {
+	int rc = PYL_ERR;
+	T value{};
+	bool ok() const { return rc == PYL_OK; }
+};
+
+// ---------------------------------------------------------------------------
+// quantities
+
+namespace unit {
+struct Volt; struct Ampere; struct AmpHour; struct Celsius; struct Number;
+}
+
+// raw / Divider in Unit, e.g. Quantity<unit::Volt, 1000> is mV
+template <typename Unit, int Divider = 1>
+class Quantity {
+public:
+	static constexpr int divider = Divider;
+
+	constexpr Quantity() = default;
+	constexpr explicit Quantity(int32_t raw) : raw_(raw) {}
+
+	constexpr int32_t raw() const { return raw_; }
+	constexpr double value() const { return double(raw_) / Divider; }
+
+	constexpr Quantity operator+(Quantity o) const { return Quantity(raw_ + o.raw_); }
+	constexpr Quantity operator-(Quantity o) const { return Quantity(raw_ - o.raw_); }
+	constexpr Quantity& operator+=(Quantity o) { raw_ += o.raw_; return *this; }
+	constexpr auto operator<=>(const Quantity&) const = default;
+
+private:
+	int32_t raw_ = 0;
+};
+
+using MilliVolts = Quantity<unit::Volt, PYL_CELL_VOLTAGE_DIVIDER>;
+using DeciAmperes = Quantity<unit::Ampere, PYL_MODULE_CURRENT_DIVIDER>;
+using MilliAmperes = Quantity<unit::Ampere, 1000>;
+using MilliAmpHours = Quantity<unit::AmpHour, PYL_MODULE_CAPACITY_DIVIDER>;
+using DeciCelsius = Quantity<unit::Celsius, 10>;
+using Number = Quantity<unit::Number>;
+
+static_assert(PYL_MODULE_VOLTAGE_DIVIDER == PYL_CELL_VOLTAGE_DIVIDER, "module and cell voltages share MilliVolts");
+
+// alarm info states
+enum class State : uint8_t { ok = 0, belowLimit = 1, aboveLimit = 2, other = 0xf0 };
+
+// ---------------------------------------------------------------------------
+// field descriptors
+
+namespace detail {
+
+constexpr int32_t nibble(char c) { return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10; }
+
+// Width is a constant, the loop is unrolled
+template <int Width>
+constexpr int32_t hex(const char *p) {
+	int32_t v = 0;
+	for (int i = 0; i < 2 * Width; i++) v = (v << 4) | nibble(p[i]);
+	return v;
+}
+
+} // namespace detail
+
+// one field of a response: Width bytes (2 hex ascii characters each) at byte Offset of the info, Offset -1
+// for fields following a variable length array (read in sequence). Signed fields are two's complement,
+// Bias is added to the raw value, e.g. -2731 for 0.1 K to 0.1 degree celsius
+template <typename T, int Width, int Offset = -1, bool Signed = false, int Bias = 0>
+struct Field {
+	using type = T;
+	static constexpr int width = Width;
+	static constexpr int offset = Offset;
+	static_assert(Width >= 1 && Width <= 3, "at most 3 bytes fit into a Quantity");
+
+	static constexpr T decode(const char *p) {
+		int32_t v = detail::hex<Width>(p);
+		if constexpr (Signed) {
+			if (v >= (int32_t(1) << (8 * Width - 1))) v -= int32_t(1) << (8 * Width);
+		}
+		return T(v + Bias);
+	}
+};
+
+// end of a fixed layout in bytes
+template <typename F>
+constexpr int fieldEnd = F::offset + F::width;
+
+// reads the fields of the info in sequence, fields with an Offset are read from there
+class Reader {
+public:
+	constexpr Reader(const char *info, int len) : begin_(info), pos_(info), end_(info + len) {}
+
+	template <typename F>
+	constexpr typename F::type get() {
+		const char *p = F::offset >= 0 ? begin_ + 2 * F::offset : pos_;
+		if (p + 2 * F::width > end_) { ok_ = false; return typename F::type{}; }
+		pos_ = p + 2 * F::width;
+		return F::decode(p);
+	}
+
+	// count fields, up to N are stored, returns the number stored
+	template <typename F, std::size_t N>
+	constexpr uint8_t getArray(int count, std::array<typename F::type, N>& dest) {
+		int i;
+		for (i = 0; i < count; i++) {
+			typename F::type v = get<F>();
+			if (i < (int)N) dest[i] = v;
+		}
+		return count < (int)N ? count : N;
+	}
+
+	constexpr bool ok() const { return ok_; }
+	constexpr bool more() const { return pos_ < end_; }
+
+private:
+	const char *begin_;
+	const char *pos_;
+	const char *end_;
+	bool ok_ = true;
+};
+
+// ---------------------------------------------------------------------------
+// responses
+
+struct AnalogData {
+	static constexpr int cmd = PYL_CMD_ANALOGDATA;
+
+	struct Layout {
+		using InfoFlag = Field<Number, 1, 0>;
+		using CommandValue = Field<Number, 1, 1>;
+		using CellsCount = Field<Number, 1, 2>;
+		using CellVoltage = Field<MilliVolts, 2>;					// CellsCount times
+		using TempCount = Field<Number, 1>;
+		using Temperature = Field<DeciCelsius, 2, -1, false, -2731>;	// TempCount times, the first is the BMS
+		using Current = Field<DeciAmperes, 2, -1, true>;
+		using Voltage = Field<MilliVolts, 2>;
+		using RemainingCapacity = Field<MilliAmpHours, 2>;
+		using UserDefinedItemCount = Field<Number, 1>;
+		using Capacity = Field<MilliAmpHours, 2>;
+		using CycleCount = Field<Number, 2>;
+		// larger batteries set both 2 byte capacities to 0xffff and append them with 3 bytes
+		using RemainingCapacity3 = Field<MilliAmpHours, 3>;
+		using Capacity3 = Field<MilliAmpHours, 3>;
+	};
+
+	Number commandValue;
+	DeciAmperes current;
+	MilliVolts voltage;
+	MilliAmpHours remainingCapacity;
+	MilliAmpHours capacity;
+	Number cycleCount;
+	uint8_t numCells = 0;
+	uint8_t numTemps = 0;
+	std::array<MilliVolts, CELLS_MAX> cells{};
+	std::array<DeciCelsius, TEMPS_MAX> temps{};
+
+	std::span<const MilliVolts> cellVoltages() const { return {cells.data(), numCells}; }
+	std::span<const DeciCelsius> temperatures() const { return {temps.data(), numTemps}; }
+
+	static constexpr bool decode(const char *info, int len, AnalogData& d) {
+		using L = Layout;
+		Reader r(info, len);
+
+		r.get<L::InfoFlag>();
+		d.commandValue = r.get<L::CommandValue>();
+		d.numCells = r.getArray<L::CellVoltage>(r.get<L::CellsCount>().raw(), d.cells);
+		d.numTemps = r.getArray<L::Temperature>(r.get<L::TempCount>().raw(), d.temps);
+		d.current = r.get<L::Current>();
+		d.voltage = r.get<L::Voltage>();
+		d.remainingCapacity = r.get<L::RemainingCapacity>();
+		r.get<L::UserDefinedItemCount>();
+		d.capacity = r.get<L::Capacity>();
+		d.cycleCount = r.get<L::CycleCount>();
+		if ((d.capacity.raw() == 0xffff) && (d.remainingCapacity.raw() == 0xffff)) {
+			d.remainingCapacity = r.get<L::RemainingCapacity3>();
+			d.capacity = r.get<L::Capacity3>();
+		}
+		return r.ok();
+	}
+};
+
+
+struct AlarmInfo {
+	static constexpr int cmd = PYL_CMD_ALARMINFO;
+
+	struct Layout {
+		using DataFlag = Field<Number, 1, 0>;
+		using CommandValue = Field<Number, 1, 1>;
+		using CellsCount = Field<Number, 1, 2>;
+		using CellVoltageState = Field<State, 1>;					// CellsCount times
+		using TempCount = Field<Number, 1>;
+		using TempState = Field<State, 1>;							// TempCount times
+		using ChargeCurrentState = Field<State, 1>;
+		using ModuleVoltageState = Field<State, 1>;
+		using DischargeCurrentState = Field<State, 1>;
+		using Status = Field<Number, 1>;							// 5 times
+	};
+
+	Number commandValue;
+	State chargeCurrent = State::ok;
+	State moduleVoltage = State::ok;
+	State dischargeCurrent = State::ok;
+	std::array<Number, 5> status{};
+	uint8_t numCells = 0;
+	uint8_t numTemps = 0;
+	std::array<State, CELLS_MAX> cells{};
+	std::array<State, TEMPS_MAX> temps{};
+
+	std::span<const State> cellVoltageStates() const { return {cells.data(), numCells}; }
+	std::span<const State> tempStates() const { return {temps.data(), numTemps}; }
+
+	static constexpr bool decode(const char *info, int len, AlarmInfo& a) {
+		using L = Layout;
+		Reader r(info, len);
+
+		r.get<L::DataFlag>();
+		a.commandValue = r.get<L::CommandValue>();
+		a.numCells = r.getArray<L::CellVoltageState>(r.get<L::CellsCount>().raw(), a.cells);
+		a.numTemps = r.getArray<L::TempState>(r.get<L::TempCount>().raw(), a.temps);
+		a.chargeCurrent = r.get<L::ChargeCurrentState>();
+		a.moduleVoltage = r.get<L::ModuleVoltageState>();
+		a.dischargeCurrent = r.get<L::DischargeCurrentState>();
+		r.getArray<L::Status>(5, a.status);
+		return r.ok();
+	}
+};
+
+
+struct ChargeDischargeInfo {
+	static constexpr int cmd = PYL_CMD_CHARGEDISCHARGEINFO;
+
+	struct Layout {
+		using CommandValue = Field<Number, 1, 0>;
+		using ChargeVoltageLimit = Field<MilliVolts, 2, 1>;
+		using DischargeVoltageLimit = Field<MilliVolts, 2, 3>;
+		using ChargeCurrentLimit = Field<DeciAmperes, 2, 5>;
+		using DischargeCurrentLimit = Field<MilliAmperes, 2, 7>;	// differs from documentation, see pylontech.c
+		using Status = Field<Number, 1, 9>;
+	};
+	static_assert(fieldEnd<Layout::Status> * 2 == 20, "expected info length");
+
+	Number commandValue;
+	MilliVolts chargeVoltageLimit;
+	MilliVolts dischargeVoltageLimit;
+	DeciAmperes chargeCurrentLimit;
+	MilliAmperes dischargeCurrentLimit;
+	Number status;
+
+	constexpr bool chargeEnabled() const { return status.raw() & 0x80; }
+	constexpr bool dischargeEnabled() const { return status.raw() & 0x40; }
+	constexpr bool chargeImmediately1() const { return status.raw() & 0x20; }
+	constexpr bool chargeImmediately2() const { return status.raw() & 0x10; }
+	constexpr bool fullChargeRequest() const { return status.raw() & 0x08; }
+
+	static constexpr bool decode(const char *info, int len, ChargeDischargeInfo& c) {
+		using L = Layout;
+		Reader r(info, len);
+
+		c.commandValue = r.get<L::CommandValue>();
+		c.chargeVoltageLimit = r.get<L::ChargeVoltageLimit>();
+		c.dischargeVoltageLimit = r.get<L::DischargeVoltageLimit>();
+		c.chargeCurrentLimit = r.get<L::ChargeCurrentLimit>();
+		c.dischargeCurrentLimit = r.get<L::DischargeCurrentLimit>();
+		c.status = r.get<L::Status>();
+		return r.ok();
+	}
+};
+
+
+struct SystemParameter {
+	static constexpr int cmd = PYL_CMD_SYSTEMPARAMETER;
+
+	struct Layout {
+		using InfoFlag = Field<Number, 1, 0>;
+		using CellHighVoltageLimit = Field<MilliVolts, 2, 1>;
+		using CellLowVoltageLimit = Field<MilliVolts, 2, 3>;
+		using CellUnderVoltageLimit = Field<MilliVolts, 2, 5>;
+		using ChargeHighTemperatureLimit = Field<DeciCelsius, 2, 7, false, -2731>;
+		using ChargeLowTemperatureLimit = Field<DeciCelsius, 2, 9, false, -2731>;
+		using ChargeCurrentLimit = Field<MilliAmperes, 2, 11>;
+		using ModuleHighVoltageLimit = Field<MilliVolts, 2, 13>;
+		using ModuleLowVoltageLimit = Field<MilliVolts, 2, 15>;
+		using ModuleUnderVoltageLimit = Field<MilliVolts, 2, 17>;
+		using DischargeHighTemperatureLimit = Field<DeciCelsius, 2, 19, false, -2731>;
+		using DischargeLowTemperatureLimit = Field<DeciCelsius, 2, 21, false, -2731>;
+		using DischargeCurrentLimit = Field<MilliAmperes, 2, 23>;
+	};
+	static_assert(fieldEnd<Layout::DischargeCurrentLimit> * 2 == 2 + 12 * 4, "expected info length");
+
+	MilliVolts cellHighVoltageLimit;
+	MilliVolts cellLowVoltageLimit;
+	MilliVolts cellUnderVoltageLimit;
+	DeciCelsius chargeHighTemperatureLimit;
+	DeciCelsius chargeLowTemperatureLimit;
+	MilliAmperes chargeCurrentLimit;
+	MilliVolts moduleHighVoltageLimit;
+	MilliVolts moduleLowVoltageLimit;
+	MilliVolts moduleUnderVoltageLimit;
+	DeciCelsius dischargeHighTemperatureLimit;
+	DeciCelsius dischargeLowTemperatureLimit;
+	MilliAmperes dischargeCurrentLimit;
+
+	static constexpr bool decode(const char *info, int len, SystemParameter& s) {
+		using L = Layout;
+		Reader r(info, len);
+
+		s.cellHighVoltageLimit = r.get<L::CellHighVoltageLimit>();
+		s.cellLowVoltageLimit = r.get<L::CellLowVoltageLimit>();
+		s.cellUnderVoltageLimit = r.get<L::CellUnderVoltageLimit>();
+		s.chargeHighTemperatureLimit = r.get<L::ChargeHighTemperatureLimit>();
+		s.chargeLowTemperatureLimit = r.get<L::ChargeLowTemperatureLimit>();
+		s.chargeCurrentLimit = r.get<L::ChargeCurrentLimit>();
+		s.moduleHighVoltageLimit = r.get<L::ModuleHighVoltageLimit>();
+		s.moduleLowVoltageLimit = r.get<L::ModuleLowVoltageLimit>();
+		s.moduleUnderVoltageLimit = r.get<L::ModuleUnderVoltageLimit>();
+		s.dischargeHighTemperatureLimit = r.get<L::DischargeHighTemperatureLimit>();
+		s.dischargeLowTemperatureLimit = r.get<L::DischargeLowTemperatureLimit>();
+		s.dischargeCurrentLimit = r.get<L::DischargeCurrentLimit>();
+		return r.ok();
+	}
+};
+
+// ---------------------------------------------------------------------------
+// requests
+
+// decode the info of a response (hex ascii, e.g. from pyl_getRawInfo or the non-blocking api)
+template <typename T>
+constexpr Result<T> decode(const char *info, int len) {
+	Result<T> r;
+	r.rc = T::decode(info, len, r.value) ? PYL_OK : PYL_ERR;
+	return r;
+}
+
+// query one module, the handle's group and adr are not changed
+template <typename T>
+Result<T> request(PYL_HandleT *pyl, int group, int adr) {
+	char info[PYL_RECEIVE_BUFSIZE];
+	int saveGroup = pyl->group, saveAdr = pyl->adr;
+	int len;
+
+	pyl_selectModule(pyl, group, adr);
+	len = pyl_getRawInfo(pyl, T::cmd, info, sizeof(info));
+	pyl_selectModule(pyl, saveGroup, saveAdr);
+	if (len < 0) return Result<T>{len};
+	return decode<T>(info, len);
+}
+
+inline Result<AnalogData> analogData(PYL_HandleT *pyl, int group, int adr) { return request<AnalogData>(pyl, group, adr); }
+inline Result<AlarmInfo> alarmInfo(PYL_HandleT *pyl, int group, int adr) { return request<AlarmInfo>(pyl, group, adr); }
+inline Result<ChargeDischargeInfo> chargeDischargeInfo(PYL_HandleT *pyl, int group, int adr) { return request<ChargeDischargeInfo>(pyl, group, adr); }
+inline Result<SystemParameter> systemParameter(PYL_HandleT *pyl, int group, int adr) { return request<SystemParameter>(pyl, group, adr); }
+
+} // namespace pyl
+
+#endif // PYLONTECH_HPP_INCLUDED
@@ -0,0 +1,554 @@
+/*
+ * pylontech_co.hpp
+ *
+ * C++20 coroutine layer for the non-blocking pylontech api, header only
+ *
+ * Usage:
+ *     pyl::Loop loop;
+ *     pyl::Port port(loop, pyl);            // pyl is an initialized and connected PYL_HandleT*
+ *
+ *     pyl::Task<int> readStack(pyl::Port& port) {
+ *         for (int adr = 1; adr <= pyl_numDevices(port.handle()); adr++) {
+ *             auto r = co_await port.analogData(adr);
+ *             if (r.ok()) printf("%d: %7.3f V\n", adr, (float)r.value.voltage / PYL_MODULE_VOLTAGE_DIVIDER);
+ *         }
+ *         co_return 0;
+ *     }
+ *     loop.run(readStack(port));
+ *
+ * Requests on one port are queued and run one after the other (the bus is half duplex),
+ * requests on different ports run concurrently on the same thread. Use pyl::whenAll to
+ * fan out over several ports. A request can be limited with .timeout(ms) and aborted via
+ * a pyl::CancelSource, pyl::Loop::sleep is an awaitable timer with the same options.
+ * Results are returned as pyl::Result<T> with rc set to PYL_OK, PYL_ERR, PYL_TIMEOUT or
+ * PYL_CANCELLED.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef PYLONTECH_CO_HPP_INCLUDED
+#define PYLONTECH_CO_HPP_INCLUDED
+
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <poll.h>
+#include "pylontechapi.h"
+#include "pylontech.hpp"
+#include "util.h"
+
+namespace pyl {
+
+// ---------------------------------------------------------------------------
+// Task<T>: lazily started coroutine, resumes the awaiting coroutine when done
+
+template <typename T> class Task;
+
+namespace detail {
+
+struct PromiseBase {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+			auto c = h.promise().continuation;
+			return c ? c : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+	std::optional<T> value;
+	Task<T> get_return_object();
+	void return_value(T v) { value = std::move(v); }
+	T result() {
+		if (exception) std::rethrow_exception(exception);
+		return std::move(*value);
+	}
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+	Task<void> get_return_object();
+	void return_void() {}
+	void result() {
+		if (exception) std::rethrow_exception(exception);
+	}
+};
+
+} // namespace detail
+
+template <typename T = void>
+class Task {
+public:
+	using promise_type = detail::Promise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	Task() = default;
+	explicit Task(handle_type h) : h_(h) {}
+	Task(Task&& o) noexcept : h_(std::exchange(o.h_, {})) {}
+	Task& operator=(Task&& o) noexcept {
+		if (this != &o) { if (h_) h_.destroy(); h_ = std::exchange(o.h_, {}); }
+		return *this;
+	}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task() { if (h_) h_.destroy(); }
+
+	bool done() const { return !h_ || h_.done(); }
+	// start a top level task, use co_await within coroutines
+	void start() { if (h_ && !h_.done()) h_.resume(); }
+	T result() { return h_.promise().result(); }
+
+	auto operator co_await() noexcept {
+		struct Awaiter {
+			handle_type h;
+			bool await_ready() noexcept { return !h || h.done(); }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+				h.promise().continuation = c;
+				return h;
+			}
+			T await_resume() { return h.promise().result(); }
+		};
+		return Awaiter{h_};
+	}
+
+private:
+	handle_type h_;
+};
+
+namespace detail {
+template <typename T>
+inline Task<T> Promise<T>::get_return_object() { return Task<T>{std::coroutine_handle<Promise<T>>::from_promise(*this)}; }
+inline Task<void> Promise<void>::get_return_object() { return Task<void>{std::coroutine_handle<Promise<void>>::from_promise(*this)}; }
+} // namespace detail
+
+// ---------------------------------------------------------------------------
+// cancellation
+
+class CancelSource;
+
+// something waiting that can be cancelled, implemented by requests and timers
+struct Cancellable {
+	CancelSource *source = nullptr;
+	virtual void cancelled() = 0;
+	virtual ~Cancellable() = default;
+};
+
+class CancelSource {
+public:
+	CancelSource() = default;
+	CancelSource(const CancelSource&) = delete;
+	CancelSource& operator=(const CancelSource&) = delete;
+	~CancelSource() { for (auto *w : waiters_) w->source = nullptr; }
+
+	// aborts all requests and timers registered with this source, they complete with PYL_CANCELLED
+	void cancel() {
+		cancelled_ = true;
+		auto w = std::move(waiters_);
+		waiters_.clear();
+		for (auto *c : w) { c->source = nullptr; c->cancelled(); }
+	}
+	bool isCancelled() const { return cancelled_; }
+	void reset() { cancelled_ = false; }
+
+	void add(Cancellable *c) { c->source = this; waiters_.push_back(c); }
+	void remove(Cancellable *c) {
+		waiters_.erase(std::remove(waiters_.begin(), waiters_.end(), c), waiters_.end());
+		c->source = nullptr;
+	}
+
+private:
+	bool cancelled_ = false;
+	std::vector<Cancellable*> waiters_;
+};
+
+// ---------------------------------------------------------------------------
+// event loop
+
+class Port;
+class Loop;
+
+namespace detail {
+
+// a request queued on or in flight on a port
+struct Op : Cancellable {
+	Port *port = nullptr;
+	int cmd = 0;
+	int group = -1;
+	int adr = 0;
+	void *dest = nullptr;
+	int rc = PYL_ERR;
+	uint64_t deadline = 0;			// 0 = no timeout besides the one of the transaction
+	bool active = false;
+	bool finished = false;
+	std::coroutine_handle<> waiter;
+	void cancelled() override;
+};
+
+struct Timer : Cancellable {
+	Loop *loop = nullptr;
+	uint64_t deadline = 0;
+	int rc = PYL_OK;
+	bool finished = false;
+	std::coroutine_handle<> waiter;
+	void cancelled() override;
+};
+
+} // namespace detail
+
+class Loop {
+public:
+	Loop() = default;
+	Loop(const Loop&) = delete;
+	Loop& operator=(const Loop&) = delete;
+
+	// run until the task is done and return its result
+	template <typename T>
+	T run(Task<T> task) {
+		task.start();
+		while (!task.done()) {
+			if (!step(-1)) break;
+		}
+		return task.result();
+	}
+
+	// process i/o and timers once, waits at most maxWaitMs (-1 = until something happens)
+	// returns 0 if there is nothing left to wait for
+	bool step(int maxWaitMs);
+
+	// awaitable timer
+	class Sleep {
+	public:
+		Sleep(Loop& loop, int ms) { t_.loop = &loop; t_.deadline = getMonotonicMs() + ms; }
+		Sleep&& cancel(CancelSource& cs) && { cs_ = &cs; return std::move(*this); }
+		bool await_ready() {
+			if (cs_ && cs_->isCancelled()) { t_.rc = PYL_CANCELLED; return true; }
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<> h) {
+			t_.waiter = h;
+			if (cs_) cs_->add(&t_);
+			t_.loop->timers_.push_back(&t_);
+		}
+		// PYL_OK if the time elapsed, PYL_CANCELLED if cancelled
+		int await_resume() {
+			if (t_.source) t_.source->remove(&t_);
+			return t_.rc;
+		}
+	private:
+		detail::Timer t_;
+		CancelSource *cs_ = nullptr;
+	};
+
+	Sleep sleep(int ms) { return Sleep(*this, ms); }
+
+private:
+	friend class Port;
+	friend struct detail::Op;
+	friend struct detail::Timer;
+
+	void addPort(Port *p) { ports_.push_back(p); }
+	void removePort(Port *p) { ports_.erase(std::remove(ports_.begin(), ports_.end(), p), ports_.end()); }
+	void removeTimer(detail::Timer *t) { timers_.erase(std::remove(timers_.begin(), timers_.end(), t), timers_.end()); }
+	void ready(std::coroutine_handle<> h) { ready_.push_back(h); }
+	void resumeReady() {
+		while (!ready_.empty()) {
+			auto h = ready_.front();
+			ready_.pop_front();
+			h.resume();
+		}
+	}
+
+	std::vector<Port*> ports_;
+	std::vector<detail::Timer*> timers_;
+	std::deque<std::coroutine_handle<>> ready_;
+};
+
+// ---------------------------------------------------------------------------
+// a serial port with a connected stack of modules, wraps a PYL_HandleT
+
+class Port {
+public:
+	Port(Loop& loop, PYL_HandleT *pyl) : loop_(loop), pyl_(pyl) { loop_.addPort(this); }
+	Port(const Port&) = delete;
+	Port& operator=(const Port&) = delete;
+	~Port() {
+		if (active_) pyl_asyncCancel(pyl_);
+		loop_.removePort(this);
+	}
+
+	PYL_HandleT *handle() const { return pyl_; }
+	Loop& loop() const { return loop_; }
+
+	template <typename T>
+	class Request {
+	public:
+		Request(Port& port, int cmd, int group, int adr) : port_(port) {
+			op_.port = &port; op_.cmd = cmd; op_.group = group; op_.adr = adr;
+			op_.dest = &result_.value;
+		}
+		Request(Request&& o) noexcept : port_(o.port_), op_(o.op_), timeoutMs_(o.timeoutMs_), cs_(o.cs_) {
+			op_.dest = &result_.value;
+		}
+		// limit the total time including the time waiting for the bus
+		Request&& timeout(int ms) && { timeoutMs_ = ms; return std::move(*this); }
+		Request&& cancel(CancelSource& cs) && { cs_ = &cs; return std::move(*this); }
+
+		bool await_ready() {
+			if (cs_ && cs_->isCancelled()) { op_.rc = PYL_CANCELLED; op_.finished = true; return true; }
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<> h) {
+			op_.waiter = h;
+			if (timeoutMs_ > 0) op_.deadline = getMonotonicMs() + timeoutMs_;
+			if (cs_) cs_->add(&op_);
+			port_.enqueue(&op_);
+		}
+		Result<T> await_resume() {
+			if (op_.source) op_.source->remove(&op_);
+			result_.rc = op_.rc;
+			return std::move(result_);
+		}
+	private:
+		Port& port_;
+		detail::Op op_;
+		Result<T> result_;
+		int timeoutMs_ = 0;
+		CancelSource *cs_ = nullptr;
+	};
+
+	// adr: first module is 1, group -1 = group of the handle
+	Request<PYL_AnalogDataT> analogData(int adr, int group = -1) { return {*this, PYL_CMD_ANALOGDATA, group, adr}; }
+	Request<PYL_AlarmInfoT> alarmInfo(int adr, int group = -1) { return {*this, PYL_CMD_ALARMINFO, group, adr}; }
+	Request<PYL_SystemParameterT> systemParameter(int adr, int group = -1) { return {*this, PYL_CMD_SYSTEMPARAMETER, group, adr}; }
+	Request<PYL_ManufacturerInformationT> manufacturerInformation(int adr, int group = -1) { return {*this, PYL_CMD_MANUFACTURERINFO, group, adr}; }
+	Request<PYL_ChargeDischargeInfoT> chargeDischargeInfo(int adr, int group = -1) { return {*this, PYL_CMD_CHARGEDISCHARGEINFO, group, adr}; }
+	Request<PYL_SerialNumberT> serialNumber(int adr, int group = -1) { return {*this, PYL_CMD_SERIALNUMBER, group, adr}; }
+	Request<int> protocolVersion(int adr, int group = -1) { return {*this, PYL_CMD_PROTOCOLVERSION, group, adr}; }
+
+private:
+	friend class Loop;
+	friend struct detail::Op;
+
+	void enqueue(detail::Op *op) {
+		queue_.push_back(op);
+		if (!active_) startNext();
+	}
+
+	// remove a queued or active op (timeout or cancel)
+	void abort(detail::Op *op, int rc) {
+		if (op->finished) return;
+		if (op == active_) {
+			pyl_asyncCancel(pyl_);
+			active_ = nullptr;
+		} else {
+			queue_.erase(std::remove(queue_.begin(), queue_.end(), op), queue_.end());
+		}
+		finish(op, rc);
+		if (!active_) startNext();
+	}
+
+	void finish(detail::Op *op, int rc) {
+		op->rc = rc;
+		op->finished = true;
+		loop_.ready(op->waiter);
+	}
+
+	void startNext() {
+		while (!active_ && !queue_.empty()) {
+			detail::Op *op = queue_.front();
+			queue_.pop_front();
+			int rc = pyl_asyncSend(pyl_, op->group, op->adr, op->cmd, 0);
+			if (rc != PYL_OK) { finish(op, rc); continue; }
+			op->active = true;
+			active_ = op;
+		}
+	}
+
+	// called by the loop when input is available or the transaction may have timed out
+	void poll() {
+		if (!active_) return;
+		int rc = pyl_asyncPoll(pyl_);
+		if (rc == PYL_PENDING) return;
+		detail::Op *op = active_;
+		active_ = nullptr;
+		if (rc == PYL_OK) rc = pyl_asyncDecode(pyl_, op->dest);
+		finish(op, rc);
+		startNext();
+	}
+
+	Loop& loop_;
+	PYL_HandleT *pyl_;
+	std::deque<detail::Op*> queue_;
+	detail::Op *active_ = nullptr;
+};
+
+inline void detail::Op::cancelled() { port->abort(this, PYL_CANCELLED); }
+
+inline void detail::Timer::cancelled() {
+	if (finished) return;
+	finished = true;
+	rc = PYL_CANCELLED;
+	loop->removeTimer(this);
+	loop->ready(waiter);
+}
+
+inline bool Loop::step(int maxWaitMs) {
+	std::vector<struct pollfd> fds;
+	std::vector<Port*> polled;
+	uint64_t now = getMonotonicMs();
+	int wait = maxWaitMs;
+	auto limit = [&wait](int64_t ms) {
+		if (ms < 0) ms = 0;
+		if (wait < 0 || ms < wait) wait = (int)ms;
+	};
+
+	resumeReady();
+
+	for (auto *p : ports_) {
+		if (!p->active_) continue;
+		struct pollfd pfd = { pyl_asyncFd(p->pyl_), POLLIN, 0 };
+		fds.push_back(pfd);
+		polled.push_back(p);
+		limit(pyl_asyncTimeout(p->pyl_));
+	}
+	for (auto *p : ports_) {
+		if (p->active_ && p->active_->deadline) limit((int64_t)p->active_->deadline - (int64_t)now);
+		for (auto *op : p->queue_) if (op->deadline) limit((int64_t)op->deadline - (int64_t)now);
+	}
+	for (auto *t : timers_) limit((int64_t)t->deadline - (int64_t)now);
+
+	if (fds.empty() && timers_.empty() && maxWaitMs < 0) {
+		bool queued = false;
+		for (auto *p : ports_) if (!p->queue_.empty()) queued = true;
+		if (!queued) return false;				// nothing to wait for
+	}
+
+	poll(fds.data(), fds.size(), wait);
+	now = getMonotonicMs();
+
+	for (size_t i = 0; i < fds.size(); i++) {
+		Port *p = polled[i];
+		if ((fds[i].revents & (POLLIN | POLLERR | POLLHUP)) || pyl_asyncTimeout(p->pyl_) == 0) p->poll();
+	}
+	// request timeouts
+	for (auto *p : ports_) {
+		std::vector<detail::Op*> expired;
+		if (p->active_ && p->active_->deadline && p->active_->deadline <= now) expired.push_back(p->active_);
+		for (auto *op : p->queue_) if (op->deadline && op->deadline <= now) expired.push_back(op);
+		for (auto *op : expired) p->abort(op, PYL_TIMEOUT);
+	}
+	// timers
+	auto timers = timers_;
+	for (auto *t : timers) {
+		if (t->deadline <= now) {
+			t->finished = true;
+			removeTimer(t);
+			ready(t->waiter);
+		}
+	}
+	resumeReady();
+	return true;
+}
+
+// ---------------------------------------------------------------------------
+// whenAll: run tasks concurrently, e.g. one per port, and wait for all of them
+
+namespace detail {
+
+struct WhenAllCounter {
+	size_t remaining;
+	std::coroutine_handle<> parent;
+	void done() { if (--remaining == 0 && parent) parent.resume(); }
+};
+
+// runs a child task and signals the counter
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+template <typename T>
+Detached runChild(Task<T>& task, std::optional<T>& out, WhenAllCounter& counter) {
+	out = co_await task;
+	counter.done();
+}
+
+inline Detached runChildVoid(Task<void>& task, WhenAllCounter& counter) {
+	co_await task;
+	counter.done();
+}
+
+struct WhenAllAwaiter {
+	WhenAllCounter& counter;
+	bool await_ready() { return counter.remaining == 0; }
+	void await_suspend(std::coroutine_handle<> h) { counter.parent = h; }
+	void await_resume() {}
+};
+
+} // namespace detail
+
+template <typename T>
+Task<std::vector<T>> whenAll(std::vector<Task<T>> tasks) {
+	std::vector<std::optional<T>> results(tasks.size());
+	detail::WhenAllCounter counter{tasks.size() + 1, {}};
+	for (size_t i = 0; i < tasks.size(); i++) detail::runChild(tasks[i], results[i], counter);
+	counter.remaining--;
+	co_await detail::WhenAllAwaiter{counter};
+	std::vector<T> out;
+	out.reserve(results.size());
+	for (auto& r : results) out.push_back(std::move(*r));
+	co_return out;
+}
+
+inline Task<void> whenAll(std::vector<Task<void>> tasks) {
+	detail::WhenAllCounter counter{tasks.size() + 1, {}};
+	for (auto& t : tasks) detail::runChildVoid(t, counter);
+	counter.remaining--;
+	co_await detail::WhenAllAwaiter{counter};
+}
+
+template <typename... T>
+Task<std::tuple<T...>> whenAll(Task<T>... tasks) {
+	std::tuple<std::optional<T>...> results;
+	detail::WhenAllCounter counter{sizeof...(T) + 1, {}};
+	[&]<size_t... I>(std::index_sequence<I...>) {
+		(detail::runChild(tasks, std::get<I>(results), counter), ...);
+	}(std::index_sequence_for<T...>{});
+	counter.remaining--;
+	co_await detail::WhenAllAwaiter{counter};
+	co_return std::apply([](auto&... r) { return std::tuple<T...>(std::move(*r)...); }, results);
+}
+
+} // namespace pyl
+
+#endif // PYLONTECH_CO_HPP_INCLUDED
@@ -33,9 +33,15 @@
 #include <termios.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
 #include "util.h"
 #include "uart.h"
 #include "pylontechapi.h"
+#include "pylonconsole.h"
+#include "pylbroker.h"
 #include "termios_helper.h"
 //#define debug
 
@@ -50,7 +56,6 @@
 #define CID2_TurnOff 0x95
 #define CID2_GetFirmwareInfo 0x96
 
-extern int verbose;
 
 const char * emptyString = "";
 
@@ -220,8 +225,7 @@ char * packetPrepareData (packetDataT *pa) {
 }
 
 
-// this is the maximum possible length plus a 0 byte
-#define RECEIVE_BUFSIZE 24+4096+1
+#define RECEIVE_BUFSIZE PYL_RECEIVE_BUFSIZE
 // min len incl. length field
 #define PKT_LEN_MIN (1+(6*2))
 
@@ -231,11 +235,39 @@ char * packetPrepareData (packetDataT *pa) {
 #define UART_READ(PYL,...) uart_read_bytes(PYL->serFd,&PYL->ti, __VA_ARGS__)
 #endif // USE_SELECT
 
+// convert a received frame (starting with SOI, checksums already verified) from hex ascii
+packetDataT * packetFromBuf (char *buf, int infoLen) {
+	packetDataT *pa;
+	char *p = buf;
+
+	p++;			// SOI
+	pa = packetAllocate(NULL,0,0);
+	if (!pa) return pa;
+	pa->ver  = hex2int(p,1); p+=2;
+	pa->adr  = hex2int(p,1); p+=2;
+	pa->cid1 = hex2int(p,1); p+=2;
+	pa->cid2 = hex2int(p,1); p+=2;
+
+	// set the the info part
+	if (infoLen >0 ) {
+		p+=4;								// skip length, is now @ info
+		pa->info = calloc(1,infoLen+1);
+		memcpy(pa->info,p,infoLen);
+	}
+	VPRINTF(3,"packetReceive: received packet, rtn: 0x%02x %s\n",pa->cid2,cid2ResponseTxt(pa->cid2));
+	if (log_getVerboseLevel() > 2) {
+		printf ("received packet -> ");
+		dumpPacket(pa);
+	}
+	pa->readPtr = pa->info;
+	return pa;
+}
+
+
 packetDataT * packetReceive (PYL_HandleT* pyl) {
 	char buf[RECEIVE_BUFSIZE];
 	char *p = &buf[0];
 	int res2, res,length,chk,chkExpected,len,infoLen;
-	packetDataT *pa;
 	char EOI_buf[4];
 	int maxInvalidSOI = 10;
 
@@ -309,7 +341,7 @@ packetDataT * packetReceive (PYL_HandleT* pyl) {
 	p = strend(buf)-1-4;							// extract the
 	chk = hex2int(p,2);								// received checksum
 	VPRINTF(3,"packetReceive: chk is: 0x0%x, chkExpected: 0x0%x, packet: '",chk,chkExpected);
-	if (verbose >= 2) {
+	if (log_getVerboseLevel() >= 2) {
 			dumpBuffer(buf,strlen(buf)); printf("' '");
 			dumpBuffer(p,strlen(p)); printf("'\n");
 	}
@@ -320,28 +352,7 @@ packetDataT * packetReceive (PYL_HandleT* pyl) {
 		return NULL;
 	}
 
-	// we got it and the checksums are ok, convert from hex ascii
-	p = buf;
-	p++;			// SOI
-	pa = packetAllocate(NULL,0,0);
-	pa->ver  = hex2int(p,1); p+=2;
-	pa->adr  = hex2int(p,1); p+=2;
-	pa->cid1 = hex2int(p,1); p+=2;
-	pa->cid2 = hex2int(p,1); p+=2;
-
-	// set the the info part
-	if (infoLen >0 ) {
-		p+=4;								// skip length, is now @ info
-		pa->info = calloc(1,infoLen+1);
-		memcpy(pa->info,p,infoLen);
-	}
-	VPRINTF(3,"packetReceive: received packet, rtn: 0x%02x %s\n",pa->cid2,cid2ResponseTxt(pa->cid2));
-	if (verbose > 2) {
-		printf ("received packet -> ");
-		dumpPacket(pa);
-	}
-	pa->readPtr = pa->info;
-	return pa;
+	return packetFromBuf(buf,infoLen);
 }
 
 int paInfoGetInt(packetDataT *pa, int byteCount) {
@@ -382,43 +393,39 @@ int packetSend (PYL_HandleT* pyl, packetDataT * pa) {
 		uart_flush(pyl->serFd);
 		return PYL_ERR;
 	}
-	if (verbose > 2) {
+	if (log_getVerboseLevel() > 2) {
 		printf ("sent packet -> ");
 		dumpPacket(pa);
 	}
+	free(packetStr);
 	free(pa);									// not needed any longer
 	return PYL_OK;
 }
 
 
 #define TERMIOS_BUFLEN 512
-packetDataT * sendCommandAndReceive2 (
-				PYL_HandleT* pyl,
-				int CID2,
-				char * dataHexAscii,
-				int expectedInfoLength) {
-
-	int res;
-	int infoLen = 0;
-	packetDataT * pa = packetAllocate(pyl, LI_BAT_DATA, CID2);
+// on my Cerbos GX some program / service is accessing the serial port even if there is a lock file present
+// check if we have the correct serial settings, this is done periodically and after communication errors
+// as we have locked the port in pyl_openSerialPort
+void checkTermios (PYL_HandleT* pyl) {
+	struct termios ti;
 	char *p;
+	uint64_t now = getMonotonicMs();
 
-	if (pyl == NULL) return NULL;
-	if (!pa) return NULL;
-	if (pyl->serFd <= 0) return NULL;
-	pa->info = dataHexAscii;
+	if (!pyl->termiosCheckNeeded && now < pyl->termiosCheckTime) return;
+	pyl->termiosCheckNeeded = 0;
+	pyl->termiosCheckTime = now + PYL_TERMIOS_CHECK_INTERVAL_MS;
+	pyl->stats.termiosChecks++;
 
-	// on my Cerbos GX some program / service is accessing the serial port even if there is a lock file present
-	// check if we have the correct serial settings
-	struct termios ti;
 	tcgetattr(pyl->serFd,&ti); 					// get current port settings
 	if ( (ti.c_cflag!=pyl->ti.c_cflag) ||		// flags different than expected ?
 		 (ti.c_iflag!=pyl->ti.c_iflag) ||
 		 (ti.c_oflag!=pyl->ti.c_oflag) ) {
+		pyl->stats.termiosAltered++;
 		p = malloc(TERMIOS_BUFLEN);
 		if (p) {
 			decode_termios (&ti, p, TERMIOS_BUFLEN);
-			LOG(0,"Settings for %s altered externally\n",pyl->portname);
+			LOG(0,"Settings for %s altered externally (%d times)\n",pyl->portname,pyl->stats.termiosAltered);
 			LOG(0,"Current settings: %s\n",p);
 			decode_termios (&pyl->ti, p, TERMIOS_BUFLEN);
 			LOG(0,"Resetting to expected settings: %s\n",p);
@@ -426,20 +433,46 @@ packetDataT * sendCommandAndReceive2 (
 		free(p);
 		tcsetattr(pyl->serFd,TCSANOW,&pyl->ti);
 	}
+}
+
+// count the error and verify the serial settings before the next command
+void commError (PYL_HandleT* pyl) {
+	pyl->stats.commErrors++;
+	pyl->termiosCheckNeeded = 1;
+}
+
+
+packetDataT * sendCommandAndReceive2 (
+				PYL_HandleT* pyl,
+				int CID2,
+				char * dataHexAscii,
+				int expectedInfoLength) {
+
+	int res;
+	int infoLen = 0;
+	packetDataT * pa = packetAllocate(pyl, LI_BAT_DATA, CID2);
+
+	if (pyl == NULL) return NULL;
+	if (!pa) return NULL;
+	if (pyl->serFd <= 0) return NULL;
+	pa->info = dataHexAscii;
+
+	checkTermios(pyl);
 	res = packetSend (pyl,pa);
 	if (res != 0) {
 		LOG(0,"%s: packet send failed, res: %d\n",commandName(CID2),res);
-		packetFree(pa);
+		free(pa);								// info is the caller's buffer
 		return NULL;
 	}
 	pa = packetReceive (pyl);
 	if (! pa) {
-		packetFree(pa);
+		commError(pyl);
 		return NULL;
 	}
 
 	if (pa->cid2 != 0) {		// 0 means ok otherwise error code
 		LOG(0,"%s: received error code 0x%02x (%s)\n",commandName(CID2),pa->cid2,cid2ResponseTxt (pa->cid2));
+		commError(pyl);
 		packetFree(pa);
 		return NULL;
 	}
@@ -448,6 +481,7 @@ packetDataT * sendCommandAndReceive2 (
 		if (pa->info) infoLen = strlen(pa->info);
 		if (expectedInfoLength > infoLen) {
 			LOG(0,"%s: expected to receive %d bytes of data but got only %d bytes\n",commandName(CID2),expectedInfoLength,infoLen);
+			commError(pyl);
 			packetFree(pa);
 			return NULL;
 		}
@@ -468,6 +502,10 @@ packetDataT * sendCommandAndReceive (
 	int rc;
 	int retry = RETRY_COUNT;
 
+	if (pyl->console) {
+		LOG(1,"%s is not available on the console port\n",commandName(CID2));
+		return NULL;
+	}
 	while (retry) {
 		retry--;
 		pd = sendCommandAndReceive2 (pyl,CID2,dataHexAscii,expectedInfoLength);
@@ -508,6 +546,8 @@ int pyl_getProtocolVersion (PYL_HandleT* pyl) {
 	exit (1);
 */
 //	pyl->protocolVersion = 0x21; // test for jk-bms
+	if (pyl->broker) return pylb_request(pyl,PYL_CMD_PROTOCOLVERSION,NULL,0);
+	if (pyl->console) return pylc_packPresent(pyl) ? PYL_OK : PYL_ERR;
 	packetDataT * pa = sendCommandAndReceive (pyl,CID2_GetCommunicationProtocolVersion, NULL, 0);
 	if (!pa) return PYL_ERR;
 
@@ -518,15 +558,10 @@ int pyl_getProtocolVersion (PYL_HandleT* pyl) {
 }
 
 
-int pyl_getAnalogData (PYL_HandleT* pyl, PYL_AnalogDataT *pd) {
-	char info[10];
+void decodeAnalogData (packetDataT *pa, PYL_AnalogDataT *pd) {
 	int i;
 
 	memset(pd,0,sizeof(*pd));
-	sprintf(info,"%02x",pyl->adr+1);
-	packetDataT * pa = sendCommandAndReceive (pyl,CID2_GetAnalogValue, info, 122);
-	if (!pa) return PYL_ERR;
-
 	pd->infoflag = paInfoGetInt(pa,1);
 	pd->commandValue = paInfoGetInt(pa,1);
 
@@ -560,19 +595,30 @@ int pyl_getAnalogData (PYL_HandleT* pyl, PYL_AnalogDataT *pd) {
 		pd->remainingCapacity = paInfoGetInt(pa,3);
 		pd->capacity = paInfoGetInt(pa,3);
 	}
+}
+
+
+int pyl_getAnalogData (PYL_HandleT* pyl, PYL_AnalogDataT *pd) {
+	char info[10];
 
+	if (pyl->broker) return pylb_request(pyl,PYL_CMD_ANALOGDATA,pd,sizeof(*pd));
+	if (pyl->console) return pylc_getAnalogData(pyl,pd);
+
+	memset(pd,0,sizeof(*pd));
+	sprintf(info,"%02x",pyl->adr+1);
+	packetDataT * pa = sendCommandAndReceive (pyl,CID2_GetAnalogValue, info, 122);
+	if (!pa) return PYL_ERR;
+
+	decodeAnalogData(pa,pd);
 	packetFree(pa);
 	return PYL_OK;
 }
 
 
 
-int pyl_getSystemParameter (PYL_HandleT* pyl, PYL_SystemParameterT *sp) {
+void decodeSystemParameter (packetDataT *pa, PYL_SystemParameterT *sp) {
 	int len;
 
-	packetDataT * pa = sendCommandAndReceive (pyl,CID2_GetSystemParameter, NULL, 2+(12*4));
-	if (!pa) return PYL_ERR;
-
 	len = 0;
 	if (pa->info) len = strlen(pa->info);
 	VPRINTF(2,"getSystemParameter: got response, data len: %d\n",len);
@@ -591,17 +637,24 @@ int pyl_getSystemParameter (PYL_HandleT* pyl, PYL_SystemParameterT *sp) {
 		sp->dischargeLowTemperatureLimit = (paInfoGetInt(pa,2)-2731)/10;
 		sp->dischargeCurrentLimit = paInfoGetInt(pa,2);
 	}
+}
+
+
+int pyl_getSystemParameter (PYL_HandleT* pyl, PYL_SystemParameterT *sp) {
+	if (pyl->broker) return pylb_request(pyl,PYL_CMD_SYSTEMPARAMETER,sp,sizeof(*sp));
+	packetDataT * pa = sendCommandAndReceive (pyl,CID2_GetSystemParameter, NULL, 2+(12*4));
+	if (!pa) return PYL_ERR;
+
+	decodeSystemParameter(pa,sp);
 	packetFree(pa);
 	return PYL_OK;
 }
 
 
-int pyl_getManufacturerInformation (PYL_HandleT* pyl, PYL_ManufacturerInformationT *mi) {
+void decodeManufacturerInformation (packetDataT *pa, PYL_ManufacturerInformationT *mi) {
 	int len;
-	packetDataT * pa = sendCommandAndReceive (pyl,CID2_GetManufacturerInformation, NULL, (10+2+20)*2);
-	memset(mi,0,sizeof(*mi));
-	if (!pa) return PYL_ERR;
 
+	memset(mi,0,sizeof(*mi));
 	len = 0;
 	if (pa->info) len = strlen(pa->info);
 	VPRINTF(2,"getManufacturerInformation: got response, data len: %d\n",len);
@@ -611,21 +664,24 @@ int pyl_getManufacturerInformation (PYL_HandleT* pyl, PYL_ManufacturerInformatio
 		mi->softwareVersion[1] = paInfoGetInt(pa,1);
 		paInfoGetString(mi->manufacturerName,pa,20);
 	}
-	packetFree(pa);
-	return PYL_OK;
 }
 
 
+int pyl_getManufacturerInformation (PYL_HandleT* pyl, PYL_ManufacturerInformationT *mi) {
+	if (pyl->broker) return pylb_request(pyl,PYL_CMD_MANUFACTURERINFO,mi,sizeof(*mi));
+	packetDataT * pa = sendCommandAndReceive (pyl,CID2_GetManufacturerInformation, NULL, (10+2+20)*2);
+	memset(mi,0,sizeof(*mi));
+	if (!pa) return PYL_ERR;
 
-int pyl_getSerialNumber (PYL_HandleT* pyl, PYL_SerialNumberT *mi) {
-	int len;
-	char info[10];
+	decodeManufacturerInformation(pa,mi);
+	packetFree(pa);
+	return PYL_OK;
+}
 
-	sprintf(info,"%02x",pyl->adr+1);
 
-	packetDataT * pa = sendCommandAndReceive (pyl,CID2_GetSerialNumberOfEquipment, info, 17*2);
-	if (!pa) return PYL_ERR;
 
+void decodeSerialNumber (packetDataT *pa, PYL_SerialNumberT *mi) {
+	int len;
 	char * p;
 
 	len = 0;
@@ -637,20 +693,28 @@ int pyl_getSerialNumber (PYL_HandleT* pyl, PYL_SerialNumberT *mi) {
 		p+=2;  // looks like addr
 		getStringFromHex(p, mi->sn, 16);
 	}
-	packetFree(pa);
-	return PYL_OK;
 }
 
 
-int pyl_getAlarmInfo (PYL_HandleT* pyl, PYL_AlarmInfoT *ai) {
+int pyl_getSerialNumber (PYL_HandleT* pyl, PYL_SerialNumberT *mi) {
 	char info[10];
-	int i;
 
-	memset(ai,0,sizeof(*ai));
+	if (pyl->broker) return pylb_request(pyl,PYL_CMD_SERIALNUMBER,mi,sizeof(*mi));
 	sprintf(info,"%02x",pyl->adr+1);
-	packetDataT * pa = sendCommandAndReceive (pyl, CID2_GetAlarmData, info, 66);
+
+	packetDataT * pa = sendCommandAndReceive (pyl,CID2_GetSerialNumberOfEquipment, info, 17*2);
 	if (!pa) return PYL_ERR;
 
+	decodeSerialNumber(pa,mi);
+	packetFree(pa);
+	return PYL_OK;
+}
+
+
+void decodeAlarmInfo (packetDataT *pa, PYL_AlarmInfoT *ai) {
+	int i;
+
+	memset(ai,0,sizeof(*ai));
 	ai->dataFlag = paInfoGetInt(pa,1);
 	ai->commandValue = paInfoGetInt(pa,1);
 
@@ -670,32 +734,413 @@ int pyl_getAlarmInfo (PYL_HandleT* pyl, PYL_AlarmInfoT *ai) {
 	ai->moduleVoltageStat = paInfoGetInt(pa,1);
 	ai->dischargeCurrentStat = paInfoGetInt(pa,1);
 	for (i=0;i<5;i++) ai->status[i] = paInfoGetInt(pa,1);
-
-	packetFree(pa);
-	return PYL_OK;
 }
 
 
-int pyl_getChargeDischargeInfo (PYL_HandleT* pyl, PYL_ChargeDischargeInfoT *cd) {
+int pyl_getAlarmInfo (PYL_HandleT* pyl, PYL_AlarmInfoT *ai) {
 	char info[10];
 
-	memset(cd,0,sizeof(*cd));
+	if (pyl->broker) return pylb_request(pyl,PYL_CMD_ALARMINFO,ai,sizeof(*ai));
+	if (pyl->console) return pylc_getAlarmInfo(pyl,ai);
+
+	memset(ai,0,sizeof(*ai));
 	sprintf(info,"%02x",pyl->adr+1);
-	packetDataT * pa = sendCommandAndReceive (pyl, CID2_GetChargeDischargeManagementInformation, info, 20);
+	packetDataT * pa = sendCommandAndReceive (pyl, CID2_GetAlarmData, info, 66);
 	if (!pa) return PYL_ERR;
 
+	decodeAlarmInfo(pa,ai);
+	packetFree(pa);
+	return PYL_OK;
+}
+
+
+void decodeChargeDischargeInfo (packetDataT *pa, PYL_ChargeDischargeInfoT *cd) {
+	memset(cd,0,sizeof(*cd));
 	cd->commandValue = paInfoGetInt(pa,1);
 	cd->chargeVoltageLimit = paInfoGetInt(pa,2);
 	cd->dischargeVoltageLimit = paInfoGetInt(pa,2);
 	cd->chargeCurrentLimit = paInfoGetInt(pa,2);
 	cd->dischargeCurrentLimit = paInfoGetInt(pa,2);
 	cd->chargeDischargeStatus = paInfoGetInt(pa,1);
+}
+
+
+int pyl_getChargeDischargeInfo (PYL_HandleT* pyl, PYL_ChargeDischargeInfoT *cd) {
+	char info[10];
+
+	if (pyl->broker) return pylb_request(pyl,PYL_CMD_CHARGEDISCHARGEINFO,cd,sizeof(*cd));
+	memset(cd,0,sizeof(*cd));
+	sprintf(info,"%02x",pyl->adr+1);
+	packetDataT * pa = sendCommandAndReceive (pyl, CID2_GetChargeDischargeManagementInformation, info, 20);
+	if (!pa) return PYL_ERR;
+
+	decodeChargeDischargeInfo(pa,cd);
+	packetFree(pa);
+	return PYL_OK;
+}
+
+
+// expected info length of the response, 0 = not checked
+int asyncExpectedInfoLength (int cmd) {
+	switch (cmd) {
+		case CID2_GetAnalogValue							: return 122;
+		case CID2_GetAlarmData								: return 66;
+		case CID2_GetSystemParameter						: return 2+(12*4);
+		case CID2_GetManufacturerInformation				: return (10+2+20)*2;
+		case CID2_GetChargeDischargeManagementInformation	: return 20;
+		case CID2_GetSerialNumberOfEquipment				: return 17*2;
+	}
+	return 0;
+}
+
+// 1 if the module address has to be sent as info
+int asyncNeedsAdrInfo (int cmd) {
+	switch (cmd) {
+		case CID2_GetAnalogValue:
+		case CID2_GetAlarmData:
+		case CID2_GetChargeDischargeManagementInformation:
+		case CID2_GetSerialNumberOfEquipment:
+			return 1;
+	}
+	return 0;
+}
 
+
+int pyl_getRawInfo (PYL_HandleT* pyl, int cmd, char *info, int size) {
+	char adrInfo[10];
+	packetDataT * pa;
+	int len = 0;
+
+	if (!pyl || pyl->broker || !info || (size < 1)) return PYL_ERR;
+	sprintf(adrInfo,"%02x",pyl->adr+1);
+	pa = sendCommandAndReceive (pyl, cmd, asyncNeedsAdrInfo(cmd) ? adrInfo : NULL, asyncExpectedInfoLength(cmd));
+	if (!pa) return PYL_ERR;
+	if (pa->info) len = strlen(pa->info);
+	if (len >= size) len = size-1;
+	memcpy(info,pa->info,len);
+	info[len] = 0;
 	packetFree(pa);
+	return len;
+}
+
+
+int pyl_asyncSend (PYL_HandleT* pyl, int group, int adr, int cmd, int timeoutMs) {
+	char info[10];
+	packetDataT * pa;
+	PYL_AsyncT *as;
+	int res;
+
+	if (!pyl || pyl->console || pyl->broker) return PYL_ERR;
+	as = &pyl->async;
+	if (as->state == PYL_PENDING) pyl_asyncCancel(pyl);
+	if (pyl->serFd <= 0) return PYL_ERR;
+	if (group < 0) group = pyl->group;
+
+	pa = packetAllocate(pyl, LI_BAT_DATA, cmd);
+	if (!pa) return PYL_ERR;
+	pa->adr = (group << 4) + adr+1;
+	if (asyncNeedsAdrInfo(cmd)) {
+		sprintf(info,"%02x",adr+1);
+		pa->info = info;
+	}
+
+	as->cmd = cmd;
+	as->group = group;
+	as->adr = adr;
+	as->rxLen = 0;
+	as->info = NULL;
+	as->deadline = getMonotonicMs() + (timeoutMs > 0 ? timeoutMs : PYL_ASYNC_TIMEOUT_MS);
+
+	checkTermios(pyl);
+	res = packetSend (pyl,pa);					// frees pa if sent
+	if (res != PYL_OK) {
+		LOG(0,"%s: packet send failed, res: %d\n",commandName(cmd),res);
+		free(pa);
+		as->state = PYL_ERR;
+		return PYL_ERR;
+	}
+	as->state = PYL_PENDING;
 	return PYL_OK;
 }
 
 
+// verify the frame in rxBuf, ends at eoi
+int asyncCheckFrame (PYL_HandleT* pyl, char *eoi) {
+	PYL_AsyncT *as = &pyl->async;
+	int length,chk,chkExpected,infoLen,frameLen,expectedInfoLength,rtn;
+
+	frameLen = eoi - as->rxBuf + 1;
+	if (frameLen < PKT_LEN_MIN+4+1) {
+		LOG(0,"%s: received frame too short (%d bytes)\n",commandName(as->cmd),frameLen);
+		return PYL_ERR;
+	}
+	length = hex2int(as->rxBuf+PKT_LEN_MIN-4,2);
+	chkExpected = calc_lchecksum (length);
+	chk = (((length & 0x0f000) >> 12) & 0x0f);
+	if (chk != chkExpected) {
+		LOG(0,"%s: invalid checksum in length field, got 0x0%x, expected 0x0%x\n",commandName(as->cmd),chk,chkExpected);
+		return PYL_ERR;
+	}
+	infoLen = (length & 0x0fff);
+	if (frameLen != PKT_LEN_MIN+infoLen+4+1) {
+		LOG(0,"%s: got %d bytes but expected %d bytes\n",commandName(as->cmd),frameLen,PKT_LEN_MIN+infoLen+4+1);
+		return PYL_ERR;
+	}
+	chkExpected = calc_checksum(as->rxBuf+1,frameLen-1-4-1);	// without SOI, CHKSUM and EOI
+	chk = hex2int(eoi-4,2);
+	if (chk != chkExpected) {
+		LOG(0,"%s: invalid checksum, got 0x0%x, expected 0x0%x\n",commandName(as->cmd),chk,chkExpected);
+		return PYL_ERR;
+	}
+	rtn = hex2int(as->rxBuf+7,1);
+	if (rtn != 0) {		// 0 means ok otherwise error code
+		LOG(0,"%s: received error code 0x%02x (%s)\n",commandName(as->cmd),rtn,cid2ResponseTxt (rtn));
+		return PYL_ERR;
+	}
+	expectedInfoLength = asyncExpectedInfoLength(as->cmd);
+	if (expectedInfoLength > infoLen) {
+		LOG(0,"%s: expected to receive %d bytes of data but got only %d bytes\n",commandName(as->cmd),expectedInfoLength,infoLen);
+		return PYL_ERR;
+	}
+	*(eoi-4) = 0;				// terminate info, overwrites the already verified checksum
+	if (infoLen) as->info = as->rxBuf+PKT_LEN_MIN;
+	return PYL_OK;
+}
+
+
+int pyl_asyncPoll (PYL_HandleT* pyl) {
+	PYL_AsyncT *as;
+	char *soi, *eoi;
+	int res;
+
+	if (!pyl) return PYL_ERR;
+	as = &pyl->async;
+	if (as->state != PYL_PENDING) return as->state;
+
+	// the port is opened with O_NONBLOCK, read whatever is available
+	while (as->rxLen < RECEIVE_BUFSIZE-1) {
+		res = read(pyl->serFd, as->rxBuf+as->rxLen, RECEIVE_BUFSIZE-1-as->rxLen);
+		if (res > 0) {
+			as->rxLen += res;
+		} else {
+			if ((res < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+				LOG(0,"%s: read from %s failed (%s)\n",commandName(as->cmd),pyl->portname,strerror(errno));
+				as->state = PYL_ERR;
+				return as->state;
+			}
+			break;
+		}
+	}
+
+	// discard anything before SOI
+	soi = memchr(as->rxBuf,0x7e,as->rxLen);
+	if (!soi) as->rxLen = 0;
+	else if (soi != as->rxBuf) {
+		as->rxLen -= soi - as->rxBuf;
+		memmove(as->rxBuf,soi,as->rxLen);
+	}
+
+	eoi = memchr(as->rxBuf,0x0d,as->rxLen);
+	if (eoi) {
+		as->state = asyncCheckFrame(pyl,eoi);
+		if (as->state != PYL_OK) {
+			uart_flush(pyl->serFd);
+			commError(pyl);
+		}
+		return as->state;
+	}
+	if (as->rxLen >= RECEIVE_BUFSIZE-1) {
+		LOG(0,"%s: no EOI received\n",commandName(as->cmd));
+		uart_flush(pyl->serFd);
+		commError(pyl);
+		as->state = PYL_ERR;
+		return as->state;
+	}
+	if (getMonotonicMs() >= as->deadline) {
+		VPRINTF(1,"%s: timeout waiting for response from group %d, adr %d\n",commandName(as->cmd),as->group,as->adr);
+		uart_flush(pyl->serFd);
+		// a missing module times out as well, only count it if we had received something
+		if (as->rxLen) commError(pyl);
+		as->state = PYL_TIMEOUT;
+	}
+	return as->state;
+}
+
+
+int pyl_asyncDecode (PYL_HandleT* pyl, void *dest) {
+	PYL_AsyncT *as;
+	packetDataT pa;
+
+	if (!pyl) return PYL_ERR;
+	as = &pyl->async;
+	if (as->state != PYL_OK) return as->state;
+	if (!as->cmd) return PYL_ERR;
+
+	memset(&pa,0,sizeof(pa));
+	pa.ver = hex2int(as->rxBuf+1,1);
+	pa.cid2 = as->cmd;
+	pa.info = as->info;
+	pa.readPtr = as->info;
+	if (!pa.info && as->cmd != CID2_GetCommunicationProtocolVersion) return PYL_ERR;
+
+	switch (as->cmd) {
+		case CID2_GetCommunicationProtocolVersion:
+			pyl->protocolVersion = pa.ver;
+			if (dest) *(int *)dest = pa.ver;
+			break;
+		case CID2_GetAnalogValue:
+			decodeAnalogData(&pa,dest); break;
+		case CID2_GetAlarmData:
+			decodeAlarmInfo(&pa,dest); break;
+		case CID2_GetSystemParameter:
+			decodeSystemParameter(&pa,dest); break;
+		case CID2_GetManufacturerInformation:
+			decodeManufacturerInformation(&pa,dest); break;
+		case CID2_GetChargeDischargeManagementInformation:
+			decodeChargeDischargeInfo(&pa,dest); break;
+		case CID2_GetSerialNumberOfEquipment:
+			decodeSerialNumber(&pa,dest); break;
+		default:
+			return PYL_ERR;
+	}
+	return PYL_OK;
+}
+
+
+void pyl_asyncCancel (PYL_HandleT* pyl) {
+	if (!pyl) return;
+	if (pyl->async.state == PYL_PENDING) {
+		if (pyl->serFd > 0) uart_flush(pyl->serFd);
+		pyl->async.state = PYL_CANCELLED;
+	}
+}
+
+
+int pyl_asyncFd (PYL_HandleT* pyl) { return pyl->serFd; }
+
+
+int pyl_asyncTimeout (PYL_HandleT* pyl) {
+	uint64_t now;
+
+	if (pyl->async.state != PYL_PENDING) return -1;
+	now = getMonotonicMs();
+	if (now >= pyl->async.deadline) return 0;
+	return pyl->async.deadline - now;
+}
+
+
+int pyl_asyncBusy (PYL_HandleT* pyl) { return pyl->async.state == PYL_PENDING; }
+
+
+#define POLL_ADR_PER_GROUP 16
+
+// per module state kept by pyl_pollAll
+typedef struct {
+	int staticValid;			// PYL_POLL_STATIC parts cached
+	int consecutiveErrors;
+	uint64_t retryTime;			// ms, CLOCK_MONOTONIC, quarantined until
+	PYL_SystemParameterT sp;
+	PYL_ManufacturerInformationT mi;
+	PYL_SerialNumberT sn;
+} pollModuleT;
+
+struct PYL_PollState {
+	pollModuleT module[PYL_MAX_GROUPS * POLL_ADR_PER_GROUP];
+};
+
+
+// run one command, the result is stored in m
+static int pollCommand (PYL_HandleT* pyl, int cmd, PYL_ModuleDataT *m) {
+	switch (cmd) {
+		case PYL_POLL_ANALOG: return pyl_getAnalogData(pyl,&m->ad);
+		case PYL_POLL_ALARM: return pyl_getAlarmInfo(pyl,&m->ai);
+		case PYL_POLL_CHARGE: return pyl_getChargeDischargeInfo(pyl,&m->cd);
+		case PYL_POLL_SYSTEMPARAMETER: return pyl_getSystemParameter(pyl,&m->sp);
+		case PYL_POLL_MANUFACTURER: return pyl_getManufacturerInformation(pyl,&m->mi);
+		case PYL_POLL_SERIAL: return pyl_getSerialNumber(pyl,&m->sn);
+	}
+	return PYL_ERR;
+}
+
+
+int pyl_pollModule (PYL_HandleT* pyl, int group, int adr, int cmds, PYL_ModuleDataT *m) {
+	int saveGroup = pyl->group, saveAdr = pyl->adr;
+	pollModuleT *pm;
+	uint64_t start;
+	int cmd,rc,first;
+
+	memset(m,0,sizeof(*m));
+	m->group = group;
+	m->adr = adr;
+	m->rc = PYL_ERR;
+	if ((group < 0) || (group >= PYL_MAX_GROUPS) || (adr < 1) || (adr > POLL_ADR_PER_GROUP)) return m->rc;
+	if (!pyl->poll) pyl->poll = calloc(1,sizeof(*pyl->poll));
+	if (!pyl->poll) return m->rc;
+	pm = &pyl->poll->module[group * POLL_ADR_PER_GROUP + adr-1];
+
+	start = getMonotonicMs();
+	if ((pm->consecutiveErrors >= PYL_QUARANTINE_ERRORS) && (start < pm->retryTime)) {
+		m->rc = PYL_QUARANTINED;
+		return m->rc;
+	}
+	if (pyl->console) cmds &= PYL_POLL_ANALOG | PYL_POLL_ALARM;	// nothing else in the pwr/bat output
+
+	// cached static data counts as received, the first command is queried anyway to check the module
+	m->valid = cmds & pm->staticValid;
+	if (m->valid & PYL_POLL_SYSTEMPARAMETER) m->sp = pm->sp;
+	if (m->valid & PYL_POLL_MANUFACTURER) m->mi = pm->mi;
+	if (m->valid & PYL_POLL_SERIAL) m->sn = pm->sn;
+
+	pyl_selectModule(pyl,group,adr);
+	first = cmds & -cmds;
+	m->rc = PYL_OK;
+	for (cmd = PYL_POLL_ANALOG; cmd <= PYL_POLL_SERIAL; cmd <<= 1) {
+		if (!(cmds & cmd) || ((m->valid & cmd) && (cmd != first))) continue;
+		rc = pollCommand(pyl,cmd,m);
+		if (rc == PYL_OK) m->valid |= cmd;
+		else if (cmd == first) {					// the module does not answer, skip the others
+			m->rc = rc;
+			m->valid = 0;
+			break;
+		}
+	}
+	pyl_selectModule(pyl,saveGroup,saveAdr);
+	m->latencyMs = getMonotonicMs() - start;
+
+	if (m->rc != PYL_OK) {
+		if (++pm->consecutiveErrors >= PYL_QUARANTINE_ERRORS) {
+			if (pm->consecutiveErrors == PYL_QUARANTINE_ERRORS)
+				LOG(1,"pyl_pollAll: group %d module %d quarantined for %d seconds\n",group,adr,PYL_QUARANTINE_MS/1000);
+			pm->retryTime = getMonotonicMs() + PYL_QUARANTINE_MS;
+			pm->staticValid = 0;					// may be a different module when it answers again
+		}
+		return m->rc;
+	}
+	pm->consecutiveErrors = 0;
+	if (m->valid & PYL_POLL_SYSTEMPARAMETER) pm->sp = m->sp;
+	if (m->valid & PYL_POLL_MANUFACTURER) pm->mi = m->mi;
+	if (m->valid & PYL_POLL_SERIAL) pm->sn = m->sn;
+	pm->staticValid |= m->valid & PYL_POLL_STATIC;
+	return m->rc;
+}
+
+
+int pyl_pollAll (PYL_HandleT* pyl, int cmds, PYL_ModuleDataT *m, int maxModules) {
+	int adr,group,maxAdr = 0,n = 0;
+
+	if (!pyl || !m) return 0;
+	for (group = 0; group < PYL_MAX_GROUPS; group++)
+		if (pyl->groupDevices[group] > maxAdr) maxAdr = pyl->groupDevices[group];
+	for (adr = 1; adr <= maxAdr; adr++)
+		for (group = 0; group < PYL_MAX_GROUPS; group++) {
+			if (adr > pyl->groupDevices[group]) continue;
+			if (n >= maxModules) return n;
+			pyl_pollModule(pyl,group,adr,cmds,&m[n++]);
+		}
+	return n;
+}
+
+
 // allocate and initialize api handle
 PYL_HandleT* pyl_initHandle() {
 	PYL_HandleT* pyl;
@@ -710,6 +1155,9 @@ void pyl_freeHandle(PYL_HandleT* pyl) {
 	if(pyl) {
 		pyl_closeSerialPort(pyl);
 		if (pyl->portname) free(pyl->portname);
+		free(pyl->console);
+		free(pyl->poll);
+		pylb_close(pyl);
 		free(pyl);
 	}
 }
@@ -723,21 +1171,65 @@ int pyl_setGroup (PYL_HandleT* pyl, int groupNum) {
 
 	pyl->group = groupNum;
 	pyl->numDevicesFound = 0;
+	pyl->initialized = 0;						// no retries, the probe after the last module fails
+	if (pyl->poll && (groupNum >= 0) && (groupNum < PYL_MAX_GROUPS))	// modules may have been replaced
+		memset(&pyl->poll->module[groupNum * POLL_ADR_PER_GROUP],0,sizeof(pollModuleT) * POLL_ADR_PER_GROUP);
+	if (pyl->console) {
+		pyl->console->pwrTime = 0;
+		if (pylc_pwr(pyl) == PYL_OK) pyl->numDevicesFound = pyl->console->numPacks;
+		pyl->groupDevices[0] = pyl->numDevicesFound;
+		if (pyl->numDevicesFound) pyl->initialized=1;
+		return pyl->numDevicesFound;
+	}
 	for (i = 0; i < PYL_MAX_DEVICES_IN_GROUP; i++) {
 		pyl_setAdr(pyl,i+1);
 		res = pyl_getProtocolVersion (pyl);
 		if (res != PYL_OK) break;
 		pyl->numDevicesFound++;
 	}
+	if ((groupNum >= 0) && (groupNum < PYL_MAX_GROUPS)) pyl->groupDevices[groupNum] = pyl->numDevicesFound;
 	if (pyl->numDevicesFound) pyl->initialized=1;
 	//printf("pyl_setGroup: group: %d, numDevicesFound: %d, initialized: %d\n",groupNum,pyl->numDevicesFound,pyl->initialized);
 	return pyl->numDevicesFound;
 }
 
 
+int pyl_scanGroups (PYL_HandleT* pyl, int groupMask) {
+	int group,total = 0;
+	int first = -1;
+
+	for (group = 0; group < PYL_MAX_GROUPS; group++) {
+		if ((groupMask & (1 << group)) == 0) continue;
+		if (pyl_setGroup(pyl, group) < 0) return -1;
+		total += pyl->groupDevices[group];
+		if ((first < 0) && pyl->groupDevices[group]) first = group;
+		VPRINTF(1,"pyl_scanGroups: group %d: %d modules\n",group,pyl->groupDevices[group]);
+	}
+	if (first >= 0) {
+		pyl->group = first;
+		pyl->numDevicesFound = pyl->groupDevices[first];
+		pyl->initialized = 1;
+	}
+	return total;
+}
+
+
+int pyl_numDevicesInGroup (PYL_HandleT* pyl, int groupNum) {
+	if ((groupNum < 0) || (groupNum >= PYL_MAX_GROUPS)) return 0;
+	return pyl->groupDevices[groupNum];
+}
+
+
+void pyl_selectModule (PYL_HandleT* pyl, int groupNum, int adr) {
+	pyl->group = groupNum;
+	pyl->adr = adr;
+}
+
+
 // closes the serial port, e.g. in case of errors. It will be reopened automatically on request
 void pyl_closeSerialPort(PYL_HandleT* pyl) {
 	if (!pyl) return;
+	pyl_asyncCancel(pyl);
 	if (pyl->serFd) {
 		uart_close(pyl->serFd,&pyl->ti_save);
 		pyl->serFd = 0;
@@ -753,9 +1245,15 @@ int pyl_openSerialPort(PYL_HandleT* pyl) {
 
 	pyl->serFd = initSerial (pyl->portname,115200,&pyl->ti_save,&pyl->ti);
 	if (pyl->serFd <= 0) {
+		if (errno == EBUSY) {
+			LOG(0,"%s is locked by another process\n",pyl->portname);
+			pyl->stats.portBusy++;
+		}
 		pyl->serFd = 0;
 		return PYL_ERR;
 	}
+	pyl->termiosCheckNeeded = 0;
+	pyl->termiosCheckTime = getMonotonicMs() + PYL_TERMIOS_CHECK_INTERVAL_MS;
 	return PYL_OK;
 }
 
@@ -771,6 +1269,24 @@ int pyl_connect(PYL_HandleT* pyl, int groupNum, char *portname) {
 }
 
 
+int pyl_connectGroups(PYL_HandleT* pyl, int groupMask, char *portname) {
+	if (!pyl) return -1;
+	pyl->portname = strdup(portname);
+
+	int rc = pyl_openSerialPort(pyl);
+	if (rc == PYL_OK) rc = pyl_scanGroups (pyl, groupMask);
+	return rc;
+}
+
+
+int pyl_connectConsole(PYL_HandleT* pyl, char *portname) {
+	if (!pyl) return -1;
+	if (!pyl->console) pyl->console = calloc(1,sizeof(*pyl->console));
+	if (!pyl->console) return -1;
+	return pyl_connect(pyl, 0, portname);
+}
+
+
 // set device address in group, first device is 1
 void pyl_setAdr(PYL_HandleT* pyl, int Adr) {
 	pyl->adr = Adr;
@@ -778,3 +1294,129 @@ void pyl_setAdr(PYL_HandleT* pyl, int Adr) {
 
 
 int pyl_numDevices(PYL_HandleT* pyl) { return pyl->numDevicesFound; };
+
+
+int pyl_portLockedByOther(const char *portname, int lockOwner) {
+	char path[PATH_MAX+sizeof(PYL_LOCKDIR)+1];
+	char real[PATH_MAX];
+	char target[32];
+	const char *name;
+	int len,pid;
+
+	// the lock is named like the device, not like a symlink to it (e.g. /dev/ttyUSB_pylontech)
+	if (realpath(portname,real)) portname = real;
+	name = strrchr(portname,'/');
+	if (name) name++; else name = portname;
+
+	snprintf(path,sizeof(path),"%s/%s",PYL_LOCKDIR,name);
+	len = readlink(path,target,sizeof(target)-1);
+	if (len <= 0) return 0;
+	target[len] = 0;
+	pid = strtol(target,NULL,10);
+	if (pid <= 0) return 0;
+	if ((pid == getpid()) || (pid == lockOwner)) return 0;		// e.g. serstart locked the port for us
+	if ((kill(pid,0) != 0) && (errno == ESRCH)) return 0;		// stale lock file
+	return 1;
+}
+
+
+typedef struct {
+	PYL_HandleT *pyl;
+	int group;
+	int adr;
+	int numDevices;
+	int protocolVersion;
+} discoverPortT;
+
+// send the next probe or advance to the next group, returns 0 if the port is done
+int discoverNext (discoverPortT *dp, int groupMask, int timeoutMs, PYL_DiscoverResultT *res, int maxRes, int *numRes) {
+	while (dp->group < 16) {
+		if ((groupMask & (1 << dp->group)) && (dp->adr <= PYL_MAX_DEVICES_IN_GROUP)) {
+			if (pyl_asyncSend(dp->pyl, dp->group, dp->adr, PYL_CMD_PROTOCOLVERSION, timeoutMs) == PYL_OK) return 1;
+			return 0;
+		}
+		if (dp->numDevices && (*numRes < maxRes)) {
+			res[*numRes].portname = dp->pyl->portname;
+			res[*numRes].group = dp->group;
+			res[*numRes].numDevices = dp->numDevices;
+			res[*numRes].protocolVersion = dp->protocolVersion;
+			(*numRes)++;
+		}
+		dp->group++;
+		dp->adr = 1;
+		dp->numDevices = 0;
+	}
+	return 0;
+}
+
+
+int pyl_discover(char **portnames, int numPorts, int groupMask, int timeoutMs, int lockOwner, PYL_DiscoverResultT *res, int maxRes) {
+	discoverPortT *ports;
+	struct pollfd *fds;
+	int i,n,rc,active,wait,t;
+	int numRes = 0;
+
+	if (timeoutMs <= 0) timeoutMs = PYL_DISCOVER_TIMEOUT_MS;
+	groupMask &= 0xffff;
+	ports = calloc(numPorts,sizeof(*ports));
+	fds = calloc(numPorts,sizeof(*fds));
+	if (!ports || !fds) { free(ports); free(fds); return 0; }
+
+	// open all ports and send the first probe
+	active = 0;
+	for (i=0;i<numPorts;i++) {
+		if (pyl_portLockedByOther(portnames[i],lockOwner)) {
+			LOG(1,"pyl_discover: %s is locked by another process, skipped\n",portnames[i]);
+			continue;
+		}
+		ports[i].pyl = pyl_initHandle();
+		if (!ports[i].pyl) continue;
+		ports[i].pyl->portname = strdup(portnames[i]);
+		if (pyl_openSerialPort(ports[i].pyl) != PYL_OK) {
+			LOG(1,"pyl_discover: unable to open %s, skipped\n",portnames[i]);
+			pyl_freeHandle(ports[i].pyl);
+			ports[i].pyl = NULL;
+			continue;
+		}
+		ports[i].adr = 1;
+		if (discoverNext(&ports[i],groupMask,timeoutMs,res,maxRes,&numRes)) active++;
+	}
+
+	while (active) {
+		n = 0; wait = -1;
+		for (i=0;i<numPorts;i++) {
+			if (!ports[i].pyl || !pyl_asyncBusy(ports[i].pyl)) continue;
+			fds[n].fd = pyl_asyncFd(ports[i].pyl);
+			fds[n].events = POLLIN;
+			fds[n].revents = 0;
+			n++;
+			t = pyl_asyncTimeout(ports[i].pyl);
+			if ((wait < 0) || (t < wait)) wait = t;
+		}
+		poll(fds,n,wait);
+
+		for (i=0;i<numPorts;i++) {
+			if (!ports[i].pyl || !pyl_asyncBusy(ports[i].pyl)) continue;
+			rc = pyl_asyncPoll(ports[i].pyl);
+			if (rc == PYL_PENDING) continue;
+			if (rc == PYL_OK) {
+				pyl_asyncDecode(ports[i].pyl,&ports[i].protocolVersion);
+				ports[i].numDevices++;
+				ports[i].adr++;
+			} else {
+				ports[i].adr = PYL_MAX_DEVICES_IN_GROUP+1;		// no (more) modules in this group
+			}
+			if (!discoverNext(&ports[i],groupMask,timeoutMs,res,maxRes,&numRes)) active--;
+		}
+	}
+
+	// the results point to our names, not to the handles
+	for (i=0;i<numRes;i++) {
+		for (n=0;n<numPorts;n++)
+			if (ports[n].pyl && (res[i].portname == ports[n].pyl->portname)) res[i].portname = portnames[n];
+	}
+	for (i=0;i<numPorts;i++) pyl_freeHandle(ports[i].pyl);
+	free(ports);
+	free(fds);
+	return numRes;
+}
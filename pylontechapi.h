@@ -29,6 +29,21 @@
  * you can also set the group (0..15), setting the group will scan for the number of modules
  *     int numModules = pyl_setGroup (PYL_HandleT* pyl, int groupNum);
  *
+ * several groups on one bus (link port chain), scan once and select group and module per request:
+ *     int total = pyl_connectGroups(pyl, (1 << 0) | (1 << 1), "/dev/ttyUSB0");
+ *     for each group with pyl_numDevicesInGroup(pyl, group) modules: pyl_selectModule(pyl, group, adr); pyl_getAnalogData(...)
+ *
+ * non-blocking use (one request in flight per handle, the bus is half duplex):
+ *     pyl_asyncSend(pyl, group, adr, PYL_CMD_ANALOGDATA, 0);
+ *     while ((res = pyl_asyncPoll(pyl)) == PYL_PENDING) { wait for pyl_asyncFd(pyl) with timeout pyl_asyncTimeout(pyl) }
+ *     if (res == PYL_OK) res = pyl_asyncDecode(pyl, &ad);
+ * pylontech_co.hpp provides a C++20 coroutine layer on top of this
+ *
+ * all modules of the scanned groups at once, the handle's group and adr are not changed:
+ *     PYL_ModuleDataT m[PYL_MAX_GROUPS * PYL_MAX_DEVICES_IN_GROUP];
+ *     int n = pyl_pollAll(pyl, PYL_POLL_ANALOG | PYL_POLL_SERIAL, m, PYL_MAX_GROUPS * PYL_MAX_DEVICES_IN_GROUP);
+ *     for (i = 0; i < n; i++) if (m[i].rc == PYL_OK) ... m[i].ad, m[i].sn
+ *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation; either version 2 of the License, or
@@ -56,6 +71,7 @@ extern "C" {
 #endif
 
 #include <termios.h>
+#include <stdint.h>
 #include "log.h"
 
 #define PYL_DEFPORTNAME "/dev/ttyUSB_pylontech"
@@ -71,6 +87,7 @@ extern "C" {
 //     Maximum 8/12 (please refer to product specification) batteries in one group
 //  lets use the lower 4 bit minus 2 as the first device is always @ adr 2
 #define PYL_MAX_DEVICES_IN_GROUP 14
+#define PYL_MAX_GROUPS 16
 
 
 #define PYL_CELL_VOLTAGE_DIVIDER 1000
@@ -87,6 +104,66 @@ extern "C" {
 
 #define PYL_OK 0
 #define PYL_ERR -1
+#define PYL_PENDING 1			// non-blocking api: request still in flight
+#define PYL_CANCELLED -2
+#define PYL_TIMEOUT -3
+#define PYL_QUARANTINED -4		// pyl_pollAll: module skipped after repeated failures
+
+// commands for the non-blocking api (CID2 values)
+#define PYL_CMD_ANALOGDATA 0x42
+#define PYL_CMD_ALARMINFO 0x44
+#define PYL_CMD_SYSTEMPARAMETER 0x47
+#define PYL_CMD_PROTOCOLVERSION 0x4f
+#define PYL_CMD_MANUFACTURERINFO 0x51
+#define PYL_CMD_CHARGEDISCHARGEINFO 0x92
+#define PYL_CMD_SERIALNUMBER 0x93
+
+// default time for a non-blocking request to complete
+#define PYL_ASYNC_TIMEOUT_MS 500
+
+// this is the maximum possible length of a response frame plus a 0 byte
+#define PYL_RECEIVE_BUFSIZE 24+4096+1
+
+// lock files of the venus serial starter, a symlink named like the device pointing to the pid
+#define PYL_LOCKDIR "/var/lock/serial-starter"
+// pyl_discover: time for a module to answer
+#define PYL_DISCOVER_TIMEOUT_MS 200
+
+// pyl_pollAll: a module failing this number of polls in a row is skipped (one probe per interval)
+#define PYL_QUARANTINE_ERRORS 3
+#define PYL_QUARANTINE_MS 60000
+
+// data acquired by pyl_pollAll, static data (system parameter, manufacturer, serial number) is queried once per module
+#define PYL_POLL_ANALOG 0x01
+#define PYL_POLL_ALARM 0x02
+#define PYL_POLL_CHARGE 0x04
+#define PYL_POLL_SYSTEMPARAMETER 0x08
+#define PYL_POLL_MANUFACTURER 0x10
+#define PYL_POLL_SERIAL 0x20
+#define PYL_POLL_STATIC (PYL_POLL_SYSTEMPARAMETER | PYL_POLL_MANUFACTURER | PYL_POLL_SERIAL)
+
+// serial settings are verified after communication errors and at least every
+#define PYL_TERMIOS_CHECK_INTERVAL_MS 60000
+
+// counters for port contention
+typedef struct {
+	int portBusy;				// open failed because another process has locked the port
+	int termiosChecks;			// number of serial settings verifications
+	int termiosAltered;			// serial settings found modified by another process
+	int commErrors;				// failed transactions, each triggers a verification
+} PYL_StatsT;
+
+// state of the request in flight for the non-blocking api
+typedef struct {
+	int cmd;					// CID2 of the pending request, 0 if idle
+	int group;
+	int adr;					// first device is 1
+	int state;					// PYL_PENDING, PYL_OK or error
+	uint64_t deadline;			// ms, CLOCK_MONOTONIC
+	int rxLen;
+	char rxBuf[PYL_RECEIVE_BUFSIZE];
+	char *info;					// info of the received response, hex ascii, points into rxBuf
+} PYL_AsyncT;
 
 
 typedef struct {
@@ -98,7 +175,15 @@ typedef struct {
 	int serFd;					// fileno for serial port i/o
 	int protocolVersion;
 	int numDevicesFound;
+	int groupDevices[PYL_MAX_GROUPS];	// modules per group, set by pyl_setGroup and pyl_scanGroups
 	int initialized;			// 1 after initialization (modules scanned)
+	uint64_t termiosCheckTime;	// ms, CLOCK_MONOTONIC, next periodic verification of the serial settings
+	int termiosCheckNeeded;		// verify serial settings before the next command
+	PYL_StatsT stats;
+	PYL_AsyncT async;			// non-blocking api
+	struct PYL_Console *console;	// console port text protocol (pwr/bat) if not NULL, see pyl_connectConsole
+	struct PYL_Broker *broker;		// requests are sent to the process owning the port if not NULL, see pyl_connectBroker
+	struct PYL_PollState *poll;		// static data and failures per module for pyl_pollAll, allocated on first use
 } PYL_HandleT;
 
 typedef struct {
@@ -164,6 +249,28 @@ typedef struct {
 	int chargeDischargeStatus;
 } PYL_ChargeDischargeInfoT;
 
+// result of pyl_pollAll for one module
+typedef struct {
+	int group;
+	int adr;					// first module is 1
+	int rc;						// result of the first command requested, the others are skipped if it failed
+	int valid;					// PYL_POLL_x received, static data may be from a previous poll
+	uint32_t latencyMs;			// time for the requests of this module
+	PYL_AnalogDataT ad;
+	PYL_AlarmInfoT ai;
+	PYL_ChargeDischargeInfoT cd;
+	PYL_SystemParameterT sp;
+	PYL_ManufacturerInformationT mi;
+	PYL_SerialNumberT sn;
+} PYL_ModuleDataT;
+
+typedef struct {
+	const char *portname;		// points to the name passed to pyl_discover
+	int group;
+	int numDevices;				// modules 1..numDevices answered
+	int protocolVersion;
+} PYL_DiscoverResultT;
+
 // allocate and initialize api handle
 PYL_HandleT* pyl_initHandle();
 
@@ -173,19 +280,46 @@ void pyl_freeHandle(PYL_HandleT* pyl);
 // sets the group and scans for devices in group, returns number of devices found
 int pyl_setGroup (PYL_HandleT* pyl, int groupNum);
 
+// scans all groups set in groupMask (bit 0 = group 0), returns the total number of modules found.
+// The first group with modules is selected
+int pyl_scanGroups (PYL_HandleT* pyl, int groupMask);
+
+// number of modules found in group by the last scan
+int pyl_numDevicesInGroup (PYL_HandleT* pyl, int groupNum);
+
+// select group and module for the next request without scanning, first module is 1
+void pyl_selectModule (PYL_HandleT* pyl, int groupNum, int adr);
+
 // closes the serial port, e.g. in case of errors. It will be reopened automatically on request
 void pyl_closeSerialPort(PYL_HandleT* pyl);
+// opens the port for exclusive use (TIOCEXCL and flock), fails if another process has locked the port
 int pyl_openSerialPort(PYL_HandleT* pyl);
 
 // open the serial port and query the number of devices, first device is at group num +2, first group is 0
 // returns -1 on failure opening the serial port or the number of devices found
 int pyl_connect(PYL_HandleT* pyl, int groupNum, char *portname);
 
+// like pyl_connect for all groups set in groupMask, returns -1 or the total number of devices found
+int pyl_connectGroups(PYL_HandleT* pyl, int groupMask, char *portname);
+
+// like pyl_connect but uses the console port (RS232) of the master pack, all modules of the stack are
+// read with one pwr command. Only pyl_getAnalogData and pyl_getAlarmInfo are available
+int pyl_connectConsole(PYL_HandleT* pyl, char *portname);
+
 // set device address in group, first device is 1
 void pyl_setAdr(PYL_HandleT* pyl, int Adr);
 
 int pyl_numDevices(PYL_HandleT* pyl);
 
+// 1 if there is a lock file in PYL_LOCKDIR for the port owned by another running process (not us or lockOwner)
+// lockOwner is the pid of the process that locked the ports for us, e.g. serstart, 0 = none
+int pyl_portLockedByOther(const char *portname, int lockOwner);
+
+// probe all ports at once for modules in the groups set in groupMask (bit 0 = group 0), ports locked by other
+// processes (other than lockOwner, see pyl_portLockedByOther) are skipped. timeoutMs=0 uses PYL_DISCOVER_TIMEOUT_MS
+// returns the number of entries (one per port and group with at least one module) stored in res
+int pyl_discover(char **portnames, int numPorts, int groupMask, int timeoutMs, int lockOwner, PYL_DiscoverResultT *res, int maxRes);
+
 // get data from selected in device in selected group
 int pyl_getProtocolVersion (PYL_HandleT* pyl);
 int pyl_getAnalogData (PYL_HandleT* pyl, PYL_AnalogDataT *pd);
@@ -195,6 +329,34 @@ int pyl_getSerialNumber (PYL_HandleT* pyl, PYL_SerialNumberT *mi);
 int pyl_getAlarmInfo (PYL_HandleT* pyl, PYL_AlarmInfoT *ai);
 int pyl_getChargeDischargeInfo (PYL_HandleT* pyl, PYL_ChargeDischargeInfoT *cd);
 
+// send cmd (PYL_CMD_x) to the selected module and copy the info of the response as received (hex ascii,
+// 0 terminated) to info, for decoders outside of the api (pylontech.hpp). Returns the length or PYL_ERR
+int pyl_getRawInfo (PYL_HandleT* pyl, int cmd, char *info, int size);
+
+// get the data selected by cmds (PYL_POLL_x) of all modules of the scanned groups, ordered adr 1 of all groups,
+// adr 2 of all groups ... Modules failing PYL_QUARANTINE_ERRORS polls in a row get rc PYL_QUARANTINED without
+// a request until PYL_QUARANTINE_MS have passed. Commands not available (e.g. on the console port) are not
+// set in valid. Returns the number of entries stored in m
+int pyl_pollAll (PYL_HandleT* pyl, int cmds, PYL_ModuleDataT *m, int maxModules);
+// same for one module, returns m->rc
+int pyl_pollModule (PYL_HandleT* pyl, int group, int adr, int cmds, PYL_ModuleDataT *m);
+
+// non-blocking api, group and adr are passed explicitly, the handle's group and adr are not changed
+// send a request, timeoutMs=0 uses PYL_ASYNC_TIMEOUT_MS, a pending request will be cancelled
+int pyl_asyncSend (PYL_HandleT* pyl, int group, int adr, int cmd, int timeoutMs);
+// read available data without blocking, returns PYL_PENDING, PYL_OK, PYL_ERR or PYL_TIMEOUT
+int pyl_asyncPoll (PYL_HandleT* pyl);
+// decode the response of the completed request, dest has to match the command, e.g. PYL_AnalogDataT for PYL_CMD_ANALOGDATA
+int pyl_asyncDecode (PYL_HandleT* pyl, void *dest);
+// abort the request in flight, discards pending input
+void pyl_asyncCancel (PYL_HandleT* pyl);
+// file descriptor to wait on for input
+int pyl_asyncFd (PYL_HandleT* pyl);
+// ms until the request in flight times out, -1 if idle
+int pyl_asyncTimeout (PYL_HandleT* pyl);
+// 1 if a request is in flight
+int pyl_asyncBusy (PYL_HandleT* pyl);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,135 @@
+/*
+ * pylshm.c
+ *
+ * module state in shared memory, protected by a sequence lock, see pylshm.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pylshm.h"
+#include "log.h"
+
+
+PYL_ShmT * pyl_shmCreate(const char *name, int numModules) {
+	PYL_ShmT *shm;
+	size_t size;
+	int fd;
+
+	if ((numModules < 0) || (numModules > PYL_SHM_MAX_MODULES)) return NULL;
+	size = sizeof(PYL_ShmT) + numModules * sizeof(PYL_ShmModuleT);
+	// a new object, readers of a previous instance keep their (stale) mapping
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		LOG(0,"pyl_shmCreate: unable to create %s (%s)\n",name,strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, size) < 0) {
+		LOG(0,"pyl_shmCreate: unable to resize %s (%s)\n",name,strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		LOG(0,"pyl_shmCreate: mmap failed (%s)\n",strerror(errno));
+		shm_unlink(name);
+		return NULL;
+	}
+	memset(shm, 0, size);
+	shm->size = size;
+	shm->moduleSize = sizeof(PYL_ShmModuleT);
+	shm->pid = getpid();
+	shm->numModules = numModules;
+	shm->version = PYL_SHM_VERSION;
+	// readers check the magic last
+	__atomic_store_n(&shm->magic, PYL_SHM_MAGIC, __ATOMIC_RELEASE);
+	return shm;
+}
+
+
+void pyl_shmDestroy(PYL_ShmT *shm, const char *name) {
+	if (!shm) return;
+	munmap(shm, shm->size);
+	shm_unlink(name);
+}
+
+
+void pyl_shmBeginWrite(PYL_ShmT *shm) {
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+void pyl_shmEndWrite(PYL_ShmT *shm) {
+	struct timespec tp;
+
+	clock_gettime(CLOCK_REALTIME, &tp);
+	shm->updated = (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+PYL_ShmT * pyl_shmOpen(const char *name) {
+	PYL_ShmT *shm;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) return NULL;
+	if ((fstat(fd, &st) < 0) || (st.st_size < (off_t)sizeof(PYL_ShmT))) {
+		close(fd);
+		return NULL;
+	}
+	shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) return NULL;
+	if ((__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != PYL_SHM_MAGIC) || (shm->version != PYL_SHM_VERSION)
+		|| (shm->moduleSize != sizeof(PYL_ShmModuleT)) || (shm->size != (uint32_t)st.st_size)) {
+		munmap(shm, st.st_size);
+		return NULL;
+	}
+	return shm;
+}
+
+
+void pyl_shmClose(PYL_ShmT *shm) {
+	if (shm) munmap(shm, shm->size);
+}
+
+
+// copy modules first..first+num-1 with a consistent sequence number
+static int readModules(PYL_ShmT *shm, int first, int num, PYL_ShmModuleT *m) {
+	uint32_t seq;
+	int retries = PYL_SHM_RETRIES;
+
+	while (retries--) {
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) continue;								// update in progress
+		memcpy(m, &shm->module[first], num * sizeof(*m));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) return num;
+	}
+	return PYL_ERR;
+}
+
+
+int pyl_shmRead(PYL_ShmT *shm, PYL_ShmModuleT *m, int maxModules) {
+	int num = shm->numModules;
+
+	if (num > maxModules) num = maxModules;
+	return readModules(shm, 0, num, m);
+}
+
+
+int pyl_shmReadModule(PYL_ShmT *shm, int idx, PYL_ShmModuleT *m) {
+	if ((idx < 0) || (idx >= (int)shm->numModules)) return PYL_ERR;
+	return readModules(shm, idx, 1, m) == 1 ? PYL_OK : PYL_ERR;
+}
@@ -0,0 +1,93 @@
+/*
+ * pylshm.h
+ *
+ * latest state of all modules in a shared memory region (/dev/shm), written by pylon2influx --shm
+ * and readable by any local process without opening the serial port.
+ *
+ * The region is protected by a sequence lock: the writer increments seq before and after an update,
+ * a reader copies the data and retries if seq was odd or has changed meanwhile. Readers never block
+ * the writer and reading does not need any syscall once the region is mapped.
+ *
+ * Reader:
+ *     PYL_ShmT *shm = pyl_shmOpen(PYL_SHM_NAME);
+ *     PYL_ShmModuleT m[PYL_SHM_MAX_MODULES];
+ *     int n = pyl_shmRead(shm, m, PYL_SHM_MAX_MODULES);   // consistent snapshot of all modules
+ *     pyl_shmClose(shm);
+ *
+ * Writer:
+ *     PYL_ShmT *shm = pyl_shmCreate(PYL_SHM_NAME, numModules);
+ *     pyl_shmBeginWrite(shm);
+ *     pyl_shmModule(shm, idx)->ad = ...;
+ *     pyl_shmEndWrite(shm);
+ *     pyl_shmDestroy(shm, PYL_SHM_NAME);
+ */
+
+#ifndef PYLSHM_H_INCLUDED
+#define PYLSHM_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "pylontechapi.h"
+
+#define PYL_SHM_NAME "/pylontech"			// /dev/shm/pylontech
+#define PYL_SHM_MAGIC 0x4d48534c			// "LSHM"
+#define PYL_SHM_VERSION 1					// incremented if the layout changes
+#define PYL_SHM_MAX_MODULES (PYL_MAX_GROUPS * 16)
+#define PYL_SHM_RETRIES 10000				// reader attempts while an update is in progress
+
+// bits of PYL_ShmModuleT.valid
+#define PYL_SHM_VALID_ANALOG 0x01
+#define PYL_SHM_VALID_ALARM 0x02
+#define PYL_SHM_VALID_CHARGE 0x04
+
+typedef struct {
+	uint16_t port;						// index of the serial port in the order given to pylon2influx
+	uint8_t group;
+	uint8_t adr;						// first module is 1
+	uint32_t valid;						// PYL_SHM_VALID_x, parts received at least once
+	uint32_t consecutiveErrors;			// failed polls since the last successful one
+	uint32_t updates;
+	uint64_t timestamp;					// ns since the epoch, last successful poll
+	PYL_AnalogDataT ad;
+	PYL_AlarmInfoT ai;
+	PYL_ChargeDischargeInfoT cd;
+} PYL_ShmModuleT;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;						// of the region in bytes
+	uint32_t moduleSize;				// sizeof(PYL_ShmModuleT) of the writer
+	int32_t pid;						// of the writer
+	uint32_t numModules;
+	uint32_t seq;						// odd while an update is in progress
+	uint32_t reserved;
+	uint64_t updated;					// ns since the epoch, last update
+	PYL_ShmModuleT module[];
+} PYL_ShmT;
+
+// writer: create (or replace) the region for numModules, NULL on failure
+PYL_ShmT * pyl_shmCreate(const char *name, int numModules);
+// writer: unmap and remove
+void pyl_shmDestroy(PYL_ShmT *shm, const char *name);
+void pyl_shmBeginWrite(PYL_ShmT *shm);
+void pyl_shmEndWrite(PYL_ShmT *shm);
+static inline PYL_ShmModuleT * pyl_shmModule(PYL_ShmT *shm, int idx) { return &shm->module[idx]; }
+
+// reader: map an existing region read only, NULL if not available or of a different version
+PYL_ShmT * pyl_shmOpen(const char *name);
+void pyl_shmClose(PYL_ShmT *shm);
+// reader: copy up to maxModules modules, returns the number of modules copied
+// or PYL_ERR if no consistent copy could be made (writer died during an update)
+int pyl_shmRead(PYL_ShmT *shm, PYL_ShmModuleT *m, int maxModules);
+// reader: copy one module, PYL_ERR if idx is out of range or no consistent copy could be made
+int pyl_shmReadModule(PYL_ShmT *shm, int idx, PYL_ShmModuleT *m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PYLSHM_H_INCLUDED
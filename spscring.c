@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include <string.h>
+#include "spscring.h"
+
+
+SPSC_T * spsc_init(size_t capacity, size_t elemSize) {
+	SPSC_T *r;
+	size_t size = 2;
+
+	while (size < capacity) size <<= 1;
+	r = aligned_alloc(SPSC_CACHELINE, (sizeof(*r) + SPSC_CACHELINE-1) & ~(size_t)(SPSC_CACHELINE-1));
+	if (!r) return NULL;
+	memset(r,0,sizeof(*r));
+	r->buf = malloc(size * elemSize);
+	if (!r->buf) { free(r); return NULL; }
+	atomic_init(&r->head,0);
+	atomic_init(&r->tail,0);
+	r->mask = size - 1;
+	r->elemSize = elemSize;
+	return r;
+}
+
+
+void spsc_free(SPSC_T *r) {
+	if (!r) return;
+	free(r->buf);
+	free(r);
+}
+
+
+int spsc_push(SPSC_T *r, const void *elem) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	if (head - tail > r->mask) return 0;
+	memcpy(r->buf + (head & r->mask) * r->elemSize, elem, r->elemSize);
+	atomic_store_explicit(&r->head, head+1, memory_order_release);
+	return 1;
+}
+
+
+int spsc_full(SPSC_T *r) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	return head - tail > r->mask;
+}
+
+
+int spsc_pop(SPSC_T *r, void *elem) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	if (head == tail) return 0;
+	memcpy(elem, r->buf + (tail & r->mask) * r->elemSize, r->elemSize);
+	atomic_store_explicit(&r->tail, tail+1, memory_order_release);
+	return 1;
+}
@@ -0,0 +1,37 @@
+#ifndef SPSCRING_H_INCLUDED
+#define SPSCRING_H_INCLUDED
+
+/*
+ * lock-free single producer / single consumer ring of fixed size elements
+ *
+ * one thread calls spsc_push, one other thread calls spsc_pop. Head and tail are on their own
+ * cache lines, the producer only writes head, the consumer only writes tail.
+ */
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define SPSC_CACHELINE 64
+
+typedef struct {
+	_Alignas(SPSC_CACHELINE) atomic_size_t head;	// next slot to write, producer
+	_Alignas(SPSC_CACHELINE) atomic_size_t tail;	// next slot to read, consumer
+	_Alignas(SPSC_CACHELINE) size_t mask;			// capacity - 1, capacity is a power of 2
+	size_t elemSize;
+	unsigned char *buf;
+} SPSC_T;
+
+// capacity is rounded up to a power of 2, NULL if out of memory
+SPSC_T * spsc_init(size_t capacity, size_t elemSize);
+void spsc_free(SPSC_T *r);
+
+// copy elem into the ring, returns 0 if the ring is full
+int spsc_push(SPSC_T *r, const void *elem);
+
+// producer side: 1 if spsc_push would fail
+int spsc_full(SPSC_T *r);
+
+// copy the oldest element to elem, returns 0 if the ring is empty
+int spsc_pop(SPSC_T *r, void *elem);
+
+#endif // SPSCRING_H_INCLUDED
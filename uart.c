@@ -7,6 +7,8 @@
 #include "uart.h"
 #include <sys/select.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
+#include <errno.h>
 #include "log.h"
 
 //#define TCP
@@ -26,7 +28,6 @@
 #endif // TCP
 
 
-extern int verbose;
 
 
 
@@ -113,10 +114,27 @@ int socketConnect (const char *addrOrName, const char *port) {
 void uart_close(int serFd, struct termios * ti_save) {
 	if (serFd != 0) {
 		if (ti_save) tcsetattr(serFd,TCSANOW,ti_save);	// restore settings
-		close(serFd);
+#ifndef TCP
+		ioctl(serFd, TIOCNXCL);
+#endif
+		close(serFd);									// releases the flock as well
     }
 }
 
+
+int uart_lock(int serFd) {
+#ifndef TCP
+	// other processes honoring flock (e.g. another instance of us) will not get the port
+	if (flock(serFd, LOCK_EX | LOCK_NB) != 0) {
+		VPRINTF(3,"uart_lock: flock failed (%s)\n",strerror(errno));
+		if (errno == EWOULDBLOCK) return UART_ERR;
+	}
+	// further open() calls will fail with EBUSY (except for root)
+	if (ioctl(serFd, TIOCEXCL) != 0) VPRINTF(3,"uart_lock: TIOCEXCL failed (%s)\n",strerror(errno));
+#endif
+	return UART_OK;
+}
+
 #include "termios_helper.h"
 
 int initSerial (char * uart_port, int baud, struct termios * ti_save, struct termios * ti) {
@@ -140,6 +158,13 @@ int initSerial (char * uart_port, int baud, struct termios * ti_save, struct ter
 	VPRINTF(3, "Res:%d\n",serFd);
 	if (serFd <0) { return serFd; }
 
+	// lock before touching the settings, the port may be in use by another process
+	if (uart_lock(serFd) != UART_OK) {
+		close(serFd);
+		errno = EBUSY;
+		return -1;
+	}
+
 	if (ti_save) {
 			tcgetattr(serFd,ti_save); /* save current port settings */
 			//decode_termios (ti_save, st, sizeof(st));
@@ -245,9 +270,9 @@ void dumpBuffer (char *buf, int size) {
 int uart_write_bytes(int serFd, char* src, size_t size) {
 	int res;
 #if 0
-	if (verbose > 1) {
+	if (log_getVerboseLevel() > 1) {
 		VPRINTF(1,"uart_write_bytes: Request to write %d bytes ",(int)size);
-		if (verbose > 1) dumpBuffer(src,size);
+		if (log_getVerboseLevel() > 1) dumpBuffer(src,size);
 		printf("\n");
 	}
 #endif
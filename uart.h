@@ -16,6 +16,10 @@ void dumpBuffer (char *buf, int size);
 
 void uart_close(int serFd, struct termios * ti_save);
 
+// get exclusive access (TIOCEXCL and flock), returns UART_ERR if another process holds the lock
+int uart_lock(int serFd);
+
+// opens and locks the port, returns -1 with errno EBUSY if the port is locked by another process
 int initSerial (char * uart_port, int baud,
 				struct termios * ti_save,		// current will be saved here if != NULL
 				struct termios * ti);			// new will be saved here if != NULL
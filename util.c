@@ -31,6 +31,7 @@
 #include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
+#include <time.h>
 
 /*#include <stdlib.h>*/
 #include <string.h>
@@ -300,3 +301,10 @@ void getStringFromHex(char *src, char *dst, int numChars) {
 		*dst = (char)hex2int(src,1); src+=2; dst++; numChars--;
 	}
 }
+
+uint64_t getMonotonicMs(void) {
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
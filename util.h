@@ -29,6 +29,10 @@
 
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define KEY_ESC 27
 #define KEY_ENTER 13
 #define KEY_BS 8
@@ -77,4 +81,11 @@ int hex2int(char *hex, int numBytes);
 
 void getStringFromHex(char *src, char *dst, int numChars);
 
+/* milliseconds from CLOCK_MONOTONIC */
+uint64_t getMonotonicMs(void);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
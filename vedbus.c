@@ -0,0 +1,451 @@
+/*
+ * vedbus.c
+ *
+ * minimal Victron Venus OS D-Bus service, see vedbus.h
+ *
+ * Values are variants, invalid values are sent as an empty array of int32 and the text "---",
+ * the same way the Victron services do.
+ */
+
+#ifdef HAVE_DBUS
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dbus/dbus.h>
+#include "vedbus.h"
+#include "log.h"
+
+#define ITEM_INVALID 0
+#define ITEM_INT 1
+#define ITEM_DOUBLE 2
+#define ITEM_STRING 3
+
+#define TEXTLEN 64
+#define INITIAL_ITEMS 64
+
+typedef struct {
+	char *path;
+	char *unit;
+	int decimals;
+	int type;							// ITEM_x
+	int changed;						// since the last vedbus_flush
+	int i;
+	double d;
+	char *s;
+} itemT;
+
+struct VEDBUS_S {
+	DBusConnection *conn;
+	int count;
+	int size;
+	itemT *items;
+};
+
+static const double scale[] = { 1, 10, 100, 1000, 10000, 100000 };
+
+
+int vedbus_addItem(VEDBUS_T *ve, const char *path, const char *unit, int decimals) {
+	itemT *item;
+
+	if (ve->count == ve->size) {
+		int size = ve->size ? ve->size * 2 : INITIAL_ITEMS;
+		item = realloc(ve->items, sizeof(*item) * size);
+		if (!item) return VEDBUS_ERR;
+		ve->items = item;
+		ve->size = size;
+	}
+	item = &ve->items[ve->count];
+	memset(item,0,sizeof(*item));
+	item->path = strdup(path);
+	item->unit = strdup(unit ? unit : "");
+	if (!item->path || !item->unit) {
+		free(item->path);
+		free(item->unit);
+		return VEDBUS_ERR;
+	}
+	if (decimals < 0) decimals = 0;
+	if (decimals > 5) decimals = 5;
+	item->decimals = decimals;
+	item->changed = 1;
+	return ve->count++;
+}
+
+
+static void setType(itemT *item, int type) {
+	if (item->type == ITEM_STRING) {
+		free(item->s);
+		item->s = NULL;
+	}
+	item->type = type;
+	item->changed = 1;
+}
+
+
+void vedbus_setInt(VEDBUS_T *ve, int item, int value) {
+	itemT *it = &ve->items[item];
+
+	if ((it->type == ITEM_INT) && (it->i == value)) return;
+	setType(it,ITEM_INT);
+	it->i = value;
+}
+
+
+void vedbus_setDouble(VEDBUS_T *ve, int item, double value) {
+	itemT *it = &ve->items[item];
+	double diff = (it->d - value) * scale[it->decimals];
+
+	// jitter below the displayed resolution is not sent
+	if ((it->type == ITEM_DOUBLE) && (diff < 0.5) && (diff > -0.5)) return;
+	setType(it,ITEM_DOUBLE);
+	it->d = value;
+}
+
+
+void vedbus_setString(VEDBUS_T *ve, int item, const char *value) {
+	itemT *it = &ve->items[item];
+
+	if ((it->type == ITEM_STRING) && (strcmp(it->s,value) == 0)) return;
+	setType(it,ITEM_STRING);
+	it->s = strdup(value);
+}
+
+
+void vedbus_setInvalid(VEDBUS_T *ve, int item) {
+	if (ve->items[item].type != ITEM_INVALID) setType(&ve->items[item],ITEM_INVALID);
+}
+
+
+static void formatText(itemT *item, char *text) {
+	switch (item->type) {
+		case ITEM_INT: snprintf(text,TEXTLEN,"%d%s",item->i,item->unit); break;
+		case ITEM_DOUBLE: snprintf(text,TEXTLEN,"%.*f%s",item->decimals,item->d,item->unit); break;
+		case ITEM_STRING: snprintf(text,TEXTLEN,"%s",item->s); break;
+		default: strcpy(text,"---");
+	}
+}
+
+
+static void appendValue(DBusMessageIter *iter, itemT *item) {
+	DBusMessageIter var,arr;
+
+	switch (item->type) {
+		case ITEM_INT:
+			dbus_message_iter_open_container(iter,DBUS_TYPE_VARIANT,DBUS_TYPE_INT32_AS_STRING,&var);
+			dbus_message_iter_append_basic(&var,DBUS_TYPE_INT32,&item->i);
+			break;
+		case ITEM_DOUBLE:
+			dbus_message_iter_open_container(iter,DBUS_TYPE_VARIANT,DBUS_TYPE_DOUBLE_AS_STRING,&var);
+			dbus_message_iter_append_basic(&var,DBUS_TYPE_DOUBLE,&item->d);
+			break;
+		case ITEM_STRING:
+			dbus_message_iter_open_container(iter,DBUS_TYPE_VARIANT,DBUS_TYPE_STRING_AS_STRING,&var);
+			dbus_message_iter_append_basic(&var,DBUS_TYPE_STRING,&item->s);
+			break;
+		default:
+			dbus_message_iter_open_container(iter,DBUS_TYPE_VARIANT,"ai",&var);
+			dbus_message_iter_open_container(&var,DBUS_TYPE_ARRAY,DBUS_TYPE_INT32_AS_STRING,&arr);
+			dbus_message_iter_close_container(&var,&arr);
+	}
+	dbus_message_iter_close_container(iter,&var);
+}
+
+
+static void appendText(DBusMessageIter *iter, itemT *item) {
+	DBusMessageIter var;
+	char text[TEXTLEN];
+	const char *p = text;
+
+	formatText(item,text);
+	dbus_message_iter_open_container(iter,DBUS_TYPE_VARIANT,DBUS_TYPE_STRING_AS_STRING,&var);
+	dbus_message_iter_append_basic(&var,DBUS_TYPE_STRING,&p);
+	dbus_message_iter_close_container(iter,&var);
+}
+
+
+// {key: value or text} as in a{sv}
+static void appendDictEntry(DBusMessageIter *dict, const char *key, itemT *item, int text) {
+	DBusMessageIter entry;
+
+	dbus_message_iter_open_container(dict,DBUS_TYPE_DICT_ENTRY,NULL,&entry);
+	dbus_message_iter_append_basic(&entry,DBUS_TYPE_STRING,&key);
+	if (text) appendText(&entry,item); else appendValue(&entry,item);
+	dbus_message_iter_close_container(dict,&entry);
+}
+
+
+// a{sa{sv}}, {path: {"Value": v, "Text": s}} of all or of the changed items
+static void appendItems(VEDBUS_T *ve, DBusMessageIter *iter, int changedOnly) {
+	DBusMessageIter items,entry,props;
+	int i;
+
+	dbus_message_iter_open_container(iter,DBUS_TYPE_ARRAY,"{sa{sv}}",&items);
+	for (i=0;i<ve->count;i++) {
+		if (changedOnly && !ve->items[i].changed) continue;
+		dbus_message_iter_open_container(&items,DBUS_TYPE_DICT_ENTRY,NULL,&entry);
+		dbus_message_iter_append_basic(&entry,DBUS_TYPE_STRING,&ve->items[i].path);
+		dbus_message_iter_open_container(&entry,DBUS_TYPE_ARRAY,"{sv}",&props);
+		appendDictEntry(&props,"Value",&ve->items[i],0);
+		appendDictEntry(&props,"Text",&ve->items[i],1);
+		dbus_message_iter_close_container(&entry,&props);
+		dbus_message_iter_close_container(&items,&entry);
+	}
+	dbus_message_iter_close_container(iter,&items);
+}
+
+
+int vedbus_flush(VEDBUS_T *ve) {
+	DBusMessageIter iter;
+	DBusMessage *msg;
+	int i,num = 0;
+
+	for (i=0;i<ve->count;i++) num += ve->items[i].changed;
+	if (num == 0) return 0;
+
+	msg = dbus_message_new_signal("/",VEDBUS_INTERFACE,"ItemsChanged");
+	if (!msg) return VEDBUS_ERR;
+	dbus_message_iter_init_append(msg,&iter);
+	appendItems(ve,&iter,1);
+	if (!dbus_connection_send(ve->conn,msg,NULL)) {
+		dbus_message_unref(msg);
+		return VEDBUS_ERR;
+	}
+	dbus_message_unref(msg);
+	dbus_connection_flush(ve->conn);
+	for (i=0;i<ve->count;i++) ve->items[i].changed = 0;
+	return num;
+}
+
+
+static itemT * findItem(VEDBUS_T *ve, const char *path) {
+	int i;
+
+	for (i=0;i<ve->count;i++)
+		if (strcmp(ve->items[i].path,path) == 0) return &ve->items[i];
+	return NULL;
+}
+
+
+// prefix of the items below path, "/" for the root
+static int subtreePrefix(const char *path, char *prefix, int size) {
+	if (strcmp(path,"/") == 0) return snprintf(prefix,size,"/");
+	return snprintf(prefix,size,"%s/",path);
+}
+
+
+// the item as variant or, for a path above items, a{sv} with the items below relative to path
+static DBusMessage * getValue(VEDBUS_T *ve, DBusMessage *msg, const char *path, int text) {
+	DBusMessageIter iter,var,dict;
+	DBusMessage *reply;
+	itemT *item;
+	char prefix[DBUS_MAXIMUM_NAME_LENGTH+2];
+	int i,len;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply) return NULL;
+	dbus_message_iter_init_append(reply,&iter);
+	item = findItem(ve,path);
+	if (item) {
+		if (text) appendText(&iter,item); else appendValue(&iter,item);
+		return reply;
+	}
+
+	len = subtreePrefix(path,prefix,sizeof(prefix));
+	dbus_message_iter_open_container(&iter,DBUS_TYPE_VARIANT,text ? "a{ss}" : "a{sv}",&var);
+	dbus_message_iter_open_container(&var,DBUS_TYPE_ARRAY,text ? "{ss}" : "{sv}",&dict);
+	for (i=0;i<ve->count;i++) {
+		if (strncmp(ve->items[i].path,prefix,len) != 0) continue;
+		if (text) {
+			DBusMessageIter entry;
+			char buf[TEXTLEN];
+			const char *key = ve->items[i].path + len, *p = buf;
+
+			formatText(&ve->items[i],buf);
+			dbus_message_iter_open_container(&dict,DBUS_TYPE_DICT_ENTRY,NULL,&entry);
+			dbus_message_iter_append_basic(&entry,DBUS_TYPE_STRING,&key);
+			dbus_message_iter_append_basic(&entry,DBUS_TYPE_STRING,&p);
+			dbus_message_iter_close_container(&dict,&entry);
+		} else appendDictEntry(&dict,ve->items[i].path + len,&ve->items[i],0);
+	}
+	dbus_message_iter_close_container(&var,&dict);
+	dbus_message_iter_close_container(&iter,&var);
+	return reply;
+}
+
+
+static DBusMessage * getItems(VEDBUS_T *ve, DBusMessage *msg) {
+	DBusMessageIter iter;
+	DBusMessage *reply;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply) return NULL;
+	dbus_message_iter_init_append(reply,&iter);
+	appendItems(ve,&iter,0);
+	return reply;
+}
+
+
+static DBusMessage * setValue(DBusMessage *msg) {
+	DBusMessage *reply;
+	dbus_int32_t rc = -1;				// all items are read only
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply) dbus_message_append_args(reply,DBUS_TYPE_INT32,&rc,DBUS_TYPE_INVALID);
+	return reply;
+}
+
+
+static const char introspectHead[] =
+	DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+	"<node>\n"
+	" <interface name=\"" DBUS_INTERFACE_INTROSPECTABLE "\">\n"
+	"  <method name=\"Introspect\"><arg direction=\"out\" type=\"s\"/></method>\n"
+	" </interface>\n"
+	" <interface name=\"" VEDBUS_INTERFACE "\">\n"
+	"  <method name=\"GetValue\"><arg direction=\"out\" type=\"v\"/></method>\n"
+	"  <method name=\"GetText\"><arg direction=\"out\" type=\"v\"/></method>\n"
+	"  <method name=\"SetValue\"><arg direction=\"in\" type=\"v\"/><arg direction=\"out\" type=\"i\"/></method>\n"
+	"  <method name=\"GetItems\"><arg direction=\"out\" type=\"a{sa{sv}}\"/></method>\n"
+	"  <signal name=\"ItemsChanged\"><arg type=\"a{sa{sv}}\"/></signal>\n"
+	" </interface>\n";
+
+
+// the interfaces and one node per path element below path
+static DBusMessage * introspect(VEDBUS_T *ve, DBusMessage *msg, const char *path) {
+	DBusMessage *reply;
+	char prefix[DBUS_MAXIMUM_NAME_LENGTH+2];
+	char *xml = NULL;
+	size_t xmlLen = 0;
+	const char *name,*end,*other;
+	int i,j,len,nameLen;
+	FILE *f;
+
+	f = open_memstream(&xml,&xmlLen);
+	if (!f) return NULL;
+	fputs(introspectHead,f);
+	len = subtreePrefix(path,prefix,sizeof(prefix));
+	for (i=0;i<ve->count;i++) {
+		if (strncmp(ve->items[i].path,prefix,len) != 0) continue;
+		name = ve->items[i].path + len;
+		end = strchr(name,'/');
+		nameLen = end ? end - name : (int)strlen(name);
+		// only the first item below a node
+		for (j=0;j<i;j++) {
+			other = ve->items[j].path;
+			if ((strncmp(other,prefix,len) == 0) && (strncmp(other+len,name,nameLen) == 0)
+				&& ((other[len+nameLen] == '/') || (other[len+nameLen] == 0))) break;
+		}
+		if (j == i) fprintf(f," <node name=\"%.*s\"/>\n",nameLen,name);
+	}
+	fputs("</node>\n",f);
+	fclose(f);
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply) dbus_message_append_args(reply,DBUS_TYPE_STRING,&xml,DBUS_TYPE_INVALID);
+	free(xml);
+	return reply;
+}
+
+
+static DBusHandlerResult handleMessage(DBusConnection *conn, DBusMessage *msg, void *data) {
+	VEDBUS_T *ve = data;
+	const char *path = dbus_message_get_path(msg);
+	DBusMessage *reply;
+
+	if (dbus_message_is_method_call(msg,DBUS_INTERFACE_INTROSPECTABLE,"Introspect")) reply = introspect(ve,msg,path);
+	else if (dbus_message_is_method_call(msg,VEDBUS_INTERFACE,"GetValue")) reply = getValue(ve,msg,path,0);
+	else if (dbus_message_is_method_call(msg,VEDBUS_INTERFACE,"GetText")) reply = getValue(ve,msg,path,1);
+	else if (dbus_message_is_method_call(msg,VEDBUS_INTERFACE,"GetItems")) reply = getItems(ve,msg);
+	else if (dbus_message_is_method_call(msg,VEDBUS_INTERFACE,"SetValue")) reply = setValue(msg);
+	else return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if (!reply) return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	dbus_connection_send(conn,reply,NULL);
+	dbus_message_unref(reply);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+
+VEDBUS_T * vedbus_init(const char *bus, const char *serviceName) {
+	static const DBusObjectPathVTable vtable = { .message_function = handleMessage };
+	DBusConnection *conn;
+	DBusError err;
+	VEDBUS_T *ve;
+	int rc;
+
+	dbus_error_init(&err);
+	if (strcmp(bus,"system") == 0) conn = dbus_bus_get_private(DBUS_BUS_SYSTEM,&err);
+	else if (strcmp(bus,"session") == 0) conn = dbus_bus_get_private(DBUS_BUS_SESSION,&err);
+	else {
+		conn = dbus_connection_open_private(bus,&err);
+		if (conn && !dbus_bus_register(conn,&err)) {
+			dbus_connection_close(conn);
+			dbus_connection_unref(conn);
+			conn = NULL;
+		}
+	}
+	if (!conn) {
+		LOG(0,"vedbus_init: unable to connect to the %s bus (%s)\n",bus,err.message);
+		dbus_error_free(&err);
+		return NULL;
+	}
+	dbus_connection_set_exit_on_disconnect(conn,FALSE);
+
+	rc = dbus_bus_request_name(conn,serviceName,DBUS_NAME_FLAG_DO_NOT_QUEUE,&err);
+	if (rc != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+		LOG(0,"vedbus_init: unable to register %s (%s)\n",serviceName,dbus_error_is_set(&err) ? err.message : "name in use");
+		dbus_error_free(&err);
+		dbus_connection_close(conn);
+		dbus_connection_unref(conn);
+		return NULL;
+	}
+
+	ve = calloc(1,sizeof(*ve));
+	if (!ve) return NULL;
+	ve->conn = conn;
+	dbus_connection_register_fallback(conn,"/",&vtable,ve);
+	return ve;
+}
+
+
+void vedbus_free(VEDBUS_T *ve) {
+	int i;
+
+	if (!ve) return;
+	dbus_connection_close(ve->conn);
+	dbus_connection_unref(ve->conn);
+	for (i=0;i<ve->count;i++) {
+		free(ve->items[i].path);
+		free(ve->items[i].unit);
+		free(ve->items[i].s);
+	}
+	free(ve->items);
+	free(ve);
+}
+
+
+int vedbus_fd(VEDBUS_T *ve) {
+	int fd = -1;
+
+	dbus_connection_get_unix_fd(ve->conn,&fd);
+	return fd;
+}
+
+
+int vedbus_pending(VEDBUS_T *ve) {
+	return dbus_connection_get_dispatch_status(ve->conn) == DBUS_DISPATCH_DATA_REMAINS;
+}
+
+
+int vedbus_dispatch(VEDBUS_T *ve) {
+	if (!dbus_connection_read_write(ve->conn,0)) return VEDBUS_ERR;		// disconnected
+	// the flush writes the replies but may read further method calls as well
+	do {
+		while (dbus_connection_dispatch(ve->conn) == DBUS_DISPATCH_DATA_REMAINS);
+		dbus_connection_flush(ve->conn);
+	} while (vedbus_pending(ve));
+	if (!dbus_connection_get_is_connected(ve->conn)) return VEDBUS_ERR;
+	return VEDBUS_OK;
+}
+
+#endif // HAVE_DBUS
@@ -0,0 +1,57 @@
+/*
+ * vedbus.h
+ *
+ * minimal Victron Venus OS D-Bus service (interface com.victronenergy.BusItem) using libdbus
+ *
+ * Items are added once with their path, unit and number of decimals, values can be set at any time.
+ * vedbus_flush sends all items changed since the last flush in one ItemsChanged signal on /, there
+ * are no PropertiesChanged signals per item. GetValue, GetText and GetItems are answered from the
+ * item table, SetValue is refused.
+ *
+ *     VEDBUS_T *ve = vedbus_init("system", "com.victronenergy.battery.ttyUSB0");
+ *     int v = vedbus_addItem(ve, "/Dc/0/Voltage", "V", 2);
+ *     vedbus_setDouble(ve, v, 52.1);
+ *     vedbus_flush(ve);
+ *     poll for input on vedbus_fd(ve), then vedbus_dispatch(ve)
+ *
+ * libdbus reads incoming messages during vedbus_flush as well, check vedbus_pending before waiting
+ * on the fd, these calls would otherwise wait for the next message.
+ *
+ * Only available if built with libdbus (HAVE_DBUS, see Makefile). Not thread safe, all calls
+ * for one service have to be made by the same thread.
+ */
+
+#ifndef VEDBUS_H_INCLUDED
+#define VEDBUS_H_INCLUDED
+
+#define VEDBUS_OK 0
+#define VEDBUS_ERR -1
+
+#define VEDBUS_INTERFACE "com.victronenergy.BusItem"
+
+typedef struct VEDBUS_S VEDBUS_T;
+
+// bus is "system", "session" or a bus address (e.g. unix:path=/tmp/bus), NULL if the name is taken
+VEDBUS_T * vedbus_init(const char *bus, const char *serviceName);
+void vedbus_free(VEDBUS_T *ve);
+
+// returns the item number or VEDBUS_ERR, the value is invalid until set
+int vedbus_addItem(VEDBUS_T *ve, const char *path, const char *unit, int decimals);
+
+// an item is sent by the next vedbus_flush only if the value (rounded to decimals) has changed
+void vedbus_setInt(VEDBUS_T *ve, int item, int value);
+void vedbus_setDouble(VEDBUS_T *ve, int item, double value);
+void vedbus_setString(VEDBUS_T *ve, int item, const char *value);
+void vedbus_setInvalid(VEDBUS_T *ve, int item);
+
+// send the changed items, returns the number of items sent or VEDBUS_ERR
+int vedbus_flush(VEDBUS_T *ve);
+
+// file descriptor to wait on for input and handle pending method calls without blocking,
+// the replies are written before vedbus_dispatch returns
+int vedbus_fd(VEDBUS_T *ve);
+int vedbus_dispatch(VEDBUS_T *ve);
+// 1 if messages have already been read and wait for vedbus_dispatch, the fd will not be readable for them
+int vedbus_pending(VEDBUS_T *ve);
+
+#endif // VEDBUS_H_INCLUDED